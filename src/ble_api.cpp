@@ -1,4 +1,6 @@
 #include "ble_api.h"
+#include "link_registry.h"
+#include "presence.h"
 // #include <freertos/FreeRTOS.h>
 
 bool BLEApi::_isReady = false;
@@ -10,9 +12,8 @@ BLEDeviceEvent BLEApi::_cbOnDeviceDisconnected = nullptr;
 BLECharacteristicNotification BLEApi::_cbOnCharacteristicNotification = nullptr;
 BLEAdvertisedDeviceCallbacks *BLEApi::_advertisedDeviceCallback = nullptr;
 BLEClientCallbacks *BLEApi::_clientCallback = nullptr;
-std::map<BLEPeripheralID, uint8_t> BLEApi::addressTypes;
-BLEConnection BLEApi::connections[MAX_CLIENT_CONNECTIONS];
-uint8_t BLEApi::activeConnections = 0;
+BLEAddressTypes BLEApi::addressTypes;
+SemaphoreHandle_t BLEApi::connectLock = nullptr;
 
 class myAdvertisedDeviceCallbacks : public NimBLEAdvertisedDeviceCallbacks
 {
@@ -57,6 +58,8 @@ void BLEApi::init()
     bleScan->setInterval(1250); // 1349
     bleScan->setWindow(650);    // 449
     _clientCallback = new myClientCallbacks();
+    connectLock = xSemaphoreCreateMutex();
+    Presence::init();
     // TODO: maybe do some pre-descovery to get address types of devices around us
     // in case ESP was rebooted and clients try to connect before doing a scan
     _isReady = true;
@@ -130,26 +133,52 @@ void BLEApi::onCharacteristicNotification(BLECharacteristicNotification cb)
 }
 
 /**
- * Connect to a device
- * @param address device address
+ * Connect to a device. Connects from different tasks run one after the other.
+ * @param id device address
+ * @param attempts connects tried 1s apart
+ * @param timeout s each attempt can take
  */
-bool BLEApi::connect(BLEPeripheralID id)
+bool BLEApi::connect(BLEPeripheralID id, uint8_t attempts, uint8_t timeout)
 {
   NimBLEClient *peripheral = getConnection(id);
   if (peripheral != nullptr)
   {
     return true;
   }
+  xSemaphoreTake(connectLock, portMAX_DELAY);
+  bool connected = connectLocked(id, attempts, timeout);
+  xSemaphoreGive(connectLock);
+  return connected;
+}
+
+/**
+ * Connect to a device, caller holds connectLock
+ */
+bool BLEApi::connectLocked(BLEPeripheralID id, uint8_t attempts, uint8_t timeout)
+{
+  NimBLEClient *peripheral = getConnection(id);
+  if (peripheral != nullptr)
+  {
+    // connected by another task while waiting for the lock
+    return true;
+  }
+  // the link slot is usually taken by the API already, it is kept until the connect is done
+  Link *link = LinkRegistry::acquire(id, true);
+  if (link == nullptr)
+  {
+    log_e("All %u links are in use", MAX_CLIENT_CONNECTIONS);
+    return false;
+  }
   BLEApi::stopScan();
 
   // get MAC address from id
   NimBLEAddress address = addressFromId(id);
 
   bool connected = false;
-  int8_t retry = 5;
+  int8_t retry = attempts;
   log_i("Connect attempt start");
   peripheral = NimBLEDevice::createClient();
-  peripheral->setConnectTimeout(10);
+  peripheral->setConnectTimeout(timeout);
   do
   {
     // TODO: sometimes the connect fails and remains hanging in the semaphore, patch BLE lib ?
@@ -159,6 +188,7 @@ bool BLEApi::connect(BLEPeripheralID id)
     // [E][BLEClient.cpp:214] gattClientEventHandler(): Failed to connect, status=Unknown ESP_ERR error
     // Retry connection in 1s
     // ----------------------------
+    Metrics::inc(METRIC_CONNECT_ATTEMPTS);
     connected = peripheral->connect(address);
     // Serial.println("Connect attempt ended");
     retry--;
@@ -180,12 +210,20 @@ bool BLEApi::connect(BLEPeripheralID id)
   if (connected)
   {
     log_i("Connected to [%s][%d]\n", address.toString().c_str(), retry);
-    addConnection(id, peripheral);
+    Memory::adjust(MEMORY_TAG_BLE, ESP_GW_BLE_CLIENT_MEMORY);
+    if (!link->values.init())
+    {
+      log_w("No memory for the value cache");
+    }
+    link->connectedAt = millis();
+    LinkRegistry::connectDone(link, peripheral);
   }
   else
   {
     log_d("Removing peripheral");
+    LinkRegistry::connectDone(link, nullptr);
     NimBLEDevice::deleteClient(peripheral);
+    Metrics::inc(METRIC_CONNECT_FAILURES);
     log_e("Could not connect to [%s][%d]\n", address.toString().c_str(), retry);
   }
   return connected;
@@ -244,7 +282,11 @@ std::vector<NimBLERemoteCharacteristic *> *BLEApi::discoverCharacteristics(BLEPe
   return nullptr;
 }
 
-std::string BLEApi::readCharacteristic(BLEPeripheralID id, std::string service, std::string characteristic)
+/**
+ * Read a characteristic value
+ * @param maxAge ms, a value read or notified more recently is returned without reading it again. If 0, it is always read
+ */
+std::string BLEApi::readCharacteristic(BLEPeripheralID id, std::string service, std::string characteristic, uint32_t maxAge)
 {
   NimBLEClient *peripheral = getConnection(id);
   if (peripheral != nullptr)
@@ -257,9 +299,25 @@ std::string BLEApi::readCharacteristic(BLEPeripheralID id, std::string service,
     if (remoteService != nullptr)
     {
       NimBLERemoteCharacteristic *remoteCharacteristic = remoteService->getCharacteristic(BLEUUID(characteristic));
-      if (remoteCharacteristic->canRead())
+      if (remoteCharacteristic != nullptr && remoteCharacteristic->canRead())
       {
-        return remoteCharacteristic->readValue();
+        ValueCache *values = getValueCache(id);
+        std::string value;
+        if (maxAge > 0 && values != nullptr)
+        {
+          if (values->lookup(remoteCharacteristic->getHandle(), maxAge, value))
+          {
+            Metrics::inc(METRIC_VALUE_CACHE_HITS);
+            return value;
+          }
+          Metrics::inc(METRIC_VALUE_CACHE_MISSES);
+        }
+        value = remoteCharacteristic->readValue();
+        if (values != nullptr && value.length() > 0)
+        {
+          values->store(remoteCharacteristic->getHandle(), (const uint8_t *)value.data(), value.length());
+        }
+        return value;
       }
     }
   }
@@ -277,7 +335,7 @@ bool BLEApi::notifyCharacteristic(BLEPeripheralID id, std::string service, std::
       if (remoteService != nullptr)
       {
         NimBLERemoteCharacteristic *remoteCharacteristic = remoteService->getCharacteristic(BLEUUID(characteristic));
-        if (remoteCharacteristic->canNotify())
+        if (remoteCharacteristic != nullptr && remoteCharacteristic->canNotify())
         {
           if (notify)
           {
@@ -308,6 +366,11 @@ bool BLEApi::writeCharacteristic(BLEPeripheralID id, std::string service, std::s
         NimBLERemoteCharacteristic *remoteCharacteristic = remoteService->getCharacteristic(BLEUUID(characteristic));
         if (remoteCharacteristic->canWrite() || remoteCharacteristic->canWriteNoResponse())
         {
+          ValueCache *values = getValueCache(id);
+          if (values != nullptr)
+          {
+            values->invalidate(remoteCharacteristic->getHandle());
+          }
           remoteCharacteristic->writeValue(data, length, !withoutResponse);
           return true;
         }
@@ -322,10 +385,18 @@ bool BLEApi::writeCharacteristic(BLEPeripheralID id, std::string service, std::s
  */
 void BLEApi::_onDeviceFoundProxy(NimBLEAdvertisedDevice *advertisedDevice)
 {
-  addressTypes[idFromAddress(advertisedDevice->getAddress())] = advertisedDevice->getAddressType();
+  Metrics::inc(METRIC_ADV_RECEIVED);
+  BLEPeripheralID id = idFromAddress(advertisedDevice->getAddress());
+  if (addressTypes.size() >= ESP_GW_MAX_DEVICES && addressTypes.find(id) == addressTypes.end())
+  {
+    // table is full, make room by forgetting an arbitrary device
+    addressTypes.erase(addressTypes.begin());
+  }
+  addressTypes[id] = advertisedDevice->getAddressType();
+  Presence::update(advertisedDevice, id);
   if (_cbOnDeviceFound)
   {
-    _cbOnDeviceFound(advertisedDevice, idFromAddress(advertisedDevice->getAddress()));
+    _cbOnDeviceFound(advertisedDevice, id);
   }
 }
 
@@ -357,6 +428,7 @@ void BLEApi::_onDeviceInteractionProxy(BLEPeripheralID id, bool connected)
       vTaskDelay(1000 / portTICK_PERIOD_MS);
       Serial.println("Dealocating memory");
       NimBLEDevice::deleteClient(peripheral);
+      Memory::adjust(MEMORY_TAG_BLE, -ESP_GW_BLE_CLIENT_MEMORY);
       meminfo();
     }
   }
@@ -371,66 +443,62 @@ void BLEApi::_onScanFinished(BLEScanResults results)
 
 void BLEApi::_onCharacteristicNotification(NimBLERemoteCharacteristic *characteristic, uint8_t *data, size_t length, bool isNotify)
 {
+  Metrics::inc(METRIC_NOTIFICATIONS);
   if (_cbOnCharacteristicNotification != nullptr)
   {
+    int64_t received = Latency::now();
     // patch required, see https://github.com/espressif/arduino-esp32/issues/3367
     NimBLERemoteService *service = characteristic->getRemoteService();
     NimBLEClient *client = service->getClient();
+    BLEPeripheralID id = idFromAddress(client->getPeerAddress());
+    Link *link = LinkRegistry::find(id);
+    if (link != nullptr)
+    {
+      link->values.store(characteristic->getHandle(), data, length);
+    }
     std::string dataStr = std::string((char *)data, length);
     _cbOnCharacteristicNotification(
-        idFromAddress(client->getPeerAddress()),
+        id,
         service->getUUID().to128().toString(),
         characteristic->getUUID().to128().toString(),
         dataStr,
         isNotify);
-  }
-}
-
-bool BLEApi::addConnection(BLEPeripheralID id, NimBLEClient *device)
-{
-  if (activeConnections < MAX_CLIENT_CONNECTIONS)
-  {
-    for (auto i = 0; i < MAX_CLIENT_CONNECTIONS; i++)
+    uint32_t elapsed = Latency::now() - received;
+    Latency::record(LATENCY_OP_NOTIFICATION, LATENCY_STAGE_TOTAL, elapsed);
+    if (link != nullptr)
     {
-      if (connections[i].device == nullptr)
+      link->notifications++;
+      if (elapsed > link->maxNotificationUs)
       {
-        connections[i].device = device;
-        connections[i].id = id;
-        activeConnections++;
-        return true;
+        link->maxNotificationUs = elapsed;
       }
     }
   }
-  return false;
 }
 
 NimBLEClient *BLEApi::getConnection(BLEPeripheralID id)
 {
-  if (activeConnections > 0)
-  {
-    for (auto i = 0; i < MAX_CLIENT_CONNECTIONS; i++)
-    {
-      if (connections[i].id == id)
-      {
-        return connections[i].device;
-      }
-    }
-  }
-  return nullptr;
+  Link *link = LinkRegistry::find(id);
+  return link != nullptr ? link->device : nullptr;
+}
+
+ValueCache *BLEApi::getValueCache(BLEPeripheralID id)
+{
+  Link *link = LinkRegistry::find(id);
+  return link != nullptr && link->device != nullptr ? &link->values : nullptr;
 }
 
+/**
+ * Peripheral disconnected, the link slot stays while API sessions hold it
+ */
 void BLEApi::delConnection(BLEPeripheralID id)
 {
-  if (activeConnections > 0)
+  Link *link = LinkRegistry::find(id);
+  if (link != nullptr)
   {
-    for (auto i = 0; i < MAX_CLIENT_CONNECTIONS; i++)
-    {
-      if (connections[i].id == id)
-      {
-        connections[i].device = nullptr;
-        activeConnections--;
-      }
-    }
+    link->device = nullptr;
+    link->values.release();
+    LinkRegistry::release(link);
   }
 }
 
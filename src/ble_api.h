@@ -4,30 +4,51 @@
 #define CONFIG_BT_NIMBLE_ROLE_PERIPHERAL_DISABLED
 #define CONFIG_BT_NIMBLE_ROLE_BROADCASTER_DISABLED
 
-#ifndef MAX_CLIENT_CONNECTIONS
-#define MAX_CLIENT_CONNECTIONS 5
+// number of known device address types kept for connecting
+#ifndef ESP_GW_MAX_DEVICES
+#ifdef BOARD_HAS_PSRAM
+#define ESP_GW_MAX_DEVICES 1024
+#else
+#define ESP_GW_MAX_DEVICES 128
+#endif
 #endif
 
-#define CONFIG_BT_NIMBLE_MAX_CONNECTIONS MAX_CLIENT_CONNECTIONS
+// NimBLE heap accounted per connected client in the memory stats (client, GATT database, host connection state).
+// A fixed estimate: free heap deltas across a connect also catch what other tasks allocate meanwhile.
+#ifndef ESP_GW_BLE_CLIENT_MEMORY
+#define ESP_GW_BLE_CLIENT_MEMORY 4096
+#endif
 
 #include <Arduino.h>
 #include <NimBLEDevice.h>
 #include <esp_bt_defs.h>
 #include <functional>
 #include "util.h"
+#include "metrics.h"
+#include "latency.h"
+#include "memory_stats.h"
+#include "value_cache.h"
+
+// concurrent peripheral links. The NimBLE host sources are compiled on their own, so its connection count
+// (nimconfig.h, 3 by default) can only be raised with -DCONFIG_BT_NIMBLE_MAX_CONNECTIONS in build_flags,
+// and the controller limit (CONFIG_BTDM_CTRL_BLE_MAX_CONN in the framework sdkconfig) along with it.
+#ifndef MAX_CLIENT_CONNECTIONS
+#define MAX_CLIENT_CONNECTIONS CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+#endif
+
+static_assert(MAX_CLIENT_CONNECTIONS <= CONFIG_BT_NIMBLE_MAX_CONNECTIONS, "more links than NimBLE host connections");
+#ifdef CONFIG_BTDM_CTRL_BLE_MAX_CONN_EFF
+static_assert(MAX_CLIENT_CONNECTIONS <= CONFIG_BTDM_CTRL_BLE_MAX_CONN_EFF, "more links than BLE controller connections");
+#endif
 
 class myAdvertisedDeviceCallbacks;
 class myClientCallbacks;
 
 typedef std::array<uint8_t, ESP_BD_ADDR_LEN> BLEPeripheralID;
+typedef std::map<BLEPeripheralID, uint8_t, std::less<BLEPeripheralID>, LargeAllocator<std::pair<const BLEPeripheralID, uint8_t>, MEMORY_TAG_BLE>> BLEAddressTypes;
 typedef std::function<void(NimBLEAdvertisedDevice *advertisedDevice, BLEPeripheralID id)> BLEDeviceFound;
 typedef std::function<void(BLEPeripheralID id)> BLEDeviceEvent;
 typedef std::function<void(BLEPeripheralID id, std::string service, std::string characteristic, std::string data, bool isNotify)> BLECharacteristicNotification;
-struct BLEConnection
-{
-  BLEPeripheralID id;
-  NimBLEClient *device;
-};
 
 class BLEApi
 {
@@ -40,11 +61,11 @@ public:
   static void onDeviceConnected(BLEDeviceEvent cb);
   static void onDeviceDisconnected(BLEDeviceEvent cb);
   static void onCharacteristicNotification(BLECharacteristicNotification cb);
-  static bool connect(BLEPeripheralID);
+  static bool connect(BLEPeripheralID id, uint8_t attempts = 5, uint8_t timeout = 10);
   static bool disconnect(BLEPeripheralID);
   static std::vector<NimBLERemoteService *> *discoverServices(BLEPeripheralID id);
   static std::vector<NimBLERemoteCharacteristic *> *discoverCharacteristics(BLEPeripheralID id, std::string service);
-  static std::string readCharacteristic(BLEPeripheralID id, std::string service, std::string characteristic);
+  static std::string readCharacteristic(BLEPeripheralID id, std::string service, std::string characteristic, uint32_t maxAge = 0);
   static bool notifyCharacteristic(BLEPeripheralID id, std::string service, std::string characteristic, bool notify = true);
   static bool writeCharacteristic(BLEPeripheralID id, std::string service, std::string characteristic, uint8_t *data, size_t length, bool withoutResponse = true);
   static BLEPeripheralID idFromAddress(NimBLEAddress address);
@@ -60,7 +81,9 @@ private:
   static NimBLEAdvertisedDeviceCallbacks *_advertisedDeviceCallback;
   static NimBLEClientCallbacks *_clientCallback;
   static NimBLEScan *bleScan;
-  static std::map<BLEPeripheralID, uint8_t> addressTypes;
+  static BLEAddressTypes addressTypes;
+  static SemaphoreHandle_t connectLock;
+  static bool connectLocked(BLEPeripheralID id, uint8_t attempts, uint8_t timeout);
   static void _onScanFinished(NimBLEScanResults results);
   static void _onCharacteristicNotification(NimBLERemoteCharacteristic *characteristic, uint8_t *data, size_t length, bool isNotify);
   static void _onDeviceFoundProxy(NimBLEAdvertisedDevice *advertisedDevice);
@@ -69,10 +92,8 @@ private:
   static BLEDeviceEvent _cbOnDeviceConnected;
   static BLEDeviceEvent _cbOnDeviceDisconnected;
   static BLECharacteristicNotification _cbOnCharacteristicNotification;
-  static BLEConnection connections[MAX_CLIENT_CONNECTIONS];
-  static uint8_t activeConnections;
-  static bool addConnection(BLEPeripheralID id, NimBLEClient *device);
   static NimBLEClient *getConnection(BLEPeripheralID id);
+  static ValueCache *getValueCache(BLEPeripheralID id);
   static void delConnection(BLEPeripheralID id);
 };
 
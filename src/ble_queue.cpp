@@ -0,0 +1,175 @@
+#include "ble_queue.h"
+
+BLEQueue::BLEQueue() : head(0), count(0), deficit(0), tokens(ESP_GW_BLE_BURST * 1000), refilled(millis()), stats()
+{
+}
+
+/**
+ * Relative air time of an operation, connects and discovery take several procedures
+ */
+uint8_t BLEQueue::cost(LatencyOp op)
+{
+  switch (op)
+  {
+  case LATENCY_OP_CONNECT:
+    return BLE_OP_MAX_COST;
+  case LATENCY_OP_DISCOVER:
+    return 2;
+  default:
+    return 1;
+  }
+}
+
+// ms to fill an empty bucket
+#define BLE_REFILL_MS ((ESP_GW_BLE_BURST * 1000 + ESP_GW_BLE_RATE - 1) / ESP_GW_BLE_RATE)
+
+void BLEQueue::refill()
+{
+  uint32_t now = millis();
+  uint32_t elapsed = now - refilled;
+  // a full bucket is reached by then, longer idle times would overflow the product
+  if (elapsed > BLE_REFILL_MS)
+  {
+    elapsed = BLE_REFILL_MS;
+  }
+  tokens += elapsed * ESP_GW_BLE_RATE;
+  if (tokens > ESP_GW_BLE_BURST * 1000)
+  {
+    tokens = ESP_GW_BLE_BURST * 1000;
+  }
+  refilled = now;
+}
+
+/**
+ * Take a token for one operation
+ * @return false if the client is over its rate
+ */
+bool BLEQueue::take()
+{
+  refill();
+  if (tokens < 1000)
+  {
+    return false;
+  }
+  tokens -= 1000;
+  return true;
+}
+
+/**
+ * ms until the next token
+ */
+uint32_t BLEQueue::retryAfter()
+{
+  refill();
+  return tokens >= 1000 ? 0 : (1000 - tokens + ESP_GW_BLE_RATE - 1) / ESP_GW_BLE_RATE;
+}
+
+/**
+ * Queue an operation, the queue owns its command buffer from now on
+ * @return false if the queue is full
+ */
+bool BLEQueue::push(const BLEOp &op)
+{
+  if (count == ESP_GW_BLE_QUEUE_SIZE)
+  {
+    return false;
+  }
+  ops[(head + count) % ESP_GW_BLE_QUEUE_SIZE] = op;
+  count++;
+  stats.queued++;
+  if (count > stats.maxDepth)
+  {
+    stats.maxDepth = count;
+  }
+  return true;
+}
+
+/**
+ * Deficit round robin: the client is credited the quantum once per turn and
+ * runs its oldest operation when the cost fits, the caller owns the command buffer
+ * @return false if the turn is over
+ */
+bool BLEQueue::next(BLEOp &op, bool turn)
+{
+  if (count == 0)
+  {
+    // idle clients do not save up credit
+    deficit = 0;
+    return false;
+  }
+  if (turn)
+  {
+    deficit += ESP_GW_BLE_QUANTUM;
+  }
+  if (ops[head].cost > deficit)
+  {
+    return false;
+  }
+  op = ops[head];
+  head = (head + 1) % ESP_GW_BLE_QUEUE_SIZE;
+  count--;
+  deficit = count == 0 ? 0 : deficit - op.cost;
+
+  uint32_t waitUs = Latency::now() - op.received;
+  stats.executed++;
+  stats.totalWaitUs += waitUs;
+  if (waitUs > stats.maxWaitUs)
+  {
+    stats.maxWaitUs = waitUs;
+  }
+  return true;
+}
+
+void BLEQueue::reject()
+{
+  stats.rejected++;
+}
+
+/**
+ * Drop all waiting operations and reset the rate limit, the slot is used by a new client
+ */
+void BLEQueue::clear()
+{
+  for (uint8_t i = 0; i < count; i++)
+  {
+    Memory::release(ops[(head + i) % ESP_GW_BLE_QUEUE_SIZE].command);
+  }
+  head = 0;
+  count = 0;
+  deficit = 0;
+  tokens = ESP_GW_BLE_BURST * 1000;
+  refilled = millis();
+  stats = BLEQueueStats();
+}
+
+uint8_t BLEQueue::depth()
+{
+  return count;
+}
+
+/**
+ * Operations waiting for a peripheral
+ */
+uint8_t BLEQueue::pending(BLEPeripheralID id)
+{
+  uint8_t pending = 0;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    if (ops[(head + i) % ESP_GW_BLE_QUEUE_SIZE].id == id)
+    {
+      pending++;
+    }
+  }
+  return pending;
+}
+
+void BLEQueue::toJson(JsonObject out)
+{
+  out["queued"] = stats.queued;
+  out["executed"] = stats.executed;
+  out["rejected"] = stats.rejected;
+  out["depth"] = count;
+  out["maxDepth"] = stats.maxDepth;
+  out["maxWaitUs"] = stats.maxWaitUs;
+  out["avgWaitUs"] = stats.executed > 0 ? (uint32_t)(stats.totalWaitUs / stats.executed) : 0;
+}
@@ -0,0 +1,96 @@
+#ifndef ESP_GW_BLE_QUEUE_H
+#define ESP_GW_BLE_QUEUE_H
+
+// BLE operations a client can have waiting
+#ifndef ESP_GW_BLE_QUEUE_SIZE
+#ifdef BOARD_HAS_PSRAM
+#define ESP_GW_BLE_QUEUE_SIZE 16
+#else
+#define ESP_GW_BLE_QUEUE_SIZE 4
+#endif
+#endif
+
+// BLE operations waiting for one peripheral, all clients together
+#ifndef ESP_GW_BLE_PERIPHERAL_DEPTH
+#define ESP_GW_BLE_PERIPHERAL_DEPTH (ESP_GW_BLE_QUEUE_SIZE * 3 / 2)
+#endif
+
+// token bucket per client, sustained operations per second and burst
+#ifndef ESP_GW_BLE_RATE
+#define ESP_GW_BLE_RATE 20
+#endif
+
+#ifndef ESP_GW_BLE_BURST
+#define ESP_GW_BLE_BURST 10
+#endif
+
+// cost credited to a client on each deficit round robin turn
+#ifndef ESP_GW_BLE_QUANTUM
+#define ESP_GW_BLE_QUANTUM 2
+#endif
+
+#define BLE_OP_MAX_COST 4 // connect, see BLEQueue::cost()
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "memory_stats.h"
+#include "latency.h"
+#include "ble_api.h"
+#include "noble_commands.h"
+
+static_assert(ESP_GW_BLE_QUANTUM > 0, "deficit round robin needs a quantum");
+
+/**
+ * Command waiting for the BLE host, kept as filtered MessagePack until it runs
+ */
+struct BLEOp
+{
+  const NobleAction *action;
+  BLEPeripheralID id;
+  uint8_t cost;
+  int64_t received;
+  uint8_t *command;
+  size_t length;
+};
+
+struct BLEQueueStats
+{
+  uint32_t queued;
+  uint32_t executed;
+  uint32_t rejected;
+  uint16_t maxDepth;
+  uint32_t maxWaitUs;
+  uint64_t totalWaitUs;
+};
+
+/**
+ * Bounded queue of the BLE operations of one WebSocket client with its rate limit and
+ * deficit round robin state. Only used from the API task.
+ */
+class BLEQueue
+{
+public:
+  BLEQueue();
+  static uint8_t cost(LatencyOp op);
+  bool take();
+  uint32_t retryAfter();
+  bool push(const BLEOp &op);
+  bool next(BLEOp &op, bool turn);
+  void reject();
+  void clear();
+  uint8_t depth();
+  uint8_t pending(BLEPeripheralID id);
+  void toJson(JsonObject stats);
+
+private:
+  BLEOp ops[ESP_GW_BLE_QUEUE_SIZE];
+  uint8_t head;
+  uint8_t count;
+  uint16_t deficit;
+  uint32_t tokens; // thousandths of an operation
+  uint32_t refilled;
+  BLEQueueStats stats;
+  void refill();
+};
+
+#endif
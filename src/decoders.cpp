@@ -0,0 +1,271 @@
+#include "decoders.h"
+#include "hex.h"
+#include <stdio.h>
+#include <string>
+
+static uint16_t readUint16BE(const uint8_t *data)
+{
+  return (uint16_t)data[0] << 8 | data[1];
+}
+
+static uint16_t readUint16LE(const uint8_t *data)
+{
+  return (uint16_t)data[1] << 8 | data[0];
+}
+
+static uint32_t readUint32BE(const uint8_t *data)
+{
+  return (uint32_t)readUint16BE(data) << 16 | readUint16BE(data + 2);
+}
+
+static void setHex(JsonObject out, const char *key, const uint8_t *data, size_t length)
+{
+  char hex[length * 2 + 1];
+  Hex::encode(data, length, hex);
+  out[key] = (char *)hex;
+}
+
+/**
+ * Apple iBeacon: type 0x02, length 0x15, proximity UUID, major, minor, measured power
+ */
+static bool decodeIBeacon(const uint8_t *data, size_t length, JsonObject out)
+{
+  if (length != 23 || data[0] != 0x02 || data[1] != 0x15)
+  {
+    return false;
+  }
+  const uint8_t *uuid = data + 2;
+  char uuidStr[37];
+  snprintf(uuidStr, sizeof(uuidStr), "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+           uuid[0], uuid[1], uuid[2], uuid[3], uuid[4], uuid[5], uuid[6], uuid[7],
+           uuid[8], uuid[9], uuid[10], uuid[11], uuid[12], uuid[13], uuid[14], uuid[15]);
+  out["uuid"] = (char *)uuidStr;
+  out["major"] = readUint16BE(data + 18);
+  out["minor"] = readUint16BE(data + 20);
+  out["txPower"] = (int8_t)data[22];
+  return true;
+}
+
+/**
+ * Eddystone UID, URL and TLM (unencrypted) frames
+ */
+static bool decodeEddystone(const uint8_t *data, size_t length, JsonObject out)
+{
+  static const char *schemes[] = {"http://www.", "https://www.", "http://", "https://"};
+  static const char *expansions[] = {".com/", ".org/", ".edu/", ".net/", ".info/", ".biz/", ".gov/",
+                                     ".com", ".org", ".edu", ".net", ".info", ".biz", ".gov"};
+  if (length < 2)
+  {
+    return false;
+  }
+  switch (data[0])
+  {
+  case 0x00:
+    if (length < 18)
+    {
+      return false;
+    }
+    out["frame"] = "uid";
+    out["txPower"] = (int8_t)data[1];
+    setHex(out, "namespace", data + 2, 10);
+    setHex(out, "instance", data + 12, 6);
+    return true;
+  case 0x10:
+  {
+    if (length < 3 || data[2] >= sizeof(schemes) / sizeof(schemes[0]))
+    {
+      return false;
+    }
+    std::string url = schemes[data[2]];
+    for (size_t i = 3; i < length; i++)
+    {
+      if (data[i] < sizeof(expansions) / sizeof(expansions[0]))
+      {
+        url += expansions[data[i]];
+      }
+      else if (data[i] > 0x20 && data[i] < 0x7F)
+      {
+        url += (char)data[i];
+      }
+      else
+      {
+        return false;
+      }
+    }
+    out["frame"] = "url";
+    out["txPower"] = (int8_t)data[1];
+    out["url"] = url;
+    return true;
+  }
+  case 0x20:
+    if (length < 14 || data[1] != 0x00)
+    {
+      return false;
+    }
+    out["frame"] = "tlm";
+    out["battery"] = readUint16BE(data + 2); // mV
+    if (readUint16BE(data + 4) != 0x8000)
+    {
+      // signed 8.8 fixed point
+      out["temperature"] = (int16_t)readUint16BE(data + 4) / 256.0;
+    }
+    out["advCount"] = readUint32BE(data + 6);
+    out["uptime"] = readUint32BE(data + 10) / 10; // s
+    return true;
+  default:
+    return false;
+  }
+}
+
+/**
+ * Ruuvi data format 5 (RAWv2), fields holding their "not available" value are left out
+ */
+static bool decodeRuuvi(const uint8_t *data, size_t length, JsonObject out)
+{
+  if (length < 24 || data[0] != 0x05)
+  {
+    return false;
+  }
+  if (readUint16BE(data + 1) != 0x8000)
+  {
+    out["temperature"] = (int16_t)readUint16BE(data + 1) * 0.005;
+  }
+  if (readUint16BE(data + 3) != 0xFFFF)
+  {
+    out["humidity"] = readUint16BE(data + 3) * 0.0025;
+  }
+  if (readUint16BE(data + 5) != 0xFFFF)
+  {
+    out["pressure"] = readUint16BE(data + 5) + 50000; // Pa
+  }
+  if (readUint16BE(data + 7) != 0x8000 && readUint16BE(data + 9) != 0x8000 && readUint16BE(data + 11) != 0x8000)
+  {
+    JsonArray acceleration = out.createNestedArray("acceleration"); // mG
+    acceleration.add((int16_t)readUint16BE(data + 7));
+    acceleration.add((int16_t)readUint16BE(data + 9));
+    acceleration.add((int16_t)readUint16BE(data + 11));
+  }
+  uint16_t power = readUint16BE(data + 13);
+  if (power >> 5 != 0x7FF)
+  {
+    out["battery"] = (power >> 5) + 1600; // mV
+  }
+  if ((power & 0x1F) != 0x1F)
+  {
+    out["txPower"] = (power & 0x1F) * 2 - 40;
+  }
+  if (data[15] != 0xFF)
+  {
+    out["movements"] = data[15];
+  }
+  if (readUint16BE(data + 16) != 0xFFFF)
+  {
+    out["sequence"] = readUint16BE(data + 16);
+  }
+  return true;
+}
+
+/**
+ * Thermometer custom formats on the environmental sensing service, told apart by length:
+ * ATC1441 (13 bytes, big endian, 0.1 °C and 1 % units) and
+ * pvvx (15 bytes, little endian, 0.01 °C and 0.01 % units, plus flags)
+ */
+static bool decodeAtc(const uint8_t *data, size_t length, JsonObject out)
+{
+  switch (length)
+  {
+  case 13:
+    out["temperature"] = (int16_t)readUint16BE(data + 6) / 10.0;
+    out["humidity"] = data[8];
+    out["batteryLevel"] = data[9]; // %
+    out["battery"] = readUint16BE(data + 10); // mV
+    out["counter"] = data[12];
+    return true;
+  case 15:
+    out["temperature"] = (int16_t)readUint16LE(data + 6) / 100.0;
+    out["humidity"] = readUint16LE(data + 8) / 100.0;
+    out["battery"] = readUint16LE(data + 10); // mV
+    out["batteryLevel"] = data[12]; // %
+    out["counter"] = data[13];
+    out["flags"] = data[14];
+    return true;
+  default:
+    return false;
+  }
+}
+
+/**
+ * Decoder table, must be kept sorted by source then key as it is binary searched
+ */
+struct DecoderTable
+{
+  static constexpr Decoder table[] = {
+      {DECODER_MANUFACTURER, 0x004C, "ibeacon", decodeIBeacon},
+      {DECODER_MANUFACTURER, 0x0499, "ruuvi", decodeRuuvi},
+      {DECODER_SERVICE_DATA, 0x181A, "atc", decodeAtc},
+      {DECODER_SERVICE_DATA, 0xFEAA, "eddystone", decodeEddystone},
+  };
+  static constexpr size_t count = sizeof(table) / sizeof(table[0]);
+};
+
+constexpr Decoder DecoderTable::table[];
+
+constexpr bool decoderBefore(const Decoder &a, const Decoder &b)
+{
+  return a.source < b.source || (a.source == b.source && a.key < b.key);
+}
+
+constexpr bool decodersSorted(const Decoder *table, size_t count)
+{
+  return count < 2 || (decoderBefore(table[0], table[1]) && decodersSorted(table + 1, count - 1));
+}
+
+static_assert(decodersSorted(DecoderTable::table, DecoderTable::count), "DecoderTable::table must be sorted by source and key");
+
+/**
+ * Find the decoder of a company identifier or service data UUID
+ */
+const Decoder *Decoders::find(DecoderSource source, uint16_t key)
+{
+  Decoder wanted = {source, key, nullptr, nullptr};
+  size_t low = 0;
+  size_t high = DecoderTable::count;
+  while (low < high)
+  {
+    size_t middle = (low + high) / 2;
+    const Decoder &decoder = DecoderTable::table[middle];
+    if (decoder.source == source && decoder.key == key)
+    {
+      return &decoder;
+    }
+    if (decoderBefore(wanted, decoder))
+    {
+      high = middle;
+    }
+    else
+    {
+      low = middle + 1;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Decode the payload that follows a company identifier or service data UUID into out
+ * @return the decoder that matched, nullptr if the format is unknown or the payload invalid (out is left empty)
+ */
+const Decoder *Decoders::decode(DecoderSource source, uint16_t key, const uint8_t *data, size_t length, JsonObject out)
+{
+  const Decoder *decoder = find(source, key);
+  if (decoder == nullptr)
+  {
+    return nullptr;
+  }
+  if (!decoder->decode(data, length, out))
+  {
+    out.clear();
+    return nullptr;
+  }
+  out["format"] = decoder->format;
+  return decoder;
+}
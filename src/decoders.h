@@ -0,0 +1,42 @@
+#ifndef ESP_GW_DECODERS_H
+#define ESP_GW_DECODERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ArduinoJson.h>
+
+enum DecoderSource : uint8_t
+{
+  DECODER_NONE,
+  DECODER_MANUFACTURER, // keyed by company identifier
+  DECODER_SERVICE_DATA  // keyed by 16 bit service data UUID
+};
+
+/**
+ * Decode the payload that follows the key, fields are added to out
+ * @return false if the payload is not in the expected format
+ */
+typedef bool (*DecoderFunction)(const uint8_t *data, size_t length, JsonObject out);
+
+struct Decoder
+{
+  DecoderSource source;
+  uint16_t key;
+  const char *format;
+  DecoderFunction decode;
+};
+
+/**
+ * Beacon and sensor advertisement formats decoded on the gateway.
+ * Only depends on ArduinoJson so the decoders can be unit tested on the host.
+ */
+class Decoders
+{
+public:
+  static const Decoder *decode(DecoderSource source, uint16_t key, const uint8_t *data, size_t length, JsonObject out);
+
+private:
+  static const Decoder *find(DecoderSource source, uint16_t key);
+};
+
+#endif
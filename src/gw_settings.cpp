@@ -87,13 +87,13 @@ bool GwSettings::init()
 
   if (prefs.isKey("cert")) {
     certLen = prefs.getBytesLength("cert");
-    cert = new uint8_t[certLen];
+    cert = (uint8_t *)Memory::allocateLarge(MEMORY_TAG_SETTINGS, certLen);
     prefs.getBytes("cert", cert, certLen);
   }
 
   if (prefs.isKey("pk")) {
     pkLen = prefs.getBytesLength("pk");
-    pk = new uint8_t[pkLen];
+    pk = (uint8_t *)Memory::allocateLarge(MEMORY_TAG_SETTINGS, pkLen);
     prefs.getBytes("pk", pk, pkLen);
   }
 
@@ -217,9 +217,9 @@ size_t GwSettings::getCertLen() {
 
 void GwSettings::setCert(const uint8_t *val, size_t len) {
   prefs.putBytes("cert", val, len);
-  delete[] cert;
+  Memory::release(cert);
   certLen = len;
-  cert = new uint8_t[certLen];
+  cert = (uint8_t *)Memory::allocateLarge(MEMORY_TAG_SETTINGS, certLen);
   memcpy(cert, val, certLen);
 }
 
@@ -233,8 +233,8 @@ size_t GwSettings::getPkLen() {
 
 void GwSettings::setPk(const uint8_t *val, size_t len) {
   prefs.putBytes("pk", val, len);
-  delete[] pk;
+  Memory::release(pk);
   pkLen = len;
-  pk = new uint8_t[pkLen];
+  pk = (uint8_t *)Memory::allocateLarge(MEMORY_TAG_SETTINGS, pkLen);
   memcpy(pk, val, pkLen);
 }
\ No newline at end of file
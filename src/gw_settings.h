@@ -3,6 +3,7 @@
 
 #include <Preferences.h>
 #include "security.h"
+#include "memory_stats.h"
 
 class GwSettings {
   public:
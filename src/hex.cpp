@@ -0,0 +1,123 @@
+#include "hex.h"
+#include "string.h"
+
+#define HEX_INVALID 0xFF
+
+static const char hexPairs[513] =
+    "000102030405060708090A0B0C0D0E0F"
+    "101112131415161718191A1B1C1D1E1F"
+    "202122232425262728292A2B2C2D2E2F"
+    "303132333435363738393A3B3C3D3E3F"
+    "404142434445464748494A4B4C4D4E4F"
+    "505152535455565758595A5B5C5D5E5F"
+    "606162636465666768696A6B6C6D6E6F"
+    "707172737475767778797A7B7C7D7E7F"
+    "808182838485868788898A8B8C8D8E8F"
+    "909192939495969798999A9B9C9D9E9F"
+    "A0A1A2A3A4A5A6A7A8A9AAABACADAEAF"
+    "B0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+    "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECF"
+    "D0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+    "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEF"
+    "F0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+#define X HEX_INVALID
+static const uint8_t hexValues[256] = {
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,
+    X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X};
+#undef X
+
+size_t Hex::encode(const uint8_t *data, size_t length, char *out)
+{
+  size_t i = 0;
+  // 4 bytes in, 8 chars out per iteration
+  for (; i + 4 <= length; i += 4)
+  {
+    char chunk[8];
+    memcpy(chunk + 0, hexPairs + data[i + 0] * 2, 2);
+    memcpy(chunk + 2, hexPairs + data[i + 1] * 2, 2);
+    memcpy(chunk + 4, hexPairs + data[i + 2] * 2, 2);
+    memcpy(chunk + 6, hexPairs + data[i + 3] * 2, 2);
+    memcpy(out + i * 2, chunk, 8);
+  }
+  for (; i < length; i++)
+  {
+    memcpy(out + i * 2, hexPairs + data[i] * 2, 2);
+  }
+  out[length * 2] = '\0';
+  return length * 2;
+}
+
+bool Hex::decode(const char *data, size_t length, uint8_t *out)
+{
+  if (length % 2 != 0)
+  {
+    return false;
+  }
+  const uint8_t *in = (const uint8_t *)data;
+  size_t outLength = length / 2;
+  size_t i = 0;
+  // 8 chars in, 4 bytes out per iteration, invalid chars are checked once per word
+  for (; i + 4 <= outLength; i += 4)
+  {
+    const uint8_t *chunk = in + i * 2;
+    uint32_t hi = (uint32_t)hexValues[chunk[0]] << 24 | (uint32_t)hexValues[chunk[2]] << 16 | (uint32_t)hexValues[chunk[4]] << 8 | hexValues[chunk[6]];
+    uint32_t lo = (uint32_t)hexValues[chunk[1]] << 24 | (uint32_t)hexValues[chunk[3]] << 16 | (uint32_t)hexValues[chunk[5]] << 8 | hexValues[chunk[7]];
+    // valid nibbles never have the high bits set
+    if ((hi | lo) & 0xF0F0F0F0)
+    {
+      return false;
+    }
+    uint32_t word = hi << 4 | lo;
+    out[i + 0] = word >> 24;
+    out[i + 1] = word >> 16;
+    out[i + 2] = word >> 8;
+    out[i + 3] = word;
+  }
+  for (; i < outLength; i++)
+  {
+    uint8_t hi = hexValues[in[i * 2]];
+    uint8_t lo = hexValues[in[i * 2 + 1]];
+    if ((hi | lo) & 0xF0)
+    {
+      return false;
+    }
+    out[i] = hi << 4 | lo;
+  }
+  return true;
+}
+
+bool Hex::isValid(const char *data, size_t length)
+{
+  if (length % 2 != 0)
+  {
+    return false;
+  }
+  for (size_t i = 0; i < length; i++)
+  {
+    if (hexValues[(uint8_t)data[i]] == HEX_INVALID)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t Hex::decodedLength(size_t length)
+{
+  return length / 2;
+}
@@ -0,0 +1,27 @@
+#ifndef ESP_GW_HEX_H
+#define ESP_GW_HEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Table driven hex codec.
+ * Encoding produces uppercase hex, decoding accepts both cases.
+ */
+class Hex {
+  public:
+    /**
+     * Encode data as hex into out (length * 2 chars plus the terminating 0)
+     * @return number of hex chars written, without the terminating 0
+     */
+    static size_t encode(const uint8_t *data, size_t length, char *out);
+    /**
+     * Decode hex into out (length / 2 bytes). out can be the same buffer as data.
+     * @return false on odd length or invalid characters
+     */
+    static bool decode(const char *data, size_t length, uint8_t *out);
+    static bool isValid(const char *data, size_t length);
+    static size_t decodedLength(size_t length);
+};
+
+#endif
@@ -0,0 +1,134 @@
+#include "latency.h"
+
+LatencyHistogram Latency::histograms[LATENCY_OP_COUNT][LATENCY_STAGE_COUNT];
+portMUX_TYPE Latency::mux = portMUX_INITIALIZER_UNLOCKED;
+LatencyOp Latency::traceOp = LATENCY_OP_NONE;
+int64_t Latency::traceReceived = 0;
+int64_t Latency::traceBleStart = 0;
+int64_t Latency::traceBleDone = 0;
+
+static const char *opNames[LATENCY_OP_COUNT] = {
+    "connect",
+    "discover",
+    "read",
+    "write",
+    "subscribe",
+    "notification",
+};
+
+static const char *stageNames[LATENCY_STAGE_COUNT] = {
+    "dispatch",
+    "ble",
+    "reply",
+    "total",
+    "queue",
+    "batch",
+};
+
+void Latency::record(LatencyOp op, LatencyStage stage, int64_t us)
+{
+  if (op >= LATENCY_OP_COUNT || us < 0)
+  {
+    return;
+  }
+  uint32_t value = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+  int bucket = value == 0 ? 0 : 32 - __builtin_clz(value) - LATENCY_FIRST_BUCKET_SHIFT;
+  if (bucket < 0)
+  {
+    bucket = 0;
+  }
+  else if (bucket >= LATENCY_BUCKETS)
+  {
+    bucket = LATENCY_BUCKETS - 1;
+  }
+  LatencyHistogram &histogram = histograms[op][stage];
+  histogram.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  histogram.count.fetch_add(1, std::memory_order_relaxed);
+  portENTER_CRITICAL(&mux);
+  histogram.sumUs += value;
+  portEXIT_CRITICAL(&mux);
+}
+
+/**
+ * Start tracing a command received at `received`
+ */
+void Latency::begin(LatencyOp op, int64_t received)
+{
+  traceOp = op;
+  traceReceived = received;
+  traceBleStart = 0;
+  traceBleDone = 0;
+}
+
+void Latency::bleStart()
+{
+  traceBleStart = now();
+}
+
+void Latency::bleDone()
+{
+  traceBleDone = now();
+}
+
+/**
+ * Reply was sent, record all stages of the traced command
+ */
+void Latency::end()
+{
+  if (traceOp == LATENCY_OP_NONE)
+  {
+    return;
+  }
+  int64_t sent = now();
+  if (traceBleStart > 0 && traceBleDone > 0)
+  {
+    record(traceOp, LATENCY_STAGE_DISPATCH, traceBleStart - traceReceived);
+    record(traceOp, LATENCY_STAGE_BLE, traceBleDone - traceBleStart);
+    record(traceOp, LATENCY_STAGE_REPLY, sent - traceBleDone);
+  }
+  record(traceOp, LATENCY_STAGE_TOTAL, sent - traceReceived);
+  traceOp = LATENCY_OP_NONE;
+}
+
+/**
+ * Add the non empty histograms to stats, bucket i counts values below 2^(i + LATENCY_FIRST_BUCKET_SHIFT) us
+ */
+void Latency::toJson(JsonObject stats)
+{
+  stats["firstBucketUs"] = 1 << LATENCY_FIRST_BUCKET_SHIFT;
+  JsonObject ops = stats.createNestedObject("latency");
+  for (auto op = 0; op < LATENCY_OP_COUNT; op++)
+  {
+    JsonObject stages;
+    for (auto stage = 0; stage < LATENCY_STAGE_COUNT; stage++)
+    {
+      LatencyHistogram &histogram = histograms[op][stage];
+      uint32_t count = histogram.count.load(std::memory_order_relaxed);
+      if (count == 0)
+      {
+        continue;
+      }
+      if (stages.isNull())
+      {
+        stages = ops.createNestedObject(opNames[op]);
+      }
+      JsonObject values = stages.createNestedObject(stageNames[stage]);
+      values["count"] = count;
+      portENTER_CRITICAL(&mux);
+      uint64_t sumUs = histogram.sumUs;
+      portEXIT_CRITICAL(&mux);
+      values["sumUs"] = sumUs;
+      // skip the empty buckets at the end
+      int last = LATENCY_BUCKETS - 1;
+      while (last > 0 && histogram.buckets[last].load(std::memory_order_relaxed) == 0)
+      {
+        last--;
+      }
+      JsonArray buckets = values.createNestedArray("buckets");
+      for (auto i = 0; i <= last; i++)
+      {
+        buckets.add(histogram.buckets[i].load(std::memory_order_relaxed));
+      }
+    }
+  }
+}
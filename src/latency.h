@@ -0,0 +1,73 @@
+#ifndef ESP_GW_LATENCY_H
+#define ESP_GW_LATENCY_H
+
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <ArduinoJson.h>
+#include <atomic>
+
+#define LATENCY_BUCKETS 20
+#define LATENCY_FIRST_BUCKET_SHIFT 6 // first bucket holds everything up to 64us
+
+enum LatencyOp : uint8_t
+{
+  LATENCY_OP_CONNECT,
+  LATENCY_OP_DISCOVER,
+  LATENCY_OP_READ,
+  LATENCY_OP_WRITE,
+  LATENCY_OP_SUBSCRIBE,
+  LATENCY_OP_NOTIFICATION,
+  LATENCY_OP_COUNT,
+  LATENCY_OP_NONE = 0xFF
+};
+
+enum LatencyStage : uint8_t
+{
+  LATENCY_STAGE_DISPATCH, // WebSocket receive to BLE op start
+  LATENCY_STAGE_BLE,      // BLE op start to completion (or NimBLE callback for notifications)
+  LATENCY_STAGE_REPLY,    // BLE op completion to reply queued
+  LATENCY_STAGE_TOTAL,    // WebSocket receive (or NimBLE callback) to reply queued
+  LATENCY_STAGE_QUEUE,    // reply queued to handed to the socket
+  LATENCY_STAGE_BATCH,    // notification held for coalescing
+  LATENCY_STAGE_COUNT
+};
+
+struct LatencyHistogram
+{
+  std::atomic<uint32_t> buckets[LATENCY_BUCKETS];
+  std::atomic<uint32_t> count;
+  uint64_t sumUs; // under Latency::mux, 64 bit atomics are not lock free on the ESP32
+};
+
+/**
+ * Fixed log2 bucket histograms per operation and stage
+ */
+class Latency
+{
+public:
+  static inline int64_t now()
+  {
+    return esp_timer_get_time();
+  }
+  static void record(LatencyOp op, LatencyStage stage, int64_t us);
+  // trace of the command being processed
+  static void begin(LatencyOp op, int64_t received);
+  static void bleStart();
+  static void bleDone();
+  static void end();
+  static inline LatencyOp current()
+  {
+    return traceOp;
+  }
+  static void toJson(JsonObject stats);
+
+private:
+  static LatencyHistogram histograms[LATENCY_OP_COUNT][LATENCY_STAGE_COUNT];
+  static portMUX_TYPE mux;
+  static LatencyOp traceOp;
+  static int64_t traceReceived;
+  static int64_t traceBleStart;
+  static int64_t traceBleDone;
+};
+
+#endif
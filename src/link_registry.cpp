@@ -0,0 +1,199 @@
+#include "link_registry.h"
+
+Link LinkRegistry::links[MAX_CLIENT_CONNECTIONS];
+int8_t LinkRegistry::index[LINK_INDEX_SIZE];
+uint8_t LinkRegistry::active = 0;
+portMUX_TYPE LinkRegistry::mux = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * Home slot of a peripheral in the index
+ */
+uint8_t LinkRegistry::slotOf(BLEPeripheralID id)
+{
+  uint8_t hash = 0;
+  for (auto i = 0; i < ESP_BD_ADDR_LEN; i++)
+  {
+    hash = hash * 31 + id[i];
+  }
+  return hash & (LINK_INDEX_SIZE - 1);
+}
+
+/**
+ * Link number of a peripheral, linear probing. Caller holds the lock.
+ */
+int8_t LinkRegistry::lookup(BLEPeripheralID id)
+{
+  uint8_t slot = slotOf(id);
+  for (auto i = 0; i < LINK_INDEX_SIZE; i++)
+  {
+    int8_t link = index[(slot + i) & (LINK_INDEX_SIZE - 1)];
+    if (link == LINK_NONE)
+    {
+      break;
+    }
+    if (links[link].id == id)
+    {
+      return link;
+    }
+  }
+  return LINK_NONE;
+}
+
+/**
+ * Rebuild the index after a link was freed, cheaper than tombstones for a handful of links.
+ * Caller holds the lock.
+ */
+void LinkRegistry::reindex()
+{
+  for (auto i = 0; i < LINK_INDEX_SIZE; i++)
+  {
+    index[i] = LINK_NONE;
+  }
+  for (int8_t link = 0; link < MAX_CLIENT_CONNECTIONS; link++)
+  {
+    if (links[link].active)
+    {
+      uint8_t slot = slotOf(links[link].id);
+      while (index[slot] != LINK_NONE)
+      {
+        slot = (slot + 1) & (LINK_INDEX_SIZE - 1);
+      }
+      index[slot] = link;
+    }
+  }
+}
+
+/**
+ * Link of a peripheral
+ * @return nullptr if there is none
+ */
+Link *LinkRegistry::find(BLEPeripheralID id)
+{
+  portENTER_CRITICAL(&mux);
+  int8_t link = active > 0 ? lookup(id) : LINK_NONE;
+  portEXIT_CRITICAL(&mux);
+  return link == LINK_NONE ? nullptr : &links[link];
+}
+
+/**
+ * Link of a peripheral, a free slot is taken if there is none yet
+ * @param connecting keep the slot until connectDone(), even if the sessions let go of it
+ * @return nullptr if all MAX_CLIENT_CONNECTIONS slots are taken
+ */
+Link *LinkRegistry::acquire(BLEPeripheralID id, bool connecting)
+{
+  Link *found = nullptr;
+  portENTER_CRITICAL(&mux);
+  if (active == 0)
+  {
+    // index is not initialized before the first link
+    reindex();
+  }
+  int8_t link = lookup(id);
+  if (link != LINK_NONE)
+  {
+    found = &links[link];
+  }
+  else if (active < MAX_CLIENT_CONNECTIONS)
+  {
+    for (link = 0; link < MAX_CLIENT_CONNECTIONS; link++)
+    {
+      if (!links[link].active)
+      {
+        found = &links[link];
+        found->active = true;
+        found->id = id;
+        found->device = nullptr;
+        found->connecting = false;
+        found->sessions = 0;
+        found->connectedAt = millis();
+        found->notifications = 0;
+        found->maxNotificationUs = 0;
+        found->persistent = false;
+        found->reconnecting = false;
+        found->attempts = 0;
+        found->reconnects = 0;
+        found->recoveryMs = 0;
+        active++;
+        reindex();
+        break;
+      }
+    }
+  }
+  if (found != nullptr && connecting)
+  {
+    found->connecting = true;
+  }
+  portEXIT_CRITICAL(&mux);
+  return found;
+}
+
+/**
+ * End of a connect started with acquire(id, true)
+ * @param device the connected client, nullptr if the connect failed
+ */
+void LinkRegistry::connectDone(Link *link, NimBLEClient *device)
+{
+  portENTER_CRITICAL(&mux);
+  link->device = device;
+  link->connecting = false;
+  portEXIT_CRITICAL(&mux);
+  release(link);
+}
+
+/**
+ * Free the slot if neither the BLE layer nor a session still uses it, nor a connect is in progress
+ */
+void LinkRegistry::release(Link *link)
+{
+  portENTER_CRITICAL(&mux);
+  if (link->active && link->device == nullptr && !link->connecting && link->sessions == 0)
+  {
+    link->active = false;
+    active--;
+    reindex();
+  }
+  portEXIT_CRITICAL(&mux);
+}
+
+/**
+ * Link by number, for iterating
+ * @return nullptr if the slot is free
+ */
+Link *LinkRegistry::at(uint8_t index)
+{
+  return index < MAX_CLIENT_CONNECTIONS && links[index].active ? &links[index] : nullptr;
+}
+
+uint8_t LinkRegistry::count()
+{
+  return active;
+}
+
+/**
+ * Per link notification counts and delivery times, for stats and soak runs
+ */
+void LinkRegistry::toJson(JsonArray out)
+{
+  uint32_t now = millis();
+  for (auto i = 0; i < MAX_CLIENT_CONNECTIONS; i++)
+  {
+    Link &link = links[i];
+    if (link.active)
+    {
+      JsonObject item = out.createNestedObject();
+      item["peripheralUuid"] = BLEApi::idToString(link.id);
+      item["connected"] = link.device != nullptr;
+      item["sessions"] = link.sessions;
+      item["uptime"] = now - link.connectedAt;
+      item["notifications"] = link.notifications;
+      item["maxNotificationUs"] = link.maxNotificationUs;
+      if (link.persistent)
+      {
+        item["reconnecting"] = link.reconnecting;
+        item["reconnects"] = link.reconnects;
+        item["recoveryMs"] = link.recoveryMs;
+      }
+    }
+  }
+}
@@ -0,0 +1,64 @@
+#ifndef ESP_GW_LINK_REGISTRY_H
+#define ESP_GW_LINK_REGISTRY_H
+
+#define LINK_INDEX_SIZE 32 // power of two, at least twice MAX_CLIENT_CONNECTIONS (9 at most)
+#define LINK_NONE -1
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "ble_api.h"
+#include "value_cache.h"
+
+static_assert(LINK_INDEX_SIZE >= 2 * MAX_CLIENT_CONNECTIONS, "link index too small");
+static_assert((LINK_INDEX_SIZE & (LINK_INDEX_SIZE - 1)) == 0, "link index size must be a power of two");
+
+/**
+ * One peripheral link. The BLE layer owns device and values, the API layer sessions.
+ * The slot is free again once both let go of it.
+ */
+struct Link
+{
+  bool active;
+  BLEPeripheralID id;
+  NimBLEClient *device; // nullptr while connecting or after the peripheral disconnected
+  bool connecting;      // a connect is in progress, possibly in another task, the slot is kept
+  uint32_t sessions;    // API sessions holding a reference
+  ValueCache values;
+  uint32_t connectedAt;
+  uint32_t notifications;
+  uint32_t maxNotificationUs;
+  // persistent links are reconnected in the background when the peripheral drops them
+  bool persistent;
+  bool reconnecting;
+  uint8_t attempts;
+  uint32_t lostAt;
+  uint32_t nextAttempt;
+  uint32_t reconnects;
+  uint32_t recoveryMs; // link lost to subscriptions restored, last reconnect
+};
+
+/**
+ * Peripheral links shared by BLEApi and NobleApi, looked up by peripheral through a hash index
+ */
+class LinkRegistry
+{
+public:
+  static Link *find(BLEPeripheralID id);
+  static Link *acquire(BLEPeripheralID id, bool connecting = false);
+  static void connectDone(Link *link, NimBLEClient *device);
+  static void release(Link *link);
+  static Link *at(uint8_t index);
+  static uint8_t count();
+  static void toJson(JsonArray out);
+
+private:
+  static Link links[MAX_CLIENT_CONNECTIONS];
+  static int8_t index[LINK_INDEX_SIZE];
+  static uint8_t active;
+  static portMUX_TYPE mux;
+  static uint8_t slotOf(BLEPeripheralID id);
+  static int8_t lookup(BLEPeripheralID id);
+  static void reindex();
+};
+
+#endif
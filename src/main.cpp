@@ -8,10 +8,30 @@
 #include "web.h"
 #include "noble_api.h"
 #include "util.h"
+#include "metrics.h"
+#include "memory_stats.h"
 
 #define WIFI_CONNECT_RETRY 5
 #define WIFI_CONFIGURE_DNS_PORT 53
 
+// WebSocket and BLE work run on the core of the NimBLE host, HTTPS and DNS on the other one
+#ifndef ESP_GW_BLE_CORE
+#define ESP_GW_BLE_CORE CONFIG_BT_NIMBLE_PINNED_TO_CORE
+#endif
+#define ESP_GW_WEB_CORE (1 - ESP_GW_BLE_CORE)
+
+#define NOBLE_TASK_STACK 8192
+#define NOBLE_TASK_PRIORITY 3
+#define NOBLE_TASK_WAIT 1 // ticks to block between websocket polls
+#define RECONNECT_TASK_STACK 4096
+#define RECONNECT_TASK_PRIORITY 2 // below the API task, it only waits for the peripheral
+#define WEB_TASK_STACK 8192
+#define WEB_TASK_PRIORITY 1
+#define WEB_TASK_WAIT 2
+#define DNS_TASK_STACK 3072
+#define DNS_TASK_PRIORITY 1
+#define DNS_TASK_WAIT 10
+
 DNSServer *dnsServer = nullptr;
 bool connected = false;
 
@@ -66,6 +86,79 @@ bool setupWeb() {
   return WebManager::init();
 }
 
+/**
+ * WebSocket API and the BLE operations it triggers
+ */
+void nobleTask(void *param)
+{
+  for (;;)
+  {
+    uint32_t loopStart = micros();
+    NobleApi::loop();
+    Memory::loop();
+    Metrics::loopTime(METRIC_LOOP_NOBLE, micros() - loopStart);
+    // NobleApi::wake() ends the wait early
+    ulTaskNotifyTake(pdTRUE, NOBLE_TASK_WAIT);
+  }
+}
+
+/**
+ * Reconnect attempts of persistent links, a peripheral that does not answer does not stall the WebSocket
+ */
+void reconnectTask(void *param)
+{
+  for (;;)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    NobleApi::runReconnect();
+  }
+}
+
+/**
+ * HTTP and HTTPS servers, a slow TLS handshake here does not delay the WebSocket
+ */
+void webTask(void *param)
+{
+  for (;;)
+  {
+    uint32_t loopStart = micros();
+    WebManager::loop();
+    Metrics::loopTime(METRIC_LOOP_WEB, micros() - loopStart);
+    vTaskDelay(WEB_TASK_WAIT);
+  }
+}
+
+/**
+ * Captive DNS, only in configuration mode
+ */
+void dnsTask(void *param)
+{
+  for (;;)
+  {
+    uint32_t loopStart = micros();
+    dnsServer->processNextRequest();
+    Metrics::loopTime(METRIC_LOOP_DNS, micros() - loopStart);
+    vTaskDelay(DNS_TASK_WAIT);
+  }
+}
+
+void setupTasks()
+{
+  Metrics::initIdle();
+
+  TaskHandle_t nobleTaskHandle;
+  xTaskCreatePinnedToCore(nobleTask, "noble", NOBLE_TASK_STACK, nullptr, NOBLE_TASK_PRIORITY, &nobleTaskHandle, ESP_GW_BLE_CORE);
+  NobleApi::setTask(nobleTaskHandle);
+  TaskHandle_t reconnectTaskHandle;
+  xTaskCreatePinnedToCore(reconnectTask, "reconnect", RECONNECT_TASK_STACK, nullptr, RECONNECT_TASK_PRIORITY, &reconnectTaskHandle, ESP_GW_BLE_CORE);
+  NobleApi::setReconnectTask(reconnectTaskHandle);
+  xTaskCreatePinnedToCore(webTask, "web", WEB_TASK_STACK, nullptr, WEB_TASK_PRIORITY, nullptr, ESP_GW_WEB_CORE);
+  if (dnsServer != nullptr)
+  {
+    xTaskCreatePinnedToCore(dnsTask, "dns", DNS_TASK_STACK, nullptr, DNS_TASK_PRIORITY, nullptr, ESP_GW_WEB_CORE);
+  }
+}
+
 void setup()
 {
   Serial.begin(921600);
@@ -91,14 +184,15 @@ void setup()
 
   Serial.println("Setup complete");
   meminfo();
+  Memory::report();
+  Memory::sample();
+  Memory::log();
+
+  setupTasks();
 }
 
 void loop()
 {
-  if (dnsServer != nullptr) {
-    // when in configuration mode handle DNS requests
-    dnsServer->processNextRequest();
-  }
-  NobleApi::loop();
-  WebManager::loop();
+  // everything runs in the tasks started by setupTasks
+  vTaskDelete(nullptr);
 }
\ No newline at end of file
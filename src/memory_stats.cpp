@@ -0,0 +1,214 @@
+#include "memory_stats.h"
+
+// every tracked allocation starts with this header
+struct MemoryHeader
+{
+  uint32_t size;
+  uint8_t tag;
+  uint8_t reserved[3];
+};
+
+struct MemoryCaps
+{
+  const char *name;
+  uint32_t caps;
+};
+
+static const MemoryCaps memoryCaps[] = {
+    {"internal", MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT},
+    {"iram", MALLOC_CAP_INTERNAL | MALLOC_CAP_32BIT},
+    {"dma", MALLOC_CAP_DMA},
+    {"spiram", MALLOC_CAP_SPIRAM},
+};
+
+#define MEMORY_CAPS_COUNT (sizeof(memoryCaps) / sizeof(memoryCaps[0]))
+
+static const char *tagNames[MEMORY_TAG_COUNT] = {
+    "ble",
+    "noble",
+    "web",
+    "json",
+    "settings",
+};
+
+std::atomic<int32_t> Memory::tagBytes[MEMORY_TAG_COUNT];
+std::atomic<int32_t> Memory::tagPeak[MEMORY_TAG_COUNT];
+MemoryCapsSample Memory::samples[MEMORY_CAPS_COUNT];
+uint32_t Memory::lastSample = 0;
+bool Memory::tlsWarning = false;
+bool Memory::bleWarning = false;
+
+void *Memory::allocate(MemoryTag tag, size_t size, uint32_t caps)
+{
+  MemoryHeader *header = (MemoryHeader *)heap_caps_malloc(sizeof(MemoryHeader) + size, caps);
+  if (header == nullptr)
+  {
+    return nullptr;
+  }
+  header->size = size;
+  header->tag = tag;
+  adjust(tag, size);
+  return header + 1;
+}
+
+void *Memory::reallocate(MemoryTag tag, void *ptr, size_t size, uint32_t caps)
+{
+  if (ptr == nullptr)
+  {
+    return allocate(tag, size, caps);
+  }
+  MemoryHeader *header = (MemoryHeader *)ptr - 1;
+  int32_t previous = header->size;
+  header = (MemoryHeader *)heap_caps_realloc(header, sizeof(MemoryHeader) + size, caps);
+  if (header == nullptr)
+  {
+    return nullptr;
+  }
+  header->size = size;
+  adjust(tag, (int32_t)size - previous);
+  return header + 1;
+}
+
+void *Memory::allocateLarge(MemoryTag tag, size_t size)
+{
+#ifdef BOARD_HAS_PSRAM
+  void *ptr = allocate(tag, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (ptr != nullptr)
+  {
+    return ptr;
+  }
+#endif
+  return allocate(tag, size);
+}
+
+void *Memory::reallocateLarge(MemoryTag tag, void *ptr, size_t size)
+{
+#ifdef BOARD_HAS_PSRAM
+  void *moved = reallocate(tag, ptr, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (moved != nullptr)
+  {
+    return moved;
+  }
+#endif
+  return reallocate(tag, ptr, size);
+}
+
+void Memory::release(void *ptr)
+{
+  if (ptr == nullptr)
+  {
+    return;
+  }
+  MemoryHeader *header = (MemoryHeader *)ptr - 1;
+  adjust((MemoryTag)header->tag, -(int32_t)header->size);
+  heap_caps_free(header);
+}
+
+/**
+ * Account memory allocated on behalf of a subsystem by a library (ie NimBLE clients)
+ */
+void Memory::adjust(MemoryTag tag, int32_t bytes)
+{
+  int32_t current = tagBytes[tag].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+  int32_t peak = tagPeak[tag].load(std::memory_order_relaxed);
+  while (current > peak && !tagPeak[tag].compare_exchange_weak(peak, current, std::memory_order_relaxed))
+  {
+  }
+}
+
+/**
+ * Sample every ESP_GW_MEMORY_SAMPLE_INTERVAL
+ */
+void Memory::loop()
+{
+  if (millis() - lastSample >= ESP_GW_MEMORY_SAMPLE_INTERVAL)
+  {
+    sample();
+    log();
+  }
+}
+
+/**
+ * Sample all heaps and warn when the largest internal block gets too small
+ */
+void Memory::sample()
+{
+  lastSample = millis();
+  for (size_t i = 0; i < MEMORY_CAPS_COUNT; i++)
+  {
+    samples[i].free = heap_caps_get_free_size(memoryCaps[i].caps);
+    samples[i].largest = heap_caps_get_largest_free_block(memoryCaps[i].caps);
+    samples[i].minimum = heap_caps_get_minimum_free_size(memoryCaps[i].caps);
+  }
+
+  size_t largest = samples[0].largest;
+  bool tlsLow = largest < ESP_GW_MEMORY_TLS_BLOCK;
+  if (tlsLow && !tlsWarning)
+  {
+    log_w("event=memory_low need=tls largest=%u required=%u", largest, ESP_GW_MEMORY_TLS_BLOCK);
+  }
+  tlsWarning = tlsLow;
+  bool bleLow = largest < ESP_GW_MEMORY_BLE_CLIENT_BLOCK;
+  if (bleLow && !bleWarning)
+  {
+    log_w("event=memory_low need=ble_client largest=%u required=%u", largest, ESP_GW_MEMORY_BLE_CLIENT_BLOCK);
+  }
+  bleWarning = bleLow;
+}
+
+/**
+ * Structured log lines of the last sample
+ */
+void Memory::log()
+{
+  for (size_t i = 0; i < MEMORY_CAPS_COUNT; i++)
+  {
+    if (heap_caps_get_total_size(memoryCaps[i].caps) > 0)
+    {
+      log_i("event=memory caps=%s free=%u largest=%u min=%u", memoryCaps[i].name, samples[i].free, samples[i].largest, samples[i].minimum);
+    }
+  }
+  for (auto i = 0; i < MEMORY_TAG_COUNT; i++)
+  {
+    log_i("event=memory tag=%s bytes=%d peak=%d", tagNames[i], tagBytes[i].load(std::memory_order_relaxed), tagPeak[i].load(std::memory_order_relaxed));
+  }
+}
+
+void Memory::toJson(JsonObject memory)
+{
+  JsonObject heaps = memory.createNestedObject("heaps");
+  for (size_t i = 0; i < MEMORY_CAPS_COUNT; i++)
+  {
+    if (heap_caps_get_total_size(memoryCaps[i].caps) > 0)
+    {
+      JsonObject heap = heaps.createNestedObject(memoryCaps[i].name);
+      heap["free"] = samples[i].free;
+      heap["largest"] = samples[i].largest;
+      heap["min"] = samples[i].minimum;
+    }
+  }
+  JsonObject tags = memory.createNestedObject("tags");
+  for (auto i = 0; i < MEMORY_TAG_COUNT; i++)
+  {
+    JsonObject tag = tags.createNestedObject(tagNames[i]);
+    tag["bytes"] = tagBytes[i].load(std::memory_order_relaxed);
+    tag["peak"] = tagPeak[i].load(std::memory_order_relaxed);
+  }
+  memory["tlsLow"] = tlsWarning;
+  memory["bleClientLow"] = bleWarning;
+}
+
+/**
+ * Boot time headroom report: total and free size of each heap
+ */
+void Memory::report()
+{
+  for (size_t i = 0; i < MEMORY_CAPS_COUNT; i++)
+  {
+    size_t total = heap_caps_get_total_size(memoryCaps[i].caps);
+    if (total > 0)
+    {
+      log_i("event=memory_headroom caps=%s total=%u free=%u largest=%u", memoryCaps[i].name, total, heap_caps_get_free_size(memoryCaps[i].caps), heap_caps_get_largest_free_block(memoryCaps[i].caps));
+    }
+  }
+}
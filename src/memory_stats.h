@@ -0,0 +1,131 @@
+#ifndef ESP_GW_MEMORY_STATS_H
+#define ESP_GW_MEMORY_STATS_H
+
+#ifndef ESP_GW_MEMORY_SAMPLE_INTERVAL
+#define ESP_GW_MEMORY_SAMPLE_INTERVAL 10000 // ms
+#endif
+
+// largest free internal block needed for a TLS handshake (mbedTLS record buffers)
+#ifndef ESP_GW_MEMORY_TLS_BLOCK
+#define ESP_GW_MEMORY_TLS_BLOCK 17408
+#endif
+
+// largest free internal block needed for NimBLEDevice::createClient and connect
+#ifndef ESP_GW_MEMORY_BLE_CLIENT_BLOCK
+#define ESP_GW_MEMORY_BLE_CLIENT_BLOCK 4096
+#endif
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <atomic>
+
+enum MemoryTag : uint8_t
+{
+  MEMORY_TAG_BLE,
+  MEMORY_TAG_NOBLE,
+  MEMORY_TAG_WEB,
+  MEMORY_TAG_JSON,
+  MEMORY_TAG_SETTINGS,
+  MEMORY_TAG_COUNT
+};
+
+struct MemoryCapsSample
+{
+  size_t free;
+  size_t largest;
+  size_t minimum;
+};
+
+/**
+ * Heap sampling and per subsystem allocation accounting
+ */
+class Memory
+{
+public:
+  // internal RAM, for DMA and hot path buffers
+  static void *allocate(MemoryTag tag, size_t size, uint32_t caps = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  static void *reallocate(MemoryTag tag, void *ptr, size_t size, uint32_t caps = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  // SPIRAM when available, for large latency tolerant structures
+  static void *allocateLarge(MemoryTag tag, size_t size);
+  static void *reallocateLarge(MemoryTag tag, void *ptr, size_t size);
+  static void release(void *ptr);
+  static void adjust(MemoryTag tag, int32_t bytes);
+  static void loop();
+  static void sample();
+  static void log();
+  static void toJson(JsonObject memory);
+  static void report();
+
+private:
+  static std::atomic<int32_t> tagBytes[MEMORY_TAG_COUNT];
+  static std::atomic<int32_t> tagPeak[MEMORY_TAG_COUNT];
+  static MemoryCapsSample samples[];
+  static uint32_t lastSample;
+  static bool tlsWarning;
+  static bool bleWarning;
+};
+
+/**
+ * ArduinoJson allocator accounted under MEMORY_TAG_JSON, documents go to SPIRAM when available
+ */
+struct JsonAllocator
+{
+  void *allocate(size_t size)
+  {
+    return Memory::allocateLarge(MEMORY_TAG_JSON, size);
+  }
+  void deallocate(void *ptr)
+  {
+    Memory::release(ptr);
+  }
+  void *reallocate(void *ptr, size_t size)
+  {
+    return Memory::reallocateLarge(MEMORY_TAG_JSON, ptr, size);
+  }
+};
+
+/**
+ * STL allocator for large containers, SPIRAM when available
+ */
+template <typename T, MemoryTag Tag>
+struct LargeAllocator
+{
+  typedef T value_type;
+  LargeAllocator() {}
+  template <typename U>
+  LargeAllocator(const LargeAllocator<U, Tag> &) {}
+  template <typename U>
+  struct rebind
+  {
+    typedef LargeAllocator<U, Tag> other;
+  };
+  T *allocate(size_t n)
+  {
+    void *ptr = Memory::allocateLarge(Tag, n * sizeof(T));
+    if (ptr == nullptr)
+    {
+      abort();
+    }
+    return (T *)ptr;
+  }
+  void deallocate(T *ptr, size_t)
+  {
+    Memory::release(ptr);
+  }
+};
+
+template <typename T, typename U, MemoryTag Tag>
+bool operator==(const LargeAllocator<T, Tag> &, const LargeAllocator<U, Tag> &)
+{
+  return true;
+}
+
+template <typename T, typename U, MemoryTag Tag>
+bool operator!=(const LargeAllocator<T, Tag> &, const LargeAllocator<U, Tag> &)
+{
+  return false;
+}
+
+typedef BasicJsonDocument<JsonAllocator> TrackedJsonDocument;
+
+#endif
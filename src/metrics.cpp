@@ -0,0 +1,151 @@
+#include "metrics.h"
+#include <esp_freertos_hooks.h>
+
+std::atomic<uint32_t> Metrics::counters[METRIC_COUNTER_COUNT];
+std::atomic<uint32_t> Metrics::gauges[METRIC_GAUGE_COUNT];
+std::atomic<uint32_t> Metrics::loopTimeLast[METRIC_LOOP_COUNT];
+std::atomic<uint32_t> Metrics::loopTimeMax[METRIC_LOOP_COUNT];
+std::atomic<uint32_t> Metrics::idleLoops[METRIC_CPU_COUNT];
+
+struct MetricInfo
+{
+  const char *name;
+  const char *labels;
+  const char *help;
+};
+
+// indexed by MetricCounter, samples of the same name must be consecutive
+static const MetricInfo counterInfo[METRIC_COUNTER_COUNT] = {
+    {"esp32gw_advertisements_received_total", "", "Advertisements received from the scan"},
+    {"esp32gw_advertisements_forwarded_total", "", "Advertisements sent to at least one client"},
+    {"esp32gw_advertisements_dropped_total", "", "Advertisements not sent to any client"},
+    {"esp32gw_advertisements_decoded_total", "", "Discover messages with fields decoded on the gateway"},
+    {"esp32gw_scan_reports_total", "", "Scan report messages, one per page of devices and window"},
+    {"esp32gw_notifications_total", "", "Characteristic notifications received"},
+    {"esp32gw_notification_batches_total", "", "Frames carrying coalesced notifications"},
+    {"esp32gw_notifications_batched_total", "", "Notifications sent in a coalesced frame"},
+    {"esp32gw_notifications_suppressed_total", "", "Notifications dropped by a subscription filter"},
+    {"esp32gw_poll_reads_total", "", "Reads done by the gateway for poll subscriptions"},
+    {"esp32gw_value_cache_lookups_total", "result=\"hit\"", "Reads with maxAge answered from the value cache (hits) or over the air"},
+    {"esp32gw_value_cache_lookups_total", "result=\"miss\"", nullptr},
+    {"esp32gw_gatt_operations_total", "op=\"read\",result=\"ok\"", "GATT operations by type and result"},
+    {"esp32gw_gatt_operations_total", "op=\"read\",result=\"failed\"", nullptr},
+    {"esp32gw_gatt_operations_total", "op=\"write\",result=\"ok\"", nullptr},
+    {"esp32gw_gatt_operations_total", "op=\"write\",result=\"failed\"", nullptr},
+    {"esp32gw_gatt_operations_total", "op=\"notify\",result=\"ok\"", nullptr},
+    {"esp32gw_gatt_operations_total", "op=\"notify\",result=\"failed\"", nullptr},
+    {"esp32gw_gatt_operations_total", "op=\"discover\",result=\"ok\"", nullptr},
+    {"esp32gw_gatt_operations_total", "op=\"discover\",result=\"failed\"", nullptr},
+    {"esp32gw_connect_attempts_total", "", "Peripheral connect attempts, including retries"},
+    {"esp32gw_connect_failures_total", "", "Peripheral connects that failed after all retries"},
+    {"esp32gw_connect_shared_total", "", "Connects served by a link already held by another client"},
+    {"esp32gw_reconnect_attempts_total", "", "Background reconnect attempts of persistent links"},
+    {"esp32gw_reconnects_total", "", "Persistent links brought back with their subscriptions"},
+    {"esp32gw_ble_busy_total", "reason=\"queue\"", "BLE operations refused by the scheduler, client commands get a busy reply"},
+    {"esp32gw_ble_busy_total", "reason=\"peripheral\"", nullptr},
+    {"esp32gw_ble_busy_total", "reason=\"rate\"", nullptr},
+    {"esp32gw_websocket_connections_total", "", "WebSocket connections accepted"},
+    {"esp32gw_websocket_tx_messages_total", "", "WebSocket messages sent"},
+    {"esp32gw_websocket_tx_bytes_total", "", "WebSocket payload bytes sent"},
+    {"esp32gw_websocket_tx_dropped_total", "", "Discover messages dropped from full client queues"},
+    {"esp32gw_websocket_tx_coalesced_total", "", "Discover messages replaced by a newer one of the same peripheral"},
+    {"esp32gw_websocket_stuck_disconnects_total", "", "Clients disconnected for not keeping up with their queue"},
+};
+
+// indexed by MetricGauge
+static const MetricInfo gaugeInfo[METRIC_GAUGE_COUNT] = {
+    {"esp32gw_websocket_clients", "", "Connected WebSocket clients"},
+};
+
+// indexed by MetricLoop
+static const char *loopNames[METRIC_LOOP_COUNT] = {
+    "noble",
+    "web",
+    "dns",
+};
+
+static void printSample(Print &out, const MetricInfo &info, const char *type, uint32_t value)
+{
+  if (info.help != nullptr)
+  {
+    out.printf("# HELP %s %s\n# TYPE %s %s\n", info.name, info.help, info.name, type);
+  }
+  if (info.labels[0] != '\0')
+  {
+    out.printf("%s{%s} %u\n", info.name, info.labels, value);
+  }
+  else
+  {
+    out.printf("%s %u\n", info.name, value);
+  }
+}
+
+/**
+ * Record a task loop iteration duration
+ */
+void Metrics::loopTime(MetricLoop loop, uint32_t us)
+{
+  loopTimeLast[loop].store(us, std::memory_order_relaxed);
+  uint32_t max = loopTimeMax[loop].load(std::memory_order_relaxed);
+  while (us > max && !loopTimeMax[loop].compare_exchange_weak(max, us, std::memory_order_relaxed))
+  {
+  }
+}
+
+bool Metrics::idleHook0()
+{
+  idleLoops[0].fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+bool Metrics::idleHook1()
+{
+  idleLoops[1].fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+/**
+ * Count idle task iterations on each core, the rate drops as the core gets busier
+ */
+void Metrics::initIdle()
+{
+  esp_register_freertos_idle_hook_for_cpu(idleHook0, 0);
+  esp_register_freertos_idle_hook_for_cpu(idleHook1, 1);
+}
+
+/**
+ * Write all metrics in text exposition format, the loop time max is reset on each call
+ */
+void Metrics::print(Print &out)
+{
+  for (auto i = 0; i < METRIC_COUNTER_COUNT; i++)
+  {
+    printSample(out, counterInfo[i], "counter", counters[i].load(std::memory_order_relaxed));
+  }
+  for (auto i = 0; i < METRIC_GAUGE_COUNT; i++)
+  {
+    printSample(out, gaugeInfo[i], "gauge", gauges[i].load(std::memory_order_relaxed));
+  }
+  for (auto i = 0; i < METRIC_LOOP_COUNT; i++)
+  {
+    char labels[16];
+    snprintf(labels, sizeof(labels), "task=\"%s\"", loopNames[i]);
+    printSample(out, {"esp32gw_loop_time_us", labels, i == 0 ? "Duration of the last task loop iteration" : nullptr}, "gauge", loopTimeLast[i].load(std::memory_order_relaxed));
+  }
+  for (auto i = 0; i < METRIC_LOOP_COUNT; i++)
+  {
+    char labels[16];
+    snprintf(labels, sizeof(labels), "task=\"%s\"", loopNames[i]);
+    printSample(out, {"esp32gw_loop_time_max_us", labels, i == 0 ? "Longest task loop iteration since the last scrape" : nullptr}, "gauge", loopTimeMax[i].exchange(0, std::memory_order_relaxed));
+  }
+  for (auto i = 0; i < METRIC_CPU_COUNT; i++)
+  {
+    char labels[16];
+    snprintf(labels, sizeof(labels), "cpu=\"%d\"", i);
+    printSample(out, {"esp32gw_idle_loops_total", labels, i == 0 ? "Idle task iterations per core" : nullptr}, "counter", idleLoops[i].load(std::memory_order_relaxed));
+  }
+  printSample(out, {"esp32gw_heap_free_bytes", "", "Free internal heap"}, "gauge", heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+  printSample(out, {"esp32gw_heap_largest_free_block_bytes", "", "Largest free internal heap block"}, "gauge", heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+  printSample(out, {"esp32gw_heap_minimum_free_bytes", "", "Minimum free internal heap since boot"}, "gauge", heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+  printSample(out, {"esp32gw_uptime_seconds", "", "Time since boot"}, "gauge", millis() / 1000);
+}
@@ -0,0 +1,90 @@
+#ifndef ESP_GW_METRICS_H
+#define ESP_GW_METRICS_H
+
+#include <Arduino.h>
+#include <atomic>
+
+enum MetricCounter : uint8_t
+{
+  METRIC_ADV_RECEIVED,
+  METRIC_ADV_FORWARDED,
+  METRIC_ADV_DROPPED,
+  METRIC_ADV_DECODED,
+  METRIC_SCAN_REPORTS,
+  METRIC_NOTIFICATIONS,
+  METRIC_NOTIFICATION_BATCHES,
+  METRIC_NOTIFICATIONS_BATCHED,
+  METRIC_NOTIFICATIONS_SUPPRESSED,
+  METRIC_POLL_READS,
+  METRIC_VALUE_CACHE_HITS,
+  METRIC_VALUE_CACHE_MISSES,
+  METRIC_GATT_READ_OK,
+  METRIC_GATT_READ_FAILED,
+  METRIC_GATT_WRITE_OK,
+  METRIC_GATT_WRITE_FAILED,
+  METRIC_GATT_NOTIFY_OK,
+  METRIC_GATT_NOTIFY_FAILED,
+  METRIC_GATT_DISCOVER_OK,
+  METRIC_GATT_DISCOVER_FAILED,
+  METRIC_CONNECT_ATTEMPTS,
+  METRIC_CONNECT_FAILURES,
+  METRIC_CONNECT_SHARED,
+  METRIC_RECONNECT_ATTEMPTS,
+  METRIC_RECONNECTS,
+  METRIC_BLE_BUSY_QUEUE,
+  METRIC_BLE_BUSY_PERIPHERAL,
+  METRIC_BLE_BUSY_RATE,
+  METRIC_WS_CONNECTIONS,
+  METRIC_WS_TX_MESSAGES,
+  METRIC_WS_TX_BYTES,
+  METRIC_WS_TX_DROPPED,
+  METRIC_WS_TX_COALESCED,
+  METRIC_WS_STUCK_DISCONNECTS,
+  METRIC_COUNTER_COUNT
+};
+
+enum MetricGauge : uint8_t
+{
+  METRIC_WS_CLIENTS,
+  METRIC_GAUGE_COUNT
+};
+
+enum MetricLoop : uint8_t
+{
+  METRIC_LOOP_NOBLE,
+  METRIC_LOOP_WEB,
+  METRIC_LOOP_DNS,
+  METRIC_LOOP_COUNT
+};
+
+#define METRIC_CPU_COUNT 2
+
+/**
+ * Lock free counters and gauges, exported in Prometheus text format
+ */
+class Metrics
+{
+public:
+  static inline void inc(MetricCounter counter, uint32_t value = 1)
+  {
+    counters[counter].fetch_add(value, std::memory_order_relaxed);
+  }
+  static inline void set(MetricGauge gauge, uint32_t value)
+  {
+    gauges[gauge].store(value, std::memory_order_relaxed);
+  }
+  static void loopTime(MetricLoop loop, uint32_t us);
+  static void initIdle();
+  static void print(Print &out);
+
+private:
+  static std::atomic<uint32_t> counters[METRIC_COUNTER_COUNT];
+  static std::atomic<uint32_t> gauges[METRIC_GAUGE_COUNT];
+  static std::atomic<uint32_t> loopTimeLast[METRIC_LOOP_COUNT];
+  static std::atomic<uint32_t> loopTimeMax[METRIC_LOOP_COUNT];
+  static std::atomic<uint32_t> idleLoops[METRIC_CPU_COUNT];
+  static bool idleHook0();
+  static bool idleHook1();
+};
+
+#endif
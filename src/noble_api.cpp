@@ -1,13 +1,25 @@
 #include "noble_api.h"
 
 bool NobleApi::ready = false;
+QueueHandle_t NobleApi::lostLinks = nullptr;
+TaskHandle_t NobleApi::reconnectTask = nullptr;
+std::atomic<uint8_t> NobleApi::reconnectState(RECONNECT_IDLE);
+BLEPeripheralID NobleApi::reconnectId;
+bool NobleApi::reconnectResult = false;
+TaskHandle_t NobleApi::task = nullptr;
 Security *NobleApi::sec = nullptr;
-WebSocketsServer *NobleApi::ws = nullptr;
+GwWebSocketsServer *NobleApi::ws = nullptr;
 Challenge NobleApi::challenges[WEBSOCKETS_SERVER_CLIENT_MAX];
-PeripheralClient NobleApi::peripheralConnections[MAX_CLIENT_CONNECTIONS];
-uint8_t NobleApi::activeConnections = 0;
+uint8_t NobleApi::encodings[WEBSOCKETS_SERVER_CLIENT_MAX];
+uint32_t NobleApi::connectedAt[WEBSOCKETS_SERVER_CLIENT_MAX];
+TxQueue NobleApi::txQueues[WEBSOCKETS_SERVER_CLIENT_MAX];
+std::atomic<bool> NobleApi::stuckClients[WEBSOCKETS_SERVER_CLIENT_MAX];
+int64_t NobleApi::blockedSince[WEBSOCKETS_SERVER_CLIENT_MAX];
+BLEQueue NobleApi::bleQueues[WEBSOCKETS_SERVER_CLIENT_MAX];
+uint8_t NobleApi::bleCursor = 0;
+bool NobleApi::bleTurn = false;
 
-bool isEmptyChallenge(Challenge challenge)
+bool NobleApi::isEmptyChallenge(Challenge challenge)
 {
   for (auto i = 0; i < BLOCK_SIZE; i++)
   {
@@ -19,7 +31,7 @@ bool isEmptyChallenge(Challenge challenge)
   return true;
 }
 
-void clearChallenge(Challenge challenge)
+void NobleApi::clearChallenge(Challenge challenge)
 {
   for (auto i = 0; i < BLOCK_SIZE; i++)
   {
@@ -32,15 +44,26 @@ void clearChallenge(Challenge challenge)
 bool NobleApi::init()
 {
   // initialize clients and challenges
-  for (auto i = 0; i < MAX_CLIENT_CONNECTIONS; i++)
-  {
-    peripheralConnections[i].client = INVALID_CLIENT;
-  }
   for (auto i = 0; i < WEBSOCKETS_SERVER_CLIENT_MAX; i++)
   {
     clearChallenge(challenges[i]);
+    encodings[i] = WS_ENCODING_JSON;
+    ciphers[i] = nullptr;
+    macs[i] = nullptr;
+    scratch[i] = nullptr;
+    scratchSize[i] = 0;
+    stuckClients[i] = false;
+    blockedSince[i] = 0;
+    deviceCursors[i] = DEVICES_IDLE;
+    devicePages[i] = nullptr;
   }
 
+  initCommands();
+  initSessions();
+  initSubscriptions();
+  Replay::init();
+  lostLinks = xQueueCreate(LOST_LINKS_SIZE, sizeof(BLEPeripheralID));
+
   // instantiate security module
   sec = new Security(GwSettings::getAes());
 
@@ -51,7 +74,7 @@ bool NobleApi::init()
   BLEApi::onCharacteristicNotification(onCharacteristicNotification);
 
   // initialize websocket
-  ws = new WebSocketsServer(ESP_GW_WEBSOCKET_PORT);
+  ws = new GwWebSocketsServer(ESP_GW_WEBSOCKET_PORT);
   ws->enableHeartbeat(30000, 5000, 3);
   ws->begin();
   ws->onEvent(onWsEvent);
@@ -69,55 +92,85 @@ void NobleApi::loop()
   {
     // Process websocket events
     ws->loop();
+    runBLEOps();
+    continueReplays();
+    continueDevices();
+    pollSubscriptions();
+    handleLostLinks();
+    reconnectLinks();
+    connectMatches();
+    sendScanReports();
+    flushBatches();
+    drainQueues();
+    expireSessions();
     // TODO: disconnect clients that did not authenticate in a resonable timeframe
   }
 }
 
 /**
- * Cleanup after a client disconnects:
- * - disconnect connected devices
- * - remove client connection mappings 
- * - remove challenges
+ * Task running loop(), woken up by wake()
  */
-void NobleApi::clientDisconnectCleanup(uint8_t client)
+void NobleApi::setTask(TaskHandle_t handle)
 {
-  // disconnect all assigned peripheralUuid
-  for (auto i = 0; i < MAX_CLIENT_CONNECTIONS; i++)
+  task = handle;
+}
+
+/**
+ * Task running runReconnect(), woken up by reconnectLinks()
+ */
+void NobleApi::setReconnectTask(TaskHandle_t handle)
+{
+  reconnectTask = handle;
+}
+
+/**
+ * Wake up the API task, safe to call from BLE callbacks
+ */
+void NobleApi::wake()
+{
+  if (task != nullptr)
   {
-    if (peripheralConnections[i].client == client)
-    {
-      BLEApi::disconnect(peripheralConnections[i].id);
-      delClient(peripheralConnections[i].id);
-    }
+    xTaskNotifyGive(task);
   }
-
-  clearChallenge(challenges[client]);
 }
 
 /**
- * Can the client connect to device ?
+ * Cleanup after a client disconnects:
+ * - detach its session, the session keeps its peripheral references until it expires
+ * - remove challenges
  */
-bool NobleApi::clientCanConnect(uint8_t client, BLEPeripheralID id)
+void NobleApi::clientDisconnectCleanup(uint8_t client)
 {
-  uint8_t connectedClient = getClient(id);
-  if (connectedClient != INVALID_CLIENT && connectedClient != client)
+  uint8_t session = getSession(client);
+  if (session != INVALID_SESSION)
   {
-    return false;
+    detachSession(session);
   }
-  return true;
+
+  clearChallenge(challenges[client]);
+  disableEncryption(client);
+  txQueues[client].clear();
+  bleQueues[client].clear();
+  cancelMatch(client);
+  scanReports[client] = false;
+  // a page still held is released by continueDevices once the cleared queue let go of it
+  deviceCursors[client] = DEVICES_IDLE;
+  stuckClients[client] = false;
+  blockedSince[client] = 0;
+  replaySessions[client] = INVALID_SESSION;
 }
 
 /**
- * Is client connected to the device ?
+ * Does the client session hold a reference to the device ?
  */
 bool NobleApi::clientConnected(uint8_t client, BLEPeripheralID id)
 {
-  uint8_t connectedClient = getClient(id);
-  if (connectedClient == client)
+  uint8_t session = getSession(client);
+  if (session == INVALID_SESSION)
   {
-    return true;
+    return false;
   }
-  return false;
+  return (getSessions(id) & (1u << session)) != 0;
 }
 
 /**
@@ -128,6 +181,7 @@ void NobleApi::onWsEvent(uint8_t client, WStype_t type, uint8_t *payload, size_t
   if (type == WStype_DISCONNECTED)
   {
     clientDisconnectCleanup(client);
+    Metrics::set(METRIC_WS_CLIENTS, ws->connectedClients());
     Serial.printf("[%u] Disconnected!\n", client);
     if (ws->connectedClients() == 0)
     {
@@ -139,19 +193,62 @@ void NobleApi::onWsEvent(uint8_t client, WStype_t type, uint8_t *payload, size_t
   }
   else if (type == WStype_CONNECTED)
   {
+    connectedAt[client] = micros();
+    // drop anything queued for a previous client in this slot
+    txQueues[client].clear();
+    bleQueues[client].clear();
+    Metrics::inc(METRIC_WS_CONNECTIONS);
+    Metrics::set(METRIC_WS_CLIENTS, ws->connectedClients());
     meminfo();
     IPAddress ip = ws->remoteIP(client);
     Serial.printf("[%u] Connected from %d.%d.%d.%d url: %s\n", client, ip[0], ip[1], ip[2], ip[3], payload);
+    // clients can ask for MessagePack upfront with ?encoding=msgpack
+    if (strstr((char *)payload, "msgpack") != nullptr)
+    {
+      encodings[client] = WS_ENCODING_MSGPACK;
+    }
+    else
+    {
+      encodings[client] = WS_ENCODING_JSON;
+    }
     // Generate IV and send auth request
     initClient(client);
     sendAuthMessage(client);
   }
-  else if (type == WStype_TEXT)
+  else if (type == WStype_TEXT || type == WStype_BIN)
   {
+    int64_t received = Latency::now();
     // Serial.printf("[%u] get  Text: %s\n", client, payload);
 
+    bool packed = type == WStype_BIN;
+    if (ciphers[client] != nullptr)
+    {
+      // encrypted clients only send encrypted binary frames
+      if (type != WStype_BIN || !decryptFrame(client, payload, length))
+      {
+        Serial.printf("[%u] Invalid encrypted frame\n", client);
+        return;
+      }
+      payload += ENCRYPTION_HEADER_SIZE;
+      length -= ENCRYPTION_HEADER_SIZE + ENCRYPTION_TAG_SIZE;
+      packed = encodings[client] == WS_ENCODING_MSGPACK;
+    }
+    else if (packed)
+    {
+      // binary frames are MessagePack, reply in the same encoding
+      encodings[client] = WS_ENCODING_MSGPACK;
+    }
+
     StaticJsonDocument<1024> command;
-    DeserializationError error = deserializeJson(command, payload, length);
+    DeserializationError error;
+    if (packed)
+    {
+      error = deserializeMsgPack(command, payload, length, DeserializationOption::Filter(commandFilter));
+    }
+    else
+    {
+      error = deserializeJson(command, payload, length, DeserializationOption::Filter(commandFilter));
+    }
 
     if (error != DeserializationError::Ok)
     { //Check for errors in parsing
@@ -161,152 +258,7 @@ void NobleApi::onWsEvent(uint8_t client, WStype_t type, uint8_t *payload, size_t
     }
     else
     {
-      const char *action = command["action"];
-      if (action && strlen(action) > 0)
-      {
-        bool authenticated = false;
-        if (isEmptyChallenge(challenges[client]))
-        {
-          authenticated = true;
-        }
-        if (!authenticated)
-        {
-          // client is not authenticated, only respond to auth
-          if (strcmp(action, "auth") == 0)
-          {
-            const char *response = command["response"];
-            if (strlen(response) > 0)
-            {
-              checkAuth(client, response);
-            }
-          }
-        }
-        else
-        {
-          // client is authenticated, allow other commands
-
-          // scan sfuff
-          if (strcmp(action, "startScanning") == 0)
-          {
-            // TODO: if the scan is already running, send the list of discovered devices
-            // TODO: setup (per connection ?) services filter
-
-            // more or less a hack to allow for passive scanning as noble API does not have such parameter
-            const bool active = command["allowDuplicates"];
-            if (active) {
-              BLEApi::startScan(0, false);
-            } else {
-              BLEApi::startScan(0, true);
-            }
-          }
-          else if (strcmp(action, "stopScanning") == 0)
-          {
-            BLEApi::stopScan();
-          }
-          else
-          {
-            // stuff that requires periperalUuid
-            const char *tempUuid = command["peripheralUuid"];
-            if (tempUuid != nullptr)
-            {
-              BLEPeripheralID peripheralUuid = BLEApi::idFromString(tempUuid);
-
-              // connection
-              if (strcmp(action, "connect") == 0)
-              {
-                // check if peripheralUuid is not asigned to another client, asign client to periperhalUuid, check connection
-                if (clientCanConnect(client, peripheralUuid))
-                {
-                  addClient(peripheralUuid, client);
-                  // TODO: check if re-connection to peripheral is ok (in case client sends multiple connect but no disconnect)
-                  bool connected = BLEApi::connect(peripheralUuid);
-                  if (connected)
-                  {
-                    sendConnected(client, peripheralUuid);
-                  }
-                  else
-                  {
-                    delClient(peripheralUuid);
-                    sendDisconnected(client, peripheralUuid, "failed");
-                  }
-                }
-                else
-                {
-                  sendDisconnected(client, peripheralUuid, "denied");
-                }
-              }
-              // actions that require a connection
-              else if (clientConnected(client, peripheralUuid))
-              {
-                if (strcmp(action, "discoverServices") == 0)
-                {
-                  std::vector<NimBLERemoteService *> *services = BLEApi::discoverServices(peripheralUuid);
-                  if (services != nullptr)
-                  {
-                    sendServices(client, peripheralUuid, services);
-                  }
-                }
-                else if (strcmp(action, "discoverCharacteristics") == 0)
-                {
-                  std::string serviceUuid = command["serviceUuid"];
-                  std::vector<NimBLERemoteCharacteristic *> *characteristics = BLEApi::discoverCharacteristics(peripheralUuid, serviceUuid);
-                  if (characteristics != nullptr)
-                  {
-                    sendCharacteristics(client, peripheralUuid, serviceUuid, characteristics);
-                  }
-                  else
-                  {
-                    delClient(peripheralUuid);
-                    sendDisconnected(client, peripheralUuid, "aborted");
-                  }
-                }
-                else if (strcmp(action, "read") == 0)
-                {
-                  std::string serviceUuid = command["serviceUuid"];
-                  std::string characteristicUuid = command["characteristicUuid"];
-                  std::string value = BLEApi::readCharacteristic(peripheralUuid, serviceUuid, characteristicUuid);
-                  sendCharacteristicValue(client, peripheralUuid, serviceUuid, characteristicUuid, value);
-                }
-                else if (strcmp(action, "write") == 0)
-                {
-                  std::string serviceUuid = command["serviceUuid"];
-                  std::string characteristicUuid = command["characteristicUuid"];
-                  std::string dataHex = command["data"];
-                  size_t length = dataHex.length() / 2;
-                  uint8_t data[length];
-                  sec->fromHex(dataHex.c_str(), length * 2, data);
-                  bool withoutResponse = command["withoutResponse"];
-                  if (BLEApi::writeCharacteristic(peripheralUuid, serviceUuid, characteristicUuid, data, length, withoutResponse))
-                  { // success
-                    sendCharacteristicWrite(client, peripheralUuid, serviceUuid, characteristicUuid);
-                  }
-                  else
-                  { // failed
-                    sendCharacteristicWrite(client, peripheralUuid, serviceUuid, characteristicUuid);
-                  }
-                }
-                else if (strcmp(action, "notify") == 0)
-                {
-                  std::string serviceUuid = command["serviceUuid"];
-                  std::string characteristicUuid = command["characteristicUuid"];
-                  bool notify = command["notify"];
-                  // subscribe or unsubscribe
-                  BLEApi::notifyCharacteristic(peripheralUuid, serviceUuid, characteristicUuid, notify);
-                  sendCharacteristicNotification(client, peripheralUuid, serviceUuid, characteristicUuid, notify);
-                }
-              }
-              else
-              {
-                sendDisconnected(client, peripheralUuid, "not connected");
-              }
-            }
-            else
-            {
-              // failed to read peripheralUuid
-            }
-          }
-        }
-      }
+      processCommand(client, command, received);
       command.clear();
     }
   }
@@ -322,6 +274,12 @@ void NobleApi::onWsEvent(uint8_t client, WStype_t type, uint8_t *payload, size_t
 
 void NobleApi::onBLEDeviceFound(NimBLEAdvertisedDevice *advertisedDevice, BLEPeripheralID id)
 {
+  matchDevice(advertisedDevice, id);
+  if (!wantsDiscover())
+  {
+    // every client is on scan reports, the advertisement is in the presence table
+    return;
+  }
   StaticJsonDocument<1024> command;
   command["type"] = "discover";
   command["peripheralUuid"] = BLEApi::idToString(id);
@@ -350,40 +308,216 @@ void NobleApi::onBLEDeviceFound(NimBLEAdvertisedDevice *advertisedDevice, BLEPer
     JsonArray serviceUuids = command["advertisement"].createNestedArray("serviceUuids");
     serviceUuids.add(advertisedDevice->getServiceUUID().toString());
   }
-  if (advertisedDevice->haveManufacturerData())
+  DecoderSource source = setDecoded(command["advertisement"].as<JsonObject>(), advertisedDevice);
+  if (advertisedDevice->haveManufacturerData() && (ESP_GW_DECODED_RAW || source != DECODER_MANUFACTURER))
   {
     char manufacturerData[advertisedDevice->getManufacturerData().length() * 2 + 1];
-    sec->toHex((uint8_t *)advertisedDevice->getManufacturerData().data(), advertisedDevice->getManufacturerData().length(), manufacturerData);
-    manufacturerData[advertisedDevice->getManufacturerData().length() * 2 + 1] = '\0';
+    Hex::encode((uint8_t *)advertisedDevice->getManufacturerData().data(), advertisedDevice->getManufacturerData().length(), manufacturerData);
     command["advertisement"]["manufacturerData"] = manufacturerData;
   }
 
-  sendJsonMessage(command);
+  if (sendDiscover(command, id) > 0)
+  {
+    Metrics::inc(METRIC_ADV_FORWARDED);
+  }
+  else
+  {
+    Metrics::inc(METRIC_ADV_DROPPED);
+  }
   command.clear();
 }
 
+/**
+ * Peripheral dropped the link, runs in the BLE host task.
+ * Links are only changed by the API task, the event is handed over to handleLostLinks().
+ */
 void NobleApi::onBLEDeviceDisconnected(BLEPeripheralID id)
 {
-  uint8_t client = getClient(id);
-  if (client != INVALID_CLIENT)
+  if (xQueueSend(lostLinks, &id, 0) != pdTRUE)
   {
-    sendDisconnected(client, id);
+    log_e("Lost link queue is full");
+  }
+  wake();
+}
+
+/**
+ * Persistent links held by sessions are kept for reconnectLinks(), the others are gone
+ */
+void NobleApi::handleLostLinks()
+{
+  BLEPeripheralID id;
+  while (xQueueReceive(lostLinks, &id, 0) == pdTRUE)
+  {
+    Link *link = LinkRegistry::find(id);
+    if (link != nullptr && link->persistent && link->sessions != 0)
+    {
+      // sessions keep the link and their subscriptions, reconnectLinks() brings it back
+      link->lostAt = millis();
+      link->attempts = 0;
+      link->nextAttempt = link->lostAt + ESP_GW_RECONNECT_MIN;
+      link->reconnecting = true;
+      Serial.printf("Persistent link to %s lost, reconnecting\n", BLEApi::idToString(id).c_str());
+      continue;
+    }
+    peripheralGone(id, "");
+  }
+}
+
+/**
+ * Start the next due reconnect attempt of a lost persistent link, with exponential backoff between attempts.
+ * Attempts run one at a time in the reconnect task, the API task keeps serving the clients meanwhile.
+ */
+void NobleApi::reconnectLinks()
+{
+  uint8_t state = reconnectState.load();
+  if (state == RECONNECT_RUNNING || reconnectTask == nullptr)
+  {
+    return;
+  }
+  if (state == RECONNECT_DONE)
+  {
+    finishReconnect();
+  }
+  uint32_t now = millis();
+  for (auto i = 0; i < MAX_CLIENT_CONNECTIONS; i++)
+  {
+    Link *link = LinkRegistry::at(i);
+    if (link == nullptr || !link->reconnecting || (int32_t)(now - link->nextAttempt) < 0)
+    {
+      continue;
+    }
+    // the attempt counts against the rate of the clients holding the link
+    uint32_t retryAfter = 0;
+    if (!chargeSessions(link->sessions, retryAfter))
+    {
+      link->nextAttempt = now + retryAfter;
+      continue;
+    }
+    link->attempts++;
+    Metrics::inc(METRIC_RECONNECT_ATTEMPTS);
+    reconnectId = link->id;
+    reconnectState.store(RECONNECT_RUNNING);
+    xTaskNotifyGive(reconnectTask);
+    return;
+  }
+}
+
+/**
+ * Reconnect attempt handed over by reconnectLinks(), runs in the reconnect task
+ */
+void NobleApi::runReconnect()
+{
+  if (reconnectState.load() != RECONNECT_RUNNING)
+  {
+    return;
+  }
+  // a single short attempt
+  reconnectResult = BLEApi::connect(reconnectId, 1, ESP_GW_RECONNECT_TIMEOUT);
+  reconnectState.store(RECONNECT_DONE);
+  wake();
+}
+
+/**
+ * Outcome of the last reconnect attempt. Subscriptions are restored before the sessions are told,
+ * so they do not have to set anything up again.
+ */
+void NobleApi::finishReconnect()
+{
+  BLEPeripheralID id = reconnectId;
+  bool connected = reconnectResult;
+  reconnectState.store(RECONNECT_IDLE);
+  Link *link = LinkRegistry::find(id);
+  if (link == nullptr || link->sessions == 0)
+  {
+    // the sessions let go of the link during the attempt
+    if (connected)
+    {
+      BLEApi::disconnect(id);
+    }
+    return;
+  }
+  if (!link->reconnecting)
+  {
+    // taken over by a connect in the meantime
+    return;
+  }
+  if (!connected || link->device == nullptr)
+  {
+    uint32_t backoff = ESP_GW_RECONNECT_MIN << (link->attempts < 16 ? link->attempts : 16);
+    if (backoff > ESP_GW_RECONNECT_MAX)
+    {
+      backoff = ESP_GW_RECONNECT_MAX;
+    }
+    // up to 10% jitter so links dropped together do not retry together
+    link->nextAttempt = millis() + backoff + esp_random() % (backoff / 10 + 1);
+    return;
+  }
+
+  restoreSubscriptions(id);
+  link->reconnecting = false;
+  link->reconnects++;
+  link->recoveryMs = millis() - link->lostAt;
+  Metrics::inc(METRIC_RECONNECTS);
+  Serial.printf("Persistent link to %s back after %u ms\n", BLEApi::idToString(id).c_str(), link->recoveryMs);
+
+  EventTag tag;
+  uint32_t live = recordEvent(link->sessions, id, REPLAY_RECONNECT, tag);
+  for (uint8_t session = 0; session < WEBSOCKETS_SERVER_CLIENT_MAX; session++)
+  {
+    if (live & (1u << session))
+    {
+      sendReconnected(sessions[session].client, id, &tag, link->recoveryMs);
+    }
+  }
+}
+
+/**
+ * Link to the peripheral is lost, tell every session holding it
+ */
+void NobleApi::peripheralGone(BLEPeripheralID id, std::string reason)
+{
+  uint32_t targets = getSessions(id);
+  if (targets != 0)
+  {
+    EventTag tag;
+    uint32_t live = recordEvent(targets, id, REPLAY_DISCONNECT, tag);
+    for (uint8_t session = 0; session < WEBSOCKETS_SERVER_CLIENT_MAX; session++)
+    {
+      if (live & (1u << session))
+      {
+        sendDisconnected(sessions[session].client, id, reason, &tag);
+      }
+    }
     delClient(id);
   }
 }
 
 void NobleApi::onCharacteristicNotification(BLEPeripheralID id, std::string service, std::string characteristic, std::string data, bool isNotify)
 {
-  uint8_t client = getClient(id);
-  if (client != INVALID_CLIENT)
+  deliverNotification(getSessions(id), id, service, characteristic, data, isNotify);
+}
+
+/**
+ * Fan a value out to the subscribed sessions among targets.
+ * Values are kept for replay even when the client is away, sessions that are not coalescing share one message.
+ */
+void NobleApi::deliverNotification(uint32_t targets, BLEPeripheralID id, const std::string &service, const std::string &characteristic, const std::string &data, bool isNotify, bool polled)
+{
+  if (targets == 0)
+  {
+    return;
+  }
+  targets = filterNotification(targets, id, service, characteristic, data, polled);
+  if (targets == 0)
   {
-    sendCharacteristicValue(
-        client,
-        id,
-        service,
-        characteristic,
-        data,
-        isNotify);
+    return;
+  }
+  EventTag tag;
+  uint32_t live = recordEvent(targets, id, REPLAY_NOTIFICATION, tag, service, characteristic, data);
+  live = batchNotification(live, id, service, characteristic, data, tag);
+  if (live != 0)
+  {
+    sendNotification(live, id, service, characteristic, data, isNotify, tag);
   }
 }
 
@@ -392,7 +526,7 @@ void NobleApi::initClient(uint8_t client)
   sec->generateIV((uint8_t *)challenges[client]);
 }
 
-void NobleApi::checkAuth(uint8_t client, const char *response)
+void NobleApi::checkAuth(uint8_t client, const char *response, bool encrypt)
 {
   // check response length
   const size_t responseLength = strlen(response);
@@ -401,7 +535,13 @@ void NobleApi::checkAuth(uint8_t client, const char *response)
     if (!isEmptyChallenge(challenges[client]))
     {
       uint8_t encryptedResponse[responseLength / 2];
-      size_t encryptedResponseLength = sec->fromHex(response, responseLength, encryptedResponse);
+      if (!Hex::decode(response, responseLength, encryptedResponse))
+      {
+        Serial.println("Authentication failed, invalid response");
+        sendAuthMessage(client);
+        return;
+      }
+      size_t encryptedResponseLength = Hex::decodedLength(responseLength);
 
       uint8_t decryptedResponse[encryptedResponseLength + 1];
       size_t decryptedResponseLength = sec->decrypt((uint8_t *)challenges[client], encryptedResponse, encryptedResponseLength, decryptedResponse);
@@ -409,8 +549,17 @@ void NobleApi::checkAuth(uint8_t client, const char *response)
 
       if (strcmp((char *)decryptedResponse, "admin:admin") == 0)
       {
+        if (encrypt && !enableEncryption(client))
+        {
+          // the client asked for encryption, never continue in cleartext
+          Serial.printf("[%u] Encryption could not be enabled\n", client);
+          sendAuthMessage(client);
+          return;
+        }
         clearChallenge(challenges[client]);
         sendState(client);
+        sendSession(client, createSession(client));
+        clientReady(client);
       }
       else
       {
@@ -422,44 +571,266 @@ void NobleApi::checkAuth(uint8_t client, const char *response)
   }
 }
 
-void NobleApi::sendJsonMessage(JsonDocument &command, const uint8_t client)
+/**
+ * Queue a message for one client, sent from the API task
+ */
+void NobleApi::sendJsonMessage(JsonDocument &command, const uint8_t client, TxClass kind, LatencyOp op)
 {
-  size_t messageLength = measureJson(command) + 1;
-  // Serial.println(messageLength);
-  char buffer[messageLength];
-  // String buffer;
-  serializeJson(command, buffer, messageLength);
-  buffer[messageLength] = '\0';
-  command.clear();
-  // ESP_LOG_BUFFER_HEXDUMP("Send", buffer, messageLength, esp_log_level_t::ESP_LOG_INFO);
-  // Serial.printf("[%u] sent Text: %s\n", client, buffer);
-  ws->sendTXT(client, buffer);
+  TxBuffer *buffer = TxBuffer::fromJson(command, encodings[client] == WS_ENCODING_MSGPACK);
   command.clear();
+  if (buffer == nullptr)
+  {
+    Serial.printf("[%u] Out of memory for message\n", client);
+    return;
+  }
+  enqueue(client, buffer, kind, BLEPeripheralID(), op);
+  buffer->release();
 }
 
-void NobleApi::sendJsonMessage(JsonDocument &command)
+/**
+ * Queue a discover message for all authenticated clients.
+ * Each encoding is serialized once and shared by the queues.
+ * @return number of clients the message was queued for
+ */
+uint8_t NobleApi::sendDiscover(JsonDocument &command, BLEPeripheralID id)
 {
-  size_t messageLength = measureJson(command) + 1;
-  char buffer[messageLength];
-  serializeJson(command, buffer, messageLength);
-  buffer[messageLength] = '\0';
-  command.clear();
+  uint8_t queued = 0;
+  // MessagePack version is only built if there is a client asking for it
+  TxBuffer *text = nullptr;
+  TxBuffer *packed = nullptr;
 
-  std::map<uint32_t, std::string>::iterator it;
   for (uint8_t client = 0; client < WEBSOCKETS_SERVER_CLIENT_MAX; client++)
   {
     if (ws->clientIsConnected(client))
     {
-      // only send to auth clients
-      if (isEmptyChallenge(challenges[client]))
+      // only send to auth clients that want every advertisement
+      if (isEmptyChallenge(challenges[client]) && !scanReports[client])
       {
-        // ESP_LOG_BUFFER_HEXDUMP("Send", buffer, messageLength, esp_log_level_t::ESP_LOG_INFO);
-        // Serial.printf("[%u] sent Text: %s\n", client, buffer);
         // TODO: use service filter in case of discovery events
-        ws->sendTXT(client, buffer);
+        bool binary = encodings[client] == WS_ENCODING_MSGPACK;
+        TxBuffer *&buffer = binary ? packed : text;
+        if (buffer == nullptr)
+        {
+          buffer = TxBuffer::fromJson(command, binary);
+        }
+        if (buffer != nullptr)
+        {
+          enqueue(client, buffer, TX_CLASS_DISCOVER, id, LATENCY_OP_NONE);
+          queued++;
+        }
+      }
+    }
+  }
+  if (text != nullptr)
+  {
+    text->release();
+  }
+  if (packed != nullptr)
+  {
+    packed->release();
+  }
+  command.clear();
+  return queued;
+}
+
+/**
+ * Push a message to the client queue and wake up the API task to send it.
+ * A client whose queue is full of undelivered replies is disconnected from the API task.
+ */
+void NobleApi::enqueue(const uint8_t client, TxBuffer *buffer, TxClass kind, BLEPeripheralID id, LatencyOp op, uint16_t page)
+{
+  if (!txQueues[client].push(buffer, kind, id, op, page))
+  {
+    stuckClients[client] = true;
+  }
+  wake();
+}
+
+/**
+ * Send queued messages class by class across all clients.
+ * Every GATT message queued when the loop starts is sent in that loop, so a reply or notification
+ * waits for at most one loop and the GATT messages queued before it, whatever the discover rate.
+ * Lower classes are limited to ESP_GW_TX_DRAIN_BUDGET messages per client and loop.
+ * A client whose socket cannot take a write is skipped until the next loop, sends never wait on it,
+ * and it is disconnected once it has been blocked for ESP_GW_TX_STUCK_TIMEOUT.
+ */
+void NobleApi::drainQueues()
+{
+  int64_t now = Latency::now();
+  bool active[WEBSOCKETS_SERVER_CLIENT_MAX];
+  for (uint8_t client = 0; client < WEBSOCKETS_SERVER_CLIENT_MAX; client++)
+  {
+    active[client] = false;
+    if (!ws->clientIsConnected(client))
+    {
+      // late messages for a client that is gone
+      if (txQueues[client].depth() > 0)
+      {
+        txQueues[client].clear();
+      }
+      stuckClients[client] = false;
+      blockedSince[client] = 0;
+    }
+    else if (stuckClients[client] || (blockedSince[client] != 0 && (now - blockedSince[client]) / 1000 > ESP_GW_TX_STUCK_TIMEOUT))
+    {
+      Serial.printf("[%u] Not keeping up with messages, disconnecting\n", client);
+      Metrics::inc(METRIC_WS_STUCK_DISCONNECTS);
+      // cleanup clears the queue
+      ws->disconnect(client);
+    }
+    else
+    {
+      active[client] = true;
+    }
+  }
+
+  bool pending = false;
+  for (uint8_t kind = TX_CLASS_GATT; kind < TX_CLASS_COUNT; kind++)
+  {
+    uint16_t budget = kind == TX_CLASS_GATT ? ESP_GW_TX_QUEUE_SIZE : ESP_GW_TX_DRAIN_BUDGET;
+    for (uint8_t client = 0; client < WEBSOCKETS_SERVER_CLIENT_MAX; client++)
+    {
+      if (!active[client])
+      {
+        continue;
+      }
+      TxEntry entry;
+      // higher classes queued in the meantime still go first
+      for (uint16_t i = 0; i < budget && txQueues[client].depth() > 0; i++)
+      {
+        if (!ws->canWrite(client))
+        {
+          if (blockedSince[client] == 0)
+          {
+            blockedSince[client] = now;
+          }
+          active[client] = false;
+          break;
+        }
+        blockedSince[client] = 0;
+        if (!txQueues[client].pop(entry, (TxClass)kind))
+        {
+          break;
+        }
+        sendEntry(client, entry);
+        entry.buffer->release();
+      }
+      // blocked clients are retried on the next loop, not spun on
+      if (kind == TX_CLASS_COUNT - 1 && active[client])
+      {
+        pending |= txQueues[client].depth() > 0;
+      }
+    }
+  }
+  if (pending)
+  {
+    wake();
+  }
+}
+
+void NobleApi::sendEntry(const uint8_t client, TxEntry &entry)
+{
+  TxBuffer *buffer = entry.buffer;
+  int64_t waited = Latency::now() - entry.queued;
+  if (entry.op != LATENCY_OP_NONE)
+  {
+    Latency::record(entry.op, LATENCY_STAGE_QUEUE, waited);
+  }
+  if (ciphers[client] != nullptr && buffer->refs.load(std::memory_order_acquire) > 1)
+  {
+    // shared with other clients, each client has its own key, encrypt a copy in the client scratch frame
+    uint8_t *frame = scratchFrame(client, buffer->length);
+    if (frame == nullptr)
+    {
+      log_e("[%u] No memory to encrypt a %u byte message", client, buffer->length);
+      Metrics::inc(METRIC_WS_TX_DROPPED);
+      return;
+    }
+    memcpy(frame + TX_HEADROOM, buffer->payload(), buffer->length);
+    sendFrame(client, frame, buffer->length, buffer->binary);
+  }
+  else
+  {
+    sendFrame(client, buffer->frame, buffer->length, buffer->binary);
+  }
+  txQueues[client].sent(buffer->length, entry.kind, waited);
+}
+
+/**
+ * Send a serialized message that starts at buffer + ENCRYPTION_HEADER_SIZE, with ENCRYPTION_TAG_SIZE bytes of room after it.
+ * Encrypted clients get the message encrypted in place with the header and tag filled in.
+ */
+void NobleApi::sendFrame(const uint8_t client, uint8_t *buffer, size_t length, bool binary)
+{
+  Metrics::inc(METRIC_WS_TX_MESSAGES);
+  Metrics::inc(METRIC_WS_TX_BYTES, length);
+  if (ciphers[client] != nullptr)
+  {
+    if (encryptFrame(client, buffer, length))
+    {
+      ws->sendBIN(client, buffer, ENCRYPTION_HEADER_SIZE + length + ENCRYPTION_TAG_SIZE);
+    }
+  }
+  else if (binary)
+  {
+    ws->sendBIN(client, buffer + ENCRYPTION_HEADER_SIZE, length);
+  }
+  else
+  {
+    ws->sendTXT(client, buffer + ENCRYPTION_HEADER_SIZE, length);
+  }
+}
+
+/**
+ * Add a binary field to a message, as hex string for JSON clients and
+ * as a raw bin field for MessagePack clients
+ */
+void NobleApi::setBinary(JsonVariant field, const uint8_t *data, size_t length, const uint8_t client)
+{
+  WireFormat::setBinary(field, data, length, encodings[client] == WS_ENCODING_MSGPACK);
+}
+
+/**
+ * Size of a binary field received from a client, either hex string or array of bytes
+ */
+size_t NobleApi::getBinaryLength(JsonVariantConst field)
+{
+  if (field.is<JsonArrayConst>())
+  {
+    return field.size();
+  }
+  const char *hex = field;
+  if (hex != nullptr)
+  {
+    return Hex::decodedLength(strlen(hex));
+  }
+  return 0;
+}
+
+/**
+ * Read a binary field received from a client, either hex string or array of bytes
+ * @return false if the field is not valid hex
+ */
+bool NobleApi::getBinary(JsonVariantConst field, uint8_t *out, size_t length)
+{
+  if (field.is<JsonArrayConst>())
+  {
+    size_t i = 0;
+    for (JsonVariantConst value : field.as<JsonArrayConst>())
+    {
+      if (i >= length)
+      {
+        break;
       }
+      out[i++] = value.as<uint8_t>();
     }
   }
+  else if (length > 0)
+  {
+    const char *hex = field;
+    return Hex::decode(hex, strlen(hex), out);
+  }
+  return true;
 }
 
 void NobleApi::sendAuthMessage(const uint8_t client)
@@ -469,9 +840,9 @@ void NobleApi::sendAuthMessage(const uint8_t client)
     StaticJsonDocument<128> command;
     command["type"] = "auth";
     char challenge[BLOCK_SIZE * 2 + 1];
-    sec->toHex((uint8_t *)challenges[client], BLOCK_SIZE, challenge);
+    Hex::encode((uint8_t *)challenges[client], BLOCK_SIZE, challenge);
     command["challenge"] = challenge;
-    sendJsonMessage(command, client);
+    sendJsonMessage(command, client, TX_CLASS_STATE);
     command.clear();
   }
 }
@@ -488,16 +859,50 @@ void NobleApi::sendState(const uint8_t client)
   {
     command["state"] = "poweredOff";
   }
-  sendJsonMessage(command, client);
+  sendJsonMessage(command, client, TX_CLASS_STATE);
   command.clear();
 }
 
-void NobleApi::sendConnected(const uint8_t client, BLEPeripheralID id)
+/**
+ * Add the sequence and time of a recorded event
+ */
+void NobleApi::setEventTag(JsonDocument &command, const EventTag *tag)
+{
+  if (tag != nullptr && tag->seq > 0)
+  {
+    command["seq"] = tag->seq;
+    command["ts"] = tag->timestamp;
+    if (tag->replayed)
+    {
+      command["replayed"] = true;
+    }
+  }
+}
+
+void NobleApi::sendConnected(const uint8_t client, BLEPeripheralID id, const EventTag *tag)
 {
   StaticJsonDocument<128> command;
   command["type"] = "connect";
   command["peripheralUuid"] = BLEApi::idToString(id);
-  sendJsonMessage(command, client);
+  setEventTag(command, tag);
+  sendJsonMessage(command, client, TX_CLASS_STATE);
+}
+
+/**
+ * Persistent link is back with its subscriptions
+ * @param downtime ms the link was down, left out of replayed events
+ */
+void NobleApi::sendReconnected(const uint8_t client, BLEPeripheralID id, const EventTag *tag, uint32_t downtime)
+{
+  StaticJsonDocument<160> command;
+  command["type"] = "reconnected";
+  command["peripheralUuid"] = BLEApi::idToString(id);
+  if (downtime > 0)
+  {
+    command["downtime"] = downtime;
+  }
+  setEventTag(command, tag);
+  sendJsonMessage(command, client, TX_CLASS_STATE);
 }
 
 void NobleApi::sendDisconnected(const uint8_t client, BLEPeripheralID id)
@@ -505,16 +910,17 @@ void NobleApi::sendDisconnected(const uint8_t client, BLEPeripheralID id)
   sendDisconnected(client, id, "");
 }
 
-void NobleApi::sendDisconnected(const uint8_t client, BLEPeripheralID id, std::string reason)
+void NobleApi::sendDisconnected(const uint8_t client, BLEPeripheralID id, std::string reason, const EventTag *tag)
 {
-  StaticJsonDocument<128> command;
+  StaticJsonDocument<160> command;
   command["type"] = "disconnect";
   command["peripheralUuid"] = BLEApi::idToString(id);
   if (reason != "")
   {
     command["reason"] = reason;
   }
-  sendJsonMessage(command, client);
+  setEventTag(command, tag);
+  sendJsonMessage(command, client, TX_CLASS_STATE);
 }
 
 void NobleApi::sendServices(const uint8_t client, BLEPeripheralID id, std::vector<NimBLERemoteService *> *services)
@@ -570,31 +976,138 @@ void NobleApi::sendCharacteristics(const uint8_t client, BLEPeripheralID id, std
   sendJsonMessage(command, client);
 }
 
-void NobleApi::sendCharacteristicValue(
+void NobleApi::setCharacteristicValue(
+    JsonDocument &command,
     const uint8_t client,
     BLEPeripheralID id,
-    std::string service,
-    std::string characteristic,
-    std::string value,
-    bool isNotification)
+    const std::string &service,
+    const std::string &characteristic,
+    const std::string &value,
+    bool isNotification,
+    const EventTag *tag)
 {
-  StaticJsonDocument<384> command;
   command["type"] = "read";
   command["peripheralUuid"] = BLEApi::idToString(id);
   command["serviceUuid"] = service;
   command["characteristicUuid"] = characteristic;
   if (value.length() > 0)
   {
-    char hexValue[value.length() * 2 + 1];
-    sec->toHex((uint8_t *)value.c_str(), value.length(), hexValue);
-    command["data"] = std::string(hexValue);
+    setBinary(command["data"], (uint8_t *)value.c_str(), value.length(), client);
   }
   else
   {
-    command["data"] = "00";
+    const uint8_t empty = 0x00;
+    setBinary(command["data"], &empty, 1, client);
   }
   command["isNotification"] = isNotification;
-  sendJsonMessage(command, client);
+  setEventTag(command, tag);
+}
+
+void NobleApi::sendCharacteristicValue(
+    const uint8_t client,
+    BLEPeripheralID id,
+    std::string service,
+    std::string characteristic,
+    std::string value,
+    bool isNotification,
+    const EventTag *tag)
+{
+  StaticJsonDocument<384> command;
+  setCharacteristicValue(command, client, id, service, characteristic, value, isNotification, tag);
+  LatencyOp op = Latency::current();
+  if (tag != nullptr && tag->replayed)
+  {
+    op = LATENCY_OP_NONE;
+  }
+  else if (isNotification)
+  {
+    op = LATENCY_OP_NOTIFICATION;
+  }
+  sendJsonMessage(command, client, TX_CLASS_GATT, op);
+}
+
+/**
+ * Queue a notification for the clients of the target sessions.
+ * Each encoding is serialized once and shared by the queues.
+ */
+void NobleApi::sendNotification(uint32_t targets, BLEPeripheralID id, const std::string &service, const std::string &characteristic, const std::string &value, bool isNotify, const EventTag &tag)
+{
+  TxBuffer *text = nullptr;
+  TxBuffer *packed = nullptr;
+  for (uint8_t session = 0; session < WEBSOCKETS_SERVER_CLIENT_MAX; session++)
+  {
+    uint8_t client = sessions[session].client;
+    if (!(targets & (1u << session)) || client == INVALID_CLIENT)
+    {
+      continue;
+    }
+    bool binary = encodings[client] == WS_ENCODING_MSGPACK;
+    TxBuffer *&buffer = binary ? packed : text;
+    if (buffer == nullptr)
+    {
+      StaticJsonDocument<384> command;
+      setCharacteristicValue(command, client, id, service, characteristic, value, isNotify, &tag);
+      buffer = TxBuffer::fromJson(command, binary);
+    }
+    if (buffer != nullptr)
+    {
+      enqueue(client, buffer, TX_CLASS_GATT, BLEPeripheralID(), LATENCY_OP_NOTIFICATION);
+    }
+  }
+  if (text != nullptr)
+  {
+    text->release();
+  }
+  if (packed != nullptr)
+  {
+    packed->release();
+  }
+}
+
+/**
+ * Coalesced notifications of one characteristic, values are [ms since ts, data]
+ */
+void NobleApi::sendCharacteristicBatch(const uint8_t client, Subscription &subscription)
+{
+  // data is copied as hex (JSON) or bin (MessagePack) strings
+  TrackedJsonDocument command(JSON_OBJECT_SIZE(8) + JSON_ARRAY_SIZE(subscription.count) + subscription.count * (JSON_ARRAY_SIZE(2) + 8) + subscription.batchLength * 2 + 128);
+  command["type"] = "notifications";
+  command["peripheralUuid"] = BLEApi::idToString(subscription.id);
+  command["serviceUuid"] = (const char *)subscription.service;
+  command["characteristicUuid"] = (const char *)subscription.characteristic;
+  command["ts"] = subscription.timestamp;
+  if (subscription.seq > 0)
+  {
+    command["seq"] = subscription.seq;
+  }
+  JsonArray values = command.createNestedArray("values");
+  int64_t now = Latency::now();
+  size_t position = 0;
+  while (position < subscription.batchLength)
+  {
+    uint32_t offset;
+    uint16_t length;
+    const uint8_t *item = subscription.batch + position;
+    memcpy(&offset, item, sizeof(offset));
+    memcpy(&length, item + sizeof(offset), sizeof(length));
+    JsonArray value = values.createNestedArray();
+    value.add(offset / 1000);
+    if (length > 0)
+    {
+      setBinary(value.addElement(), item + BATCH_ITEM_HEADER, length, client);
+    }
+    else
+    {
+      const uint8_t empty = 0x00;
+      setBinary(value.addElement(), &empty, 1, client);
+    }
+    // time the notification was held back
+    Latency::record(LATENCY_OP_NOTIFICATION, LATENCY_STAGE_BATCH, now - subscription.started - offset);
+    position += BATCH_ITEM_HEADER + length;
+  }
+  Metrics::inc(METRIC_NOTIFICATION_BATCHES);
+  Metrics::inc(METRIC_NOTIFICATIONS_BATCHED, subscription.count);
+  sendJsonMessage(command, client, TX_CLASS_GATT, LATENCY_OP_NOTIFICATION);
 }
 
 void NobleApi::sendCharacteristicNotification(
@@ -613,6 +1126,17 @@ void NobleApi::sendCharacteristicNotification(
   sendJsonMessage(command, client);
 }
 
+void NobleApi::sendCharacteristicPoll(const uint8_t client, BLEPeripheralID id, std::string service, std::string characteristic, uint32_t interval)
+{
+  StaticJsonDocument<256> command;
+  command["type"] = "poll";
+  command["peripheralUuid"] = BLEApi::idToString(id);
+  command["serviceUuid"] = service;
+  command["characteristicUuid"] = characteristic;
+  command["interval"] = interval;
+  sendJsonMessage(command, client);
+}
+
 void NobleApi::sendCharacteristicWrite(const uint8_t client, BLEPeripheralID id, std::string service, std::string characteristic)
 {
   StaticJsonDocument<256> command;
@@ -623,50 +1147,90 @@ void NobleApi::sendCharacteristicWrite(const uint8_t client, BLEPeripheralID id,
   sendJsonMessage(command, client);
 }
 
-bool NobleApi::addClient(BLEPeripheralID id, uint8_t client)
+/**
+ * BLE operation refused, the client can retry after retryAfter ms when it is rate limited
+ */
+void NobleApi::sendBusy(const uint8_t client, const NobleAction *action, NobleCommand &request, const char *reason, uint32_t retryAfter)
 {
-  if (activeConnections < MAX_CLIENT_CONNECTIONS)
+  StaticJsonDocument<256> command;
+  command["type"] = "busy";
+  command["action"] = action->name;
+  if (action->fields & CMD_FIELD_PERIPHERAL)
   {
-    for (auto i = 0; i < MAX_CLIENT_CONNECTIONS; i++)
-    {
-      if (peripheralConnections[i].client == INVALID_CLIENT)
-      {
-        peripheralConnections[i].client = client;
-        peripheralConnections[i].id = id;
-        activeConnections++;
-        return true;
-      }
-    }
+    command["peripheralUuid"] = BLEApi::idToString(request.peripheralUuid);
+  }
+  if (strlen(request.serviceUuid) > 0)
+  {
+    command["serviceUuid"] = request.serviceUuid;
+  }
+  if (strlen(request.characteristicUuid) > 0)
+  {
+    command["characteristicUuid"] = request.characteristicUuid;
   }
-  return false;
+  command["reason"] = reason;
+  if (retryAfter > 0)
+  {
+    command["retryAfter"] = retryAfter;
+  }
+  sendJsonMessage(command, client);
 }
 
-uint8_t NobleApi::getClient(BLEPeripheralID id)
+/**
+ * Add a session reference to the peripheral link, creating the link if needed
+ * @return false if all link slots are taken
+ */
+bool NobleApi::addClient(BLEPeripheralID id, uint8_t session)
 {
-  if (activeConnections > 0)
+  Link *link = LinkRegistry::acquire(id);
+  if (link == nullptr)
   {
-    for (auto i = 0; i < MAX_CLIENT_CONNECTIONS; i++)
-    {
-      if (peripheralConnections[i].id == id)
-      {
-        return peripheralConnections[i].client;
-      }
-    }
+    return false;
+  }
+  link->sessions |= 1u << session;
+  return true;
+}
+
+/**
+ * Sessions holding a reference to the peripheral, 0 if there is no link
+ */
+uint32_t NobleApi::getSessions(BLEPeripheralID id)
+{
+  Link *link = LinkRegistry::find(id);
+  return link != nullptr ? link->sessions : 0;
+}
+
+/**
+ * Drop the reference of a session with its subscriptions, the link is closed with the last reference
+ */
+void NobleApi::releaseClient(BLEPeripheralID id, uint8_t session)
+{
+  uint32_t remaining = getSessions(id) & ~(1u << session);
+  if (remaining == 0)
+  {
+    BLEApi::disconnect(id);
+    delClient(id);
+    return;
+  }
+  removeSubscriptions(id, session);
+  Link *link = LinkRegistry::find(id);
+  if (link != nullptr)
+  {
+    link->sessions = remaining;
   }
-  return INVALID_CLIENT;
 }
 
+/**
+ * Link is gone, drop all references and subscriptions
+ */
 void NobleApi::delClient(BLEPeripheralID id)
 {
-  if (activeConnections > 0)
+  removeSubscriptions(id);
+  Link *link = LinkRegistry::find(id);
+  if (link != nullptr)
   {
-    for (auto i = 0; i < MAX_CLIENT_CONNECTIONS; i++)
-    {
-      if (peripheralConnections[i].id == id)
-      {
-        peripheralConnections[i].client = INVALID_CLIENT;
-        activeConnections--;
-      }
-    }
+    link->sessions = 0;
+    link->persistent = false;
+    link->reconnecting = false;
+    LinkRegistry::release(link);
   }
-}
\ No newline at end of file
+}
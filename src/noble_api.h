@@ -5,61 +5,362 @@
 #define ESP_GW_WEBSOCKET_PORT 8080
 #endif
 
+#ifndef ESP_GW_SESSION_TTL
+#define ESP_GW_SESSION_TTL 60000 // ms a session can be resumed after the client disconnected
+#endif
+
+#ifndef ESP_GW_MAX_SUBSCRIPTIONS
+#define ESP_GW_MAX_SUBSCRIPTIONS (MAX_CLIENT_CONNECTIONS * 4)
+#endif
+
+#ifndef ESP_GW_MAX_BATCH
+#define ESP_GW_MAX_BATCH 32 // notifications coalesced in one frame
+#endif
+
+#ifndef ESP_GW_MIN_POLL_INTERVAL
+#define ESP_GW_MIN_POLL_INTERVAL 100 // ms
+#endif
+
+// backoff between reconnect attempts of persistent links, ms
+#ifndef ESP_GW_RECONNECT_MIN
+#define ESP_GW_RECONNECT_MIN 1000
+#endif
+
+#ifndef ESP_GW_RECONNECT_MAX
+#define ESP_GW_RECONNECT_MAX 60000
+#endif
+
+// s a reconnect attempt can take, client connects wait for it
+#ifndef ESP_GW_RECONNECT_TIMEOUT
+#define ESP_GW_RECONNECT_TIMEOUT 3
+#endif
+
+// ms connectMatching waits for a matching advertisement
+#ifndef ESP_GW_MATCH_TIMEOUT
+#define ESP_GW_MATCH_TIMEOUT 10000
+#endif
+
+#ifndef ESP_GW_MATCH_MAX_TIMEOUT
+#define ESP_GW_MATCH_MAX_TIMEOUT 60000
+#endif
+
+// devices per getDevices message
+#ifndef ESP_GW_PRESENCE_PAGE
+#ifdef BOARD_HAS_PSRAM
+#define ESP_GW_PRESENCE_PAGE 32
+#else
+#define ESP_GW_PRESENCE_PAGE 16
+#endif
+#endif
+
+#ifndef ESP_GW_MIN_REPORT_INTERVAL
+#define ESP_GW_MIN_REPORT_INTERVAL 1000 // ms
+#endif
+
+// 0 leaves out the raw manufacturerData of advertisements decoded on the gateway
+#ifndef ESP_GW_DECODED_RAW
+#define ESP_GW_DECODED_RAW 1
+#endif
+
+#define RECONNECT_IDLE 0
+#define RECONNECT_RUNNING 1 // attempt handed to the reconnect task
+#define RECONNECT_DONE 2    // result waiting for the API task
+
+#define LOST_LINKS_SIZE (MAX_CLIENT_CONNECTIONS * 2) // disconnects waiting for the API task
+
+#define MATCH_ANY_MANUFACTURER -1
+#define MATCH_ANY_RSSI -128
+
+#define BATCH_ITEM_HEADER 6 // 4 bytes offset in us, 2 bytes length
+
+#define FILTER_CHANGE (1 << 0)   // only when the value changed
+#define FILTER_DELTA (1 << 1)    // only when a number in the value moved by more than delta
+#define FILTER_INTERVAL (1 << 2) // at most once per minInterval
+
+#define ENCRYPTION_HEADER_SIZE 8 // message counter in front of each encrypted frame
+#define ENCRYPTION_TAG_SIZE 16   // AES-CMAC of the counter block and the encrypted message, after it
+#define ENCRYPTION_DIRECTION_TX 0x00
+#define ENCRYPTION_DIRECTION_RX 0x01
+
 #define INVALID_CLIENT 255
+#define INVALID_SESSION 255
+#define DEVICES_IDLE UINT16_MAX
+
+#define WS_ENCODING_JSON 0
+#define WS_ENCODING_MSGPACK 1
 
-#include <WebSocketsServer.h>
+#include "ws_server.h"
 #include <ArduinoJson.h>
 #include "gw_settings.h"
 #include "security.h"
+#include "hex.h"
+#include "wire_format.h"
+#include "memory_stats.h"
 #include "ble_api.h"
+#include "link_registry.h"
+#include "noble_commands.h"
+#include "tx_queue.h"
+#include "ble_queue.h"
+#include "replay.h"
+#include "presence.h"
+#include "decoders.h"
 
-struct PeripheralClient {
-  BLEPeripheralID id;
+static_assert(TX_HEADROOM == ENCRYPTION_HEADER_SIZE, "queued frames must fit the encryption header");
+static_assert(TX_TAILROOM >= ENCRYPTION_TAG_SIZE, "queued frames must fit the encryption tag");
+static_assert(WEBSOCKETS_SERVER_CLIENT_MAX <= REPLAY_MAX_SESSIONS, "sessions must fit the session masks");
+
+typedef uint8_t Challenge[BLOCK_SIZE];
+
+struct ClientSession {
+  uint8_t token[BLOCK_SIZE];
   uint8_t client;
+  bool active;
+  uint32_t expires;
+  uint32_t seq; // last event sequence
 };
 
-typedef uint8_t Challenge[BLOCK_SIZE];
+/**
+ * Server side notification filter, compares against the last forwarded value
+ */
+struct NotificationFilter {
+  uint8_t flags;
+  uint8_t offset; // little endian number at offset, width 1, 2 or 4 bytes
+  uint8_t width;
+  bool isSigned;
+  uint16_t minInterval;
+  uint32_t delta;
+  bool hasLast;
+  uint16_t lastLength;
+  uint32_t lastHash;
+  uint32_t lastNumber;
+  uint32_t lastForwarded;
+  uint32_t suppressed;
+};
+
+struct Subscription {
+  bool active;
+  uint8_t session;
+  BLEPeripheralID id;
+  char service[REPLAY_MAX_UUID + 1];
+  char characteristic[REPLAY_MAX_UUID + 1];
+  uint16_t maxDelay; // ms a notification can be held for coalescing, 0 to send right away
+  uint8_t maxBatch;
+  NotificationFilter filter;
+  bool notifying;
+  uint32_t pollInterval; // ms between server side reads, 0 when not polled
+  uint32_t nextPoll;
+  // pending batch, items are [offset from started][length][data]
+  uint8_t count;
+  uint32_t seq;
+  uint32_t timestamp;
+  int64_t started;
+  uint8_t *batch;
+  size_t batchLength;
+  size_t batchCapacity;
+};
+
+/**
+ * Pending connectMatching of a client, unset criteria match anything
+ */
+struct ConnectMatch {
+  bool active;
+  bool found;
+  bool scanning; // scan was started for the match
+  bool persistent;
+  bool hasService;
+  NimBLEUUID service;
+  char name[32];
+  int32_t manufacturerId; // company identifier, first two bytes of the manufacturer data
+  int16_t minRssi;
+  uint32_t started;
+  uint32_t deadline;
+  BLEPeripheralID id;
+  int16_t rssi;
+};
 
 class NobleApi
 {
 public:
   static bool init();
   static void loop();
+  static void setTask(TaskHandle_t task);
+  static void setReconnectTask(TaskHandle_t task);
+  static void wake();
+  static void runReconnect();
 
 private:
+  friend struct NobleActions;
   static bool ready;
+  static TaskHandle_t task;
   static Security *sec;
-  static WebSocketsServer *ws;
+  static GwWebSocketsServer *ws;
   // static std::map<uint32_t, std::string> challenges;
   static Challenge challenges[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static uint8_t encodings[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static uint32_t connectedAt[WEBSOCKETS_SERVER_CLIENT_MAX];
+
+  static Security *ciphers[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static Security *macs[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static uint64_t txCounters[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static uint64_t rxCounters[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static uint8_t *scratch[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static size_t scratchSize[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static bool enableEncryption(uint8_t client);
+  static void disableEncryption(uint8_t client);
+  static bool encryptFrame(uint8_t client, uint8_t *buffer, size_t length);
+  static uint8_t *scratchFrame(uint8_t client, size_t length);
+  static bool decryptFrame(uint8_t client, uint8_t *buffer, size_t length);
+
+  static ClientSession sessions[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static void initSessions();
+  static uint8_t createSession(uint8_t client);
+  static uint8_t getSession(uint8_t client);
+  static bool resumeSession(uint8_t client, const uint8_t proof[BLOCK_SIZE], bool encrypt, int64_t lastSeq);
+  static void detachSession(uint8_t session);
+  static void expireSessions();
+  static void clearSession(uint8_t session);
+  static void sendSession(const uint8_t client, uint8_t session);
+  static void clientReady(uint8_t client);
 
+  static portMUX_TYPE replayMux;
+  static uint8_t replaySessions[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static uint32_t replayCursors[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static uint32_t replayAfter[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static uint32_t recordEvent(uint32_t targets, BLEPeripheralID id, ReplayType type, EventTag &tag, const std::string &service = "", const std::string &characteristic = "", const std::string &data = "");
+  static void attachSession(uint8_t client, uint8_t session, int64_t lastSeq);
+  static void continueReplays();
+  static void finishReplay(uint8_t client);
+  static void sendGap(const uint8_t client, uint32_t from, uint32_t to);
+
+  static Subscription subscriptions[ESP_GW_MAX_SUBSCRIPTIONS];
+  static SemaphoreHandle_t subscriptionsLock;
+  static void initSubscriptions();
+  static Subscription *findSubscription(BLEPeripheralID id, const char *service, const char *characteristic, uint8_t session);
+  static Subscription *addSubscription(BLEPeripheralID id, const char *service, const char *characteristic, uint8_t session);
+  static Subscription *lookupSubscription(BLEPeripheralID id, const char *service, const char *characteristic, uint8_t session);
+  static uint8_t countNotifying(BLEPeripheralID id, const char *service, const char *characteristic);
+  static void removeSubscription(Subscription &subscription);
+  static void removeSubscriptions(BLEPeripheralID id);
+  static void removeSubscriptions(BLEPeripheralID id, uint8_t session);
+  static void setFilter(Subscription &subscription, JsonVariantConst filter);
+  static bool passFilter(NotificationFilter &filter, const std::string &data);
+  static uint32_t filterNotification(uint32_t targets, BLEPeripheralID id, const std::string &service, const std::string &characteristic, const std::string &data, bool polled);
+  static void subscriptionsToJson(JsonArray out);
+  static uint32_t batchNotification(uint32_t targets, BLEPeripheralID id, const std::string &service, const std::string &characteristic, const std::string &data, const EventTag &tag);
+  static void flushBatch(Subscription &subscription);
+  static void flushBatches();
+  static uint8_t pollCursor;
+  static void pollSubscriptions();
+  static void handlePollRead(uint8_t client, NobleCommand &command);
+  static const NobleAction pollReadAction;
+  static void restoreSubscriptions(BLEPeripheralID id);
+  static QueueHandle_t lostLinks;
+  static void handleLostLinks();
+  static TaskHandle_t reconnectTask;
+  static std::atomic<uint8_t> reconnectState;
+  static BLEPeripheralID reconnectId;
+  static bool reconnectResult;
+  static void reconnectLinks();
+  static void finishReconnect();
+
+  static ConnectMatch matches[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static portMUX_TYPE matchMux;
+  static void matchDevice(NimBLEAdvertisedDevice *advertisedDevice, BLEPeripheralID id);
+  static void connectMatches();
+  static void cancelMatch(uint8_t client);
+  static void sendConnectMatching(const uint8_t client, const ConnectMatch &match, const char *reason);
+  static void sendDevices(const uint8_t client);
+  // getDevices snapshots in progress, next slot to copy and the last page queued
+  static uint16_t deviceCursors[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static TxBuffer *devicePages[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static void continueDevices();
+  static DecoderSource setDecoded(JsonObject advertisement, NimBLEAdvertisedDevice *advertisedDevice);
+
+  // clients getting a scan report per window instead of every advertisement
+  static bool scanReports[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static uint32_t reportInterval;
+  static uint32_t reportStarted;
+  static bool wantsDiscover();
+  static void sendScanReports();
+  static void setScanReport(JsonDocument &command, const uint8_t client, const PresenceEntry *page, uint16_t count, uint32_t window, bool first, bool more);
+
+  static StaticJsonDocument<384> commandFilter;
+  static void initCommands();
+  static const NobleAction *findAction(const char *name);
+  static bool parseCommand(JsonDocument &document, uint32_t fields, NobleCommand &command);
+  static void processCommand(uint8_t client, JsonDocument &document, int64_t received);
+  static void runCommand(uint8_t client, const NobleAction *action, JsonDocument &document, int64_t received);
+  static void handleAuth(uint8_t client, NobleCommand &command);
+  static void handleResume(uint8_t client, NobleCommand &command);
+  static void handleStartScanning(uint8_t client, NobleCommand &command);
+  static void handleStopScanning(uint8_t client, NobleCommand &command);
+  static void handleConnect(uint8_t client, NobleCommand &command);
+  static void handleConnectMatching(uint8_t client, NobleCommand &command);
+  static void handleDiscoverServices(uint8_t client, NobleCommand &command);
+  static void handleDiscoverCharacteristics(uint8_t client, NobleCommand &command);
+  static void handleRead(uint8_t client, NobleCommand &command);
+  static void handleWrite(uint8_t client, NobleCommand &command);
+  static void handleNotify(uint8_t client, NobleCommand &command);
+  static void handlePoll(uint8_t client, NobleCommand &command);
+  static void handleStats(uint8_t client, NobleCommand &command);
+  static void handleGetDevices(uint8_t client, NobleCommand &command);
+
+  static bool isEmptyChallenge(Challenge challenge);
+  static void clearChallenge(Challenge challenge);
   static void clientDisconnectCleanup(uint8_t client);
-  static bool clientCanConnect(uint8_t client, BLEPeripheralID id);
   static bool clientConnected(uint8_t client, BLEPeripheralID id);
 
   static void initClient(uint8_t client);
-  static void checkAuth(uint8_t client, const char *response);
-  static void sendJsonMessage(JsonDocument &command, const uint8_t client);
-  static void sendJsonMessage(JsonDocument &command);
+  static void checkAuth(uint8_t client, const char *response, bool encrypt);
+  static void sendJsonMessage(JsonDocument &command, const uint8_t client, TxClass kind = TX_CLASS_GATT, LatencyOp op = Latency::current());
+  static uint8_t sendDiscover(JsonDocument &command, BLEPeripheralID id);
+  static void sendFrame(const uint8_t client, uint8_t *buffer, size_t length, bool binary);
+
+  static TxQueue txQueues[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static std::atomic<bool> stuckClients[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static int64_t blockedSince[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static void enqueue(const uint8_t client, TxBuffer *buffer, TxClass kind, BLEPeripheralID id, LatencyOp op, uint16_t page = TX_PAGE_NONE);
+  static void drainQueues();
+  static void sendEntry(const uint8_t client, TxEntry &entry);
+  static BLEQueue bleQueues[WEBSOCKETS_SERVER_CLIENT_MAX];
+  static uint8_t bleCursor;
+  static bool bleTurn;
+  static void scheduleCommand(uint8_t client, const NobleAction *action, JsonDocument &document, NobleCommand &command, int64_t received);
+  static const char *queueBLEOp(uint8_t client, const NobleAction *action, JsonDocument &document, BLEPeripheralID id, int64_t received, uint32_t &retryAfter);
+  static bool chargeSessions(uint32_t targets, uint32_t &retryAfter);
+  static void runBLEOps();
+  static void setBinary(JsonVariant field, const uint8_t *data, size_t length, const uint8_t client);
+  static size_t getBinaryLength(JsonVariantConst field);
+  static bool getBinary(JsonVariantConst field, uint8_t *out, size_t length);
   static void sendAuthMessage(const uint8_t client);
   static void sendState(const uint8_t client);
-  static void sendConnected(const uint8_t client, BLEPeripheralID id);
+  static void setEventTag(JsonDocument &command, const EventTag *tag);
+  static void sendConnected(const uint8_t client, BLEPeripheralID id, const EventTag *tag = nullptr);
+  static void sendReconnected(const uint8_t client, BLEPeripheralID id, const EventTag *tag, uint32_t downtime = 0);
   static void sendDisconnected(const uint8_t client, BLEPeripheralID id);
-  static void sendDisconnected(const uint8_t client, BLEPeripheralID id, std::string reason);
+  static void sendDisconnected(const uint8_t client, BLEPeripheralID id, std::string reason, const EventTag *tag = nullptr);
   static void sendServices(const uint8_t client, BLEPeripheralID id, std::vector<NimBLERemoteService *> *services);
   static void sendCharacteristics(const uint8_t client, BLEPeripheralID id, std::string service, std::vector<NimBLERemoteCharacteristic *> *characteristics);
-  static void sendCharacteristicValue(const uint8_t client, BLEPeripheralID id, std::string service, std::string characteristic, std::string value, bool isNotification = false);
+  static void setCharacteristicValue(JsonDocument &command, const uint8_t client, BLEPeripheralID id, const std::string &service, const std::string &characteristic, const std::string &value, bool isNotification, const EventTag *tag);
+  static void sendCharacteristicValue(const uint8_t client, BLEPeripheralID id, std::string service, std::string characteristic, std::string value, bool isNotification = false, const EventTag *tag = nullptr);
+  static void sendNotification(uint32_t targets, BLEPeripheralID id, const std::string &service, const std::string &characteristic, const std::string &value, bool isNotify, const EventTag &tag);
+  static void sendCharacteristicBatch(const uint8_t client, Subscription &subscription);
   static void sendCharacteristicNotification(const uint8_t client, BLEPeripheralID id, std::string service, std::string characteristic, bool state);
+  static void sendCharacteristicPoll(const uint8_t client, BLEPeripheralID id, std::string service, std::string characteristic, uint32_t interval);
   static void sendCharacteristicWrite(const uint8_t client, BLEPeripheralID id, std::string service, std::string characteristic);
+  static void sendBusy(const uint8_t client, const NobleAction *action, NobleCommand &request, const char *reason, uint32_t retryAfter);
   static void onWsEvent(uint8_t client, WStype_t type, uint8_t *payload, size_t length);
   static void onBLEDeviceFound(NimBLEAdvertisedDevice *advertisedDevice, BLEPeripheralID id);
   static void onBLEDeviceDisconnected(BLEPeripheralID id);
   static void onCharacteristicNotification(BLEPeripheralID id, std::string service, std::string characteristic, std::string data, bool isNotify);
+  static void deliverNotification(uint32_t targets, BLEPeripheralID id, const std::string &service, const std::string &characteristic, const std::string &data, bool isNotify, bool polled = false);
+  static void peripheralGone(BLEPeripheralID id, std::string reason);
 
-  static PeripheralClient peripheralConnections[MAX_CLIENT_CONNECTIONS];
-  static uint8_t activeConnections;
-  static bool addClient(BLEPeripheralID id, uint8_t client);
-  static uint8_t getClient(BLEPeripheralID id);
+  // peripheral links are shared by the sessions holding a reference to them,
+  // sessions of disconnected clients keep theirs until they expire
+  static bool addClient(BLEPeripheralID id, uint8_t session);
+  static uint32_t getSessions(BLEPeripheralID id);
+  static void releaseClient(BLEPeripheralID id, uint8_t session);
   static void delClient(BLEPeripheralID id);
 };
 
@@ -0,0 +1,730 @@
+#include "noble_api.h"
+
+StaticJsonDocument<384> NobleApi::commandFilter;
+
+/**
+ * JSON keys for each CMD_FIELD_* bit
+ */
+static const char *commandFields[CMD_FIELD_COUNT] = {
+    "peripheralUuid",
+    "serviceUuid",
+    "characteristicUuid",
+    "data",
+    "withoutResponse",
+    "notify",
+    "allowDuplicates",
+    "response",
+    "proof",
+    "encrypt",
+    "lastSeq",
+    "maxDelay",
+    "maxBatch",
+    "filter",
+    "interval",
+    "maxAge",
+    "persistent",
+    "timeout",
+};
+
+/**
+ * Action table, must be kept sorted by name as it is binary searched
+ */
+struct NobleActions
+{
+  static constexpr NobleAction table[] = {
+      {"auth", NobleApi::handleAuth, CMD_FIELD_RESPONSE | CMD_FIELD_ENCRYPT, CMD_AUTH_ONLY, LATENCY_OP_NONE},
+      {"connect", NobleApi::handleConnect, CMD_FIELD_PERIPHERAL | CMD_FIELD_PERSISTENT, CMD_SCHEDULED, LATENCY_OP_CONNECT},
+      {"connectMatching", NobleApi::handleConnectMatching, CMD_FIELD_FILTER | CMD_FIELD_TIMEOUT | CMD_FIELD_PERSISTENT, 0, LATENCY_OP_NONE},
+      {"discoverCharacteristics", NobleApi::handleDiscoverCharacteristics, CMD_FIELD_PERIPHERAL | CMD_FIELD_SERVICE, CMD_CONNECTED_ONLY | CMD_SCHEDULED, LATENCY_OP_DISCOVER},
+      {"discoverServices", NobleApi::handleDiscoverServices, CMD_FIELD_PERIPHERAL, CMD_CONNECTED_ONLY | CMD_SCHEDULED, LATENCY_OP_DISCOVER},
+      {"getDevices", NobleApi::handleGetDevices, 0, 0, LATENCY_OP_NONE},
+      {"notify", NobleApi::handleNotify, CMD_FIELD_PERIPHERAL | CMD_FIELD_SERVICE | CMD_FIELD_CHARACTERISTIC | CMD_FIELD_NOTIFY | CMD_FIELD_MAX_DELAY | CMD_FIELD_MAX_BATCH | CMD_FIELD_FILTER, CMD_CONNECTED_ONLY | CMD_SCHEDULED, LATENCY_OP_SUBSCRIBE},
+      {"poll", NobleApi::handlePoll, CMD_FIELD_PERIPHERAL | CMD_FIELD_SERVICE | CMD_FIELD_CHARACTERISTIC | CMD_FIELD_INTERVAL | CMD_FIELD_FILTER, CMD_CONNECTED_ONLY, LATENCY_OP_NONE},
+      {"read", NobleApi::handleRead, CMD_FIELD_PERIPHERAL | CMD_FIELD_SERVICE | CMD_FIELD_CHARACTERISTIC | CMD_FIELD_MAX_AGE, CMD_CONNECTED_ONLY | CMD_SCHEDULED, LATENCY_OP_READ},
+      {"resume", NobleApi::handleResume, CMD_FIELD_PROOF | CMD_FIELD_ENCRYPT | CMD_FIELD_LAST_SEQ, CMD_AUTH_ONLY, LATENCY_OP_NONE},
+      {"startScanning", NobleApi::handleStartScanning, CMD_FIELD_ALLOW_DUPLICATES | CMD_FIELD_INTERVAL, 0, LATENCY_OP_NONE},
+      {"stats", NobleApi::handleStats, 0, 0, LATENCY_OP_NONE},
+      {"stopScanning", NobleApi::handleStopScanning, 0, 0, LATENCY_OP_NONE},
+      {"write", NobleApi::handleWrite, CMD_FIELD_PERIPHERAL | CMD_FIELD_SERVICE | CMD_FIELD_CHARACTERISTIC | CMD_FIELD_DATA | CMD_FIELD_WITHOUT_RESPONSE, CMD_CONNECTED_ONLY | CMD_SCHEDULED, LATENCY_OP_WRITE},
+  };
+  static constexpr size_t count = sizeof(table) / sizeof(table[0]);
+};
+
+constexpr NobleAction NobleActions::table[];
+
+constexpr int compareActionNames(const char *a, const char *b)
+{
+  return (*a != *b || *a == '\0') ? (*a - *b) : compareActionNames(a + 1, b + 1);
+}
+
+constexpr bool actionsSorted(const NobleAction *table, size_t count)
+{
+  return count < 2 || (compareActionNames(table[0].name, table[1].name) < 0 && actionsSorted(table + 1, count - 1));
+}
+
+static_assert(actionsSorted(NobleActions::table, NobleActions::count), "NobleActions::table must be sorted by name");
+
+/**
+ * Read queued by pollSubscriptions() for the client of the polling session, not in the table so clients cannot send it
+ */
+const NobleAction NobleApi::pollReadAction = {"pollRead", NobleApi::handlePollRead, CMD_FIELD_PERIPHERAL | CMD_FIELD_SERVICE | CMD_FIELD_CHARACTERISTIC, CMD_SCHEDULED, LATENCY_OP_NONE};
+
+/**
+ * Build the deserialization filter from the fields used by all actions
+ */
+void NobleApi::initCommands()
+{
+  uint32_t fields = 0;
+  for (size_t i = 0; i < NobleActions::count; i++)
+  {
+    fields |= NobleActions::table[i].fields;
+  }
+  commandFilter.clear();
+  commandFilter["action"] = true;
+  for (uint8_t i = 0; i < CMD_FIELD_COUNT; i++)
+  {
+    if (fields & (1u << i))
+    {
+      commandFilter[commandFields[i]] = true;
+    }
+  }
+}
+
+/**
+ * Find the action handler by name
+ */
+const NobleAction *NobleApi::findAction(const char *name)
+{
+  size_t low = 0;
+  size_t high = NobleActions::count;
+  while (low < high)
+  {
+    size_t middle = (low + high) / 2;
+    int result = strcmp(name, NobleActions::table[middle].name);
+    if (result == 0)
+    {
+      return &NobleActions::table[middle];
+    }
+    if (result < 0)
+    {
+      high = middle;
+    }
+    else
+    {
+      low = middle + 1;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Read the declared fields of a command
+ * @return false if a required field is missing
+ */
+bool NobleApi::parseCommand(JsonDocument &document, uint32_t fields, NobleCommand &command)
+{
+  command.serviceUuid = "";
+  command.characteristicUuid = "";
+  command.response = "";
+  command.proof = "";
+  command.withoutResponse = false;
+  command.notify = false;
+  command.allowDuplicates = false;
+  command.encrypt = false;
+  command.lastSeq = -1;
+  command.maxDelay = 0;
+  command.maxBatch = ESP_GW_MAX_BATCH;
+  command.interval = 0;
+  command.maxAge = 0;
+  command.persistent = false;
+  command.timeout = 0;
+
+  if (fields & CMD_FIELD_PERIPHERAL)
+  {
+    const char *peripheralUuid = document["peripheralUuid"];
+    if (peripheralUuid == nullptr)
+    {
+      return false;
+    }
+    command.peripheralUuid = BLEApi::idFromString(peripheralUuid);
+  }
+  if (fields & CMD_FIELD_SERVICE)
+  {
+    command.serviceUuid = document["serviceUuid"] | "";
+  }
+  if (fields & CMD_FIELD_CHARACTERISTIC)
+  {
+    command.characteristicUuid = document["characteristicUuid"] | "";
+  }
+  if (fields & CMD_FIELD_DATA)
+  {
+    command.data = document["data"];
+  }
+  if (fields & CMD_FIELD_RESPONSE)
+  {
+    command.response = document["response"] | "";
+  }
+  if (fields & CMD_FIELD_PROOF)
+  {
+    command.proof = document["proof"] | "";
+  }
+  if (fields & CMD_FIELD_WITHOUT_RESPONSE)
+  {
+    command.withoutResponse = document["withoutResponse"];
+  }
+  if (fields & CMD_FIELD_NOTIFY)
+  {
+    command.notify = document["notify"];
+  }
+  if (fields & CMD_FIELD_ALLOW_DUPLICATES)
+  {
+    command.allowDuplicates = document["allowDuplicates"];
+  }
+  if (fields & CMD_FIELD_ENCRYPT)
+  {
+    command.encrypt = document["encrypt"];
+  }
+  if ((fields & CMD_FIELD_LAST_SEQ) && document["lastSeq"].is<uint32_t>())
+  {
+    command.lastSeq = document["lastSeq"].as<uint32_t>();
+  }
+  if (fields & CMD_FIELD_MAX_DELAY)
+  {
+    command.maxDelay = document["maxDelay"].as<uint16_t>();
+  }
+  if (fields & CMD_FIELD_FILTER)
+  {
+    command.filter = document["filter"];
+  }
+  if (fields & CMD_FIELD_INTERVAL)
+  {
+    command.interval = document["interval"] | 0;
+  }
+  if (fields & CMD_FIELD_MAX_AGE)
+  {
+    command.maxAge = document["maxAge"] | 0;
+  }
+  if (fields & CMD_FIELD_PERSISTENT)
+  {
+    command.persistent = document["persistent"];
+  }
+  if (fields & CMD_FIELD_TIMEOUT)
+  {
+    command.timeout = document["timeout"] | 0;
+  }
+  if (fields & CMD_FIELD_MAX_BATCH)
+  {
+    int maxBatch = document["maxBatch"] | ESP_GW_MAX_BATCH;
+    command.maxBatch = maxBatch <= 0 || maxBatch > ESP_GW_MAX_BATCH ? ESP_GW_MAX_BATCH : maxBatch;
+  }
+  return true;
+}
+
+/**
+ * Process a decoded command from a client
+ */
+void NobleApi::processCommand(uint8_t client, JsonDocument &document, int64_t received)
+{
+  const char *name = document["action"];
+  if (name == nullptr || name[0] == '\0')
+  {
+    return;
+  }
+  const NobleAction *action = findAction(name);
+  if (action == nullptr)
+  {
+    return;
+  }
+
+  // client that is not authenticated can only auth
+  bool authenticated = isEmptyChallenge(challenges[client]);
+  if (authenticated == ((action->rules & CMD_AUTH_ONLY) != 0))
+  {
+    return;
+  }
+
+  if (action->rules & CMD_SCHEDULED)
+  {
+    NobleCommand command;
+    if (!parseCommand(document, action->fields, command))
+    {
+      return;
+    }
+    // refuse early what would be refused when it runs
+    if ((action->rules & CMD_CONNECTED_ONLY) && !clientConnected(client, command.peripheralUuid))
+    {
+      sendDisconnected(client, command.peripheralUuid, "not connected");
+      return;
+    }
+    scheduleCommand(client, action, document, command, received);
+    return;
+  }
+  runCommand(client, action, document, received);
+}
+
+/**
+ * Check the action rules and run its handler
+ */
+void NobleApi::runCommand(uint8_t client, const NobleAction *action, JsonDocument &document, int64_t received)
+{
+  NobleCommand command;
+  if (!parseCommand(document, action->fields, command))
+  {
+    // failed to read peripheralUuid
+    return;
+  }
+
+  // actions that require a connection, the link can be gone by the time a queued command runs
+  if ((action->rules & CMD_CONNECTED_ONLY) && !clientConnected(client, command.peripheralUuid))
+  {
+    sendDisconnected(client, command.peripheralUuid, "not connected");
+    return;
+  }
+
+  Latency::begin(action->latency, received);
+  action->handler(client, command);
+  Latency::end();
+}
+
+/**
+ * Queue BLE work of a client, or tell it right away that the gateway is busy
+ */
+void NobleApi::scheduleCommand(uint8_t client, const NobleAction *action, JsonDocument &document, NobleCommand &command, int64_t received)
+{
+  uint32_t retryAfter = 0;
+  const char *reason = queueBLEOp(client, action, document, command.peripheralUuid, received, retryAfter);
+  if (reason != nullptr)
+  {
+    sendBusy(client, action, command, reason, retryAfter);
+  }
+}
+
+/**
+ * Admit BLE work to the queue of a client, also used for the work the gateway does on behalf of a client
+ * @return nullptr once queued, else why it was refused ("queue", "peripheral" or "rate", retryAfter is set for "rate")
+ */
+const char *NobleApi::queueBLEOp(uint8_t client, const NobleAction *action, JsonDocument &document, BLEPeripheralID id, int64_t received, uint32_t &retryAfter)
+{
+  BLEQueue &queue = bleQueues[client];
+  uint8_t pending = 0;
+  for (uint8_t i = 0; i < WEBSOCKETS_SERVER_CLIENT_MAX; i++)
+  {
+    pending += bleQueues[i].pending(id);
+  }
+
+  const char *reason = nullptr;
+  BLEOp op;
+  op.command = nullptr;
+  if (queue.depth() == ESP_GW_BLE_QUEUE_SIZE)
+  {
+    reason = "queue";
+    Metrics::inc(METRIC_BLE_BUSY_QUEUE);
+  }
+  else if (pending >= ESP_GW_BLE_PERIPHERAL_DEPTH)
+  {
+    reason = "peripheral";
+    Metrics::inc(METRIC_BLE_BUSY_PERIPHERAL);
+  }
+  else if (!queue.take())
+  {
+    reason = "rate";
+    retryAfter = queue.retryAfter();
+    Metrics::inc(METRIC_BLE_BUSY_RATE);
+  }
+  else
+  {
+    // the document lives on the stack of the caller, keep the filtered command
+    op.length = measureMsgPack(document);
+    op.command = (uint8_t *)Memory::allocate(MEMORY_TAG_NOBLE, op.length);
+    if (op.command == nullptr)
+    {
+      reason = "queue";
+      Metrics::inc(METRIC_BLE_BUSY_QUEUE);
+    }
+  }
+  if (reason != nullptr)
+  {
+    queue.reject();
+    return reason;
+  }
+
+  serializeMsgPack(document, op.command, op.length);
+  op.action = action;
+  op.id = id;
+  op.cost = BLEQueue::cost(action->latency);
+  op.received = received;
+  queue.push(op);
+  return nullptr;
+}
+
+/**
+ * Charge BLE work done on behalf of sessions, a reconnect, to the first of their clients that has a token
+ * @return false if every client of the sessions is over its rate, retryAfter is then the shortest wait.
+ * Detached sessions have nobody to charge, their work is not limited.
+ */
+bool NobleApi::chargeSessions(uint32_t targets, uint32_t &retryAfter)
+{
+  bool attached = false;
+  retryAfter = UINT32_MAX;
+  for (uint8_t i = 0; i < WEBSOCKETS_SERVER_CLIENT_MAX; i++)
+  {
+    uint8_t client = sessions[i].client;
+    if (!(targets & (1u << i)) || !sessions[i].active || client == INVALID_CLIENT)
+    {
+      continue;
+    }
+    attached = true;
+    if (bleQueues[client].take())
+    {
+      return true;
+    }
+    uint32_t wait = bleQueues[client].retryAfter();
+    if (wait < retryAfter)
+    {
+      retryAfter = wait;
+    }
+  }
+  if (!attached)
+  {
+    retryAfter = 0;
+    return true;
+  }
+  Metrics::inc(METRIC_BLE_BUSY_RATE);
+  return false;
+}
+
+/**
+ * Run the next queued BLE operation, clients take turns in deficit round robin order
+ * so one flooding client cannot starve the others
+ */
+void NobleApi::runBLEOps()
+{
+  BLEOp op;
+  bool found = false;
+  // enough turns for any client to save up the largest cost
+  for (uint8_t i = 0; i < WEBSOCKETS_SERVER_CLIENT_MAX * (BLE_OP_MAX_COST / ESP_GW_BLE_QUANTUM + 1) && !found; i++)
+  {
+    found = bleQueues[bleCursor].next(op, !bleTurn);
+    bleTurn = found;
+    if (!found)
+    {
+      bleCursor = (bleCursor + 1) % WEBSOCKETS_SERVER_CLIENT_MAX;
+    }
+  }
+  if (!found)
+  {
+    return;
+  }
+
+  StaticJsonDocument<1024> document;
+  if (deserializeMsgPack(document, op.command, op.length) == DeserializationError::Ok)
+  {
+    runCommand(bleCursor, op.action, document, op.received);
+  }
+  document.clear();
+  Memory::release(op.command);
+
+  // more work waiting, do not sleep between operations
+  for (uint8_t i = 0; i < WEBSOCKETS_SERVER_CLIENT_MAX; i++)
+  {
+    if (bleQueues[i].depth() > 0)
+    {
+      wake();
+      break;
+    }
+  }
+}
+
+void NobleApi::handleAuth(uint8_t client, NobleCommand &command)
+{
+  if (strlen(command.response) > 0)
+  {
+    checkAuth(client, command.response, command.encrypt);
+  }
+}
+
+void NobleApi::handleResume(uint8_t client, NobleCommand &command)
+{
+  uint8_t proof[BLOCK_SIZE];
+  if (strlen(command.proof) == BLOCK_SIZE * 2 && Hex::decode(command.proof, BLOCK_SIZE * 2, proof) && resumeSession(client, proof, command.encrypt, command.lastSeq))
+  {
+    return;
+  }
+  // unknown or expired session, fallback to a regular auth
+  sendAuthMessage(client);
+}
+
+void NobleApi::handleStartScanning(uint8_t client, NobleCommand &command)
+{
+  // TODO: setup (per connection ?) services filter
+
+  // with an interval the client gets one report per window instead of every advertisement,
+  // the window is shared by all reporting clients, the last one asking sets it
+  scanReports[client] = command.interval > 0;
+  if (command.interval > 0)
+  {
+    if (reportInterval == 0)
+    {
+      // first reporting client, what was counted before is not part of the window
+      Presence::resetWindow();
+      reportStarted = millis();
+    }
+    reportInterval = command.interval < ESP_GW_MIN_REPORT_INTERVAL ? ESP_GW_MIN_REPORT_INTERVAL : command.interval;
+  }
+
+  // more or less a hack to allow for passive scanning as noble API does not have such parameter
+  bool started = BLEApi::startScan(0, !command.allowDuplicates);
+  if (!started)
+  {
+    // scan is already running, catch the client up with the devices seen so far
+    sendDevices(client);
+  }
+}
+
+void NobleApi::handleGetDevices(uint8_t client, NobleCommand &command)
+{
+  sendDevices(client);
+}
+
+void NobleApi::handleStopScanning(uint8_t client, NobleCommand &command)
+{
+  BLEApi::stopScan();
+}
+
+void NobleApi::handleConnect(uint8_t client, NobleCommand &command)
+{
+  // the client session takes a reference to the peripheral link, the first one opens it
+  uint8_t session = getSession(client);
+  uint32_t holders = getSessions(command.peripheralUuid);
+  if (session == INVALID_SESSION || !addClient(command.peripheralUuid, session))
+  {
+    sendDisconnected(client, command.peripheralUuid, "denied");
+    return;
+  }
+  bool connected = true;
+  if ((holders & ~(1u << session)) != 0)
+  {
+    // link held by other sessions
+    Metrics::inc(METRIC_CONNECT_SHARED);
+  }
+  else
+  {
+    // TODO: check if re-connection to peripheral is ok (in case client sends multiple connect but no disconnect)
+    Latency::bleStart();
+    connected = BLEApi::connect(command.peripheralUuid);
+    Latency::bleDone();
+  }
+  if (connected)
+  {
+    if (command.persistent)
+    {
+      // kept for the lifetime of the link, whichever session asked
+      Link *link = LinkRegistry::find(command.peripheralUuid);
+      if (link != nullptr)
+      {
+        link->persistent = true;
+      }
+    }
+    EventTag tag;
+    if (recordEvent(1u << session, command.peripheralUuid, REPLAY_CONNECT, tag) != 0)
+    {
+      sendConnected(client, command.peripheralUuid, &tag);
+    }
+  }
+  else
+  {
+    delClient(command.peripheralUuid);
+    sendDisconnected(client, command.peripheralUuid, "failed");
+  }
+}
+
+void NobleApi::handleDiscoverServices(uint8_t client, NobleCommand &command)
+{
+  Latency::bleStart();
+  std::vector<NimBLERemoteService *> *services = BLEApi::discoverServices(command.peripheralUuid);
+  Latency::bleDone();
+  if (services != nullptr)
+  {
+    Metrics::inc(METRIC_GATT_DISCOVER_OK);
+    sendServices(client, command.peripheralUuid, services);
+  }
+  else
+  {
+    Metrics::inc(METRIC_GATT_DISCOVER_FAILED);
+  }
+}
+
+void NobleApi::handleDiscoverCharacteristics(uint8_t client, NobleCommand &command)
+{
+  std::string serviceUuid = command.serviceUuid;
+  Latency::bleStart();
+  std::vector<NimBLERemoteCharacteristic *> *characteristics = BLEApi::discoverCharacteristics(command.peripheralUuid, serviceUuid);
+  Latency::bleDone();
+  if (characteristics != nullptr)
+  {
+    Metrics::inc(METRIC_GATT_DISCOVER_OK);
+    sendCharacteristics(client, command.peripheralUuid, serviceUuid, characteristics);
+  }
+  else
+  {
+    Metrics::inc(METRIC_GATT_DISCOVER_FAILED);
+    peripheralGone(command.peripheralUuid, "aborted");
+  }
+}
+
+void NobleApi::handleRead(uint8_t client, NobleCommand &command)
+{
+  std::string serviceUuid = command.serviceUuid;
+  std::string characteristicUuid = command.characteristicUuid;
+  Latency::bleStart();
+  std::string value = BLEApi::readCharacteristic(command.peripheralUuid, serviceUuid, characteristicUuid, command.maxAge);
+  Latency::bleDone();
+  Metrics::inc(value.length() > 0 ? METRIC_GATT_READ_OK : METRIC_GATT_READ_FAILED);
+  sendCharacteristicValue(client, command.peripheralUuid, serviceUuid, characteristicUuid, value);
+}
+
+void NobleApi::handleWrite(uint8_t client, NobleCommand &command)
+{
+  std::string serviceUuid = command.serviceUuid;
+  std::string characteristicUuid = command.characteristicUuid;
+  size_t length = getBinaryLength(command.data);
+  uint8_t data[length];
+  if (!getBinary(command.data, data, length))
+  { // invalid data, nothing was written
+    Serial.println("Invalid write data");
+    Metrics::inc(METRIC_GATT_WRITE_FAILED);
+    sendCharacteristicWrite(client, command.peripheralUuid, serviceUuid, characteristicUuid);
+  }
+  else
+  {
+    Latency::bleStart();
+    bool written = BLEApi::writeCharacteristic(command.peripheralUuid, serviceUuid, characteristicUuid, data, length, command.withoutResponse);
+    Latency::bleDone();
+    if (written)
+    { // success
+      Metrics::inc(METRIC_GATT_WRITE_OK);
+      sendCharacteristicWrite(client, command.peripheralUuid, serviceUuid, characteristicUuid);
+    }
+    else
+    { // failed
+      Metrics::inc(METRIC_GATT_WRITE_FAILED);
+      sendCharacteristicWrite(client, command.peripheralUuid, serviceUuid, characteristicUuid);
+    }
+  }
+}
+
+void NobleApi::handleNotify(uint8_t client, NobleCommand &command)
+{
+  std::string serviceUuid = command.serviceUuid;
+  std::string characteristicUuid = command.characteristicUuid;
+  uint8_t session = getSession(client);
+  // keep the per session subscription, the peripheral is only (un)subscribed
+  // by the first and the last session notified of the characteristic
+  bool shared = false;
+  xSemaphoreTake(subscriptionsLock, portMAX_DELAY);
+  Subscription *subscription = command.notify ? addSubscription(command.peripheralUuid, command.serviceUuid, command.characteristicUuid, session)
+                                              : lookupSubscription(command.peripheralUuid, command.serviceUuid, command.characteristicUuid, session);
+  if (subscription != nullptr)
+  {
+    shared = countNotifying(subscription->id, subscription->service, subscription->characteristic) > (subscription->notifying ? 1 : 0);
+    subscription->notifying = command.notify;
+    if (command.notify)
+    {
+      subscription->maxDelay = command.maxDelay;
+      subscription->maxBatch = command.maxBatch;
+      setFilter(*subscription, command.filter);
+    }
+    else if (subscription->pollInterval == 0)
+    {
+      removeSubscription(*subscription);
+    }
+  }
+  xSemaphoreGive(subscriptionsLock);
+
+  bool subscribed = true;
+  if (command.notify && subscription == nullptr)
+  {
+    // all subscription slots are taken
+    subscribed = false;
+  }
+  else if (!shared && subscription != nullptr)
+  {
+    Latency::bleStart();
+    subscribed = BLEApi::notifyCharacteristic(command.peripheralUuid, serviceUuid, characteristicUuid, command.notify);
+    Latency::bleDone();
+    if (!subscribed && command.notify)
+    {
+      xSemaphoreTake(subscriptionsLock, portMAX_DELAY);
+      subscription = lookupSubscription(command.peripheralUuid, command.serviceUuid, command.characteristicUuid, session);
+      if (subscription != nullptr)
+      {
+        subscription->notifying = false;
+        if (subscription->pollInterval == 0)
+        {
+          removeSubscription(*subscription);
+        }
+      }
+      xSemaphoreGive(subscriptionsLock);
+    }
+  }
+  Metrics::inc(subscribed ? METRIC_GATT_NOTIFY_OK : METRIC_GATT_NOTIFY_FAILED);
+  sendCharacteristicNotification(client, command.peripheralUuid, serviceUuid, characteristicUuid, command.notify && subscribed);
+}
+
+void NobleApi::handlePoll(uint8_t client, NobleCommand &command)
+{
+  uint8_t session = getSession(client);
+  uint32_t interval = 0;
+  xSemaphoreTake(subscriptionsLock, portMAX_DELAY);
+  if (command.interval > 0)
+  {
+    Subscription *subscription = addSubscription(command.peripheralUuid, command.serviceUuid, command.characteristicUuid, session);
+    if (subscription != nullptr)
+    {
+      interval = command.interval < ESP_GW_MIN_POLL_INTERVAL ? ESP_GW_MIN_POLL_INTERVAL : command.interval;
+      subscription->pollInterval = interval;
+      // first read right away
+      subscription->nextPoll = millis();
+      setFilter(*subscription, command.filter);
+    }
+  }
+  else
+  {
+    Subscription *subscription = lookupSubscription(command.peripheralUuid, command.serviceUuid, command.characteristicUuid, session);
+    if (subscription != nullptr)
+    {
+      subscription->pollInterval = 0;
+      if (!subscription->notifying)
+      {
+        removeSubscription(*subscription);
+      }
+    }
+  }
+  xSemaphoreGive(subscriptionsLock);
+  sendCharacteristicPoll(client, command.peripheralUuid, command.serviceUuid, command.characteristicUuid, interval);
+}
+
+void NobleApi::handleStats(uint8_t client, NobleCommand &command)
+{
+  TrackedJsonDocument stats(8192);
+  stats["type"] = "stats";
+  Latency::toJson(stats.as<JsonObject>());
+  Memory::sample();
+  Memory::toJson(stats.createNestedObject("memory"));
+  subscriptionsToJson(stats.createNestedArray("subscriptions"));
+  LinkRegistry::toJson(stats.createNestedArray("links"));
+  stats["devices"] = Presence::count();
+  JsonObject queues = stats.createNestedObject("tx");
+  JsonObject bleQueueStats = stats.createNestedObject("ble");
+  for (uint8_t i = 0; i < WEBSOCKETS_SERVER_CLIENT_MAX; i++)
+  {
+    if (ws->clientIsConnected(i))
+    {
+      char key[4];
+      snprintf(key, sizeof(key), "%u", i);
+      txQueues[i].toJson(queues.createNestedObject(key));
+      bleQueues[i].toJson(bleQueueStats.createNestedObject(key));
+    }
+  }
+  sendJsonMessage(stats, client, TX_CLASS_STATE);
+}
@@ -0,0 +1,70 @@
+#ifndef ESP_GW_NOBLE_COMMANDS_H
+#define ESP_GW_NOBLE_COMMANDS_H
+
+#include <ArduinoJson.h>
+#include "ble_api.h"
+#include "latency.h"
+
+// fields a command handler can ask for
+#define CMD_FIELD_PERIPHERAL (1 << 0)
+#define CMD_FIELD_SERVICE (1 << 1)
+#define CMD_FIELD_CHARACTERISTIC (1 << 2)
+#define CMD_FIELD_DATA (1 << 3)
+#define CMD_FIELD_WITHOUT_RESPONSE (1 << 4)
+#define CMD_FIELD_NOTIFY (1 << 5)
+#define CMD_FIELD_ALLOW_DUPLICATES (1 << 6)
+#define CMD_FIELD_RESPONSE (1 << 7)
+#define CMD_FIELD_PROOF (1 << 8)
+#define CMD_FIELD_ENCRYPT (1 << 9)
+#define CMD_FIELD_LAST_SEQ (1 << 10)
+#define CMD_FIELD_MAX_DELAY (1 << 11)
+#define CMD_FIELD_MAX_BATCH (1 << 12)
+#define CMD_FIELD_FILTER (1 << 13)
+#define CMD_FIELD_INTERVAL (1 << 14)
+#define CMD_FIELD_MAX_AGE (1 << 15)
+#define CMD_FIELD_PERSISTENT (1 << 16)
+#define CMD_FIELD_TIMEOUT (1 << 17)
+#define CMD_FIELD_COUNT 18
+
+// command access rules
+#define CMD_AUTH_ONLY (1 << 0)      // only accepted before authentication
+#define CMD_CONNECTED_ONLY (1 << 1) // client session must hold a reference to the peripheral link
+#define CMD_SCHEDULED (1 << 2)      // BLE work, queued per client and run in deficit round robin order
+
+/**
+ * Typed view of a command, only the fields declared by the action are set
+ */
+struct NobleCommand
+{
+  BLEPeripheralID peripheralUuid;
+  const char *serviceUuid;
+  const char *characteristicUuid;
+  JsonVariantConst data;
+  const char *response;
+  const char *proof;
+  bool withoutResponse;
+  bool notify;
+  bool allowDuplicates;
+  bool encrypt;
+  int64_t lastSeq; // -1 when not given
+  uint16_t maxDelay;
+  uint8_t maxBatch;
+  JsonVariantConst filter;
+  uint32_t interval;
+  uint32_t maxAge;
+  bool persistent;
+  uint32_t timeout;
+};
+
+typedef void (*NobleCommandHandler)(uint8_t client, NobleCommand &command);
+
+struct NobleAction
+{
+  const char *name;
+  NobleCommandHandler handler;
+  uint32_t fields;
+  uint8_t rules;
+  LatencyOp latency;
+};
+
+#endif
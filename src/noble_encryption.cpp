@@ -0,0 +1,167 @@
+#include "noble_api.h"
+
+Security *NobleApi::ciphers[WEBSOCKETS_SERVER_CLIENT_MAX];
+Security *NobleApi::macs[WEBSOCKETS_SERVER_CLIENT_MAX];
+uint64_t NobleApi::txCounters[WEBSOCKETS_SERVER_CLIENT_MAX];
+uint64_t NobleApi::rxCounters[WEBSOCKETS_SERVER_CLIENT_MAX];
+uint8_t *NobleApi::scratch[WEBSOCKETS_SERVER_CLIENT_MAX];
+size_t NobleApi::scratchSize[WEBSOCKETS_SERVER_CLIENT_MAX];
+
+/**
+ * Nonce layout: direction byte, 3 zero bytes, 8 byte message counter, 4 byte block counter
+ */
+static void buildNonce(uint8_t nonce[BLOCK_SIZE], uint8_t direction, uint64_t counter)
+{
+  memset(nonce, 0, BLOCK_SIZE);
+  nonce[0] = direction;
+  for (auto i = 0; i < ENCRYPTION_HEADER_SIZE; i++)
+  {
+    nonce[4 + i] = counter >> (8 * (ENCRYPTION_HEADER_SIZE - 1 - i));
+  }
+}
+
+/**
+ * Constant time tag compare
+ */
+static bool sameTag(const uint8_t a[ENCRYPTION_TAG_SIZE], const uint8_t b[ENCRYPTION_TAG_SIZE])
+{
+  uint8_t diff = 0;
+  for (auto i = 0; i < ENCRYPTION_TAG_SIZE; i++)
+  {
+    diff |= a[i] ^ b[i];
+  }
+  return diff == 0;
+}
+
+/**
+ * Switch an authenticating client to encrypted frames.
+ * Session key is the current challenge encrypted with the gateway key,
+ * MAC key is a block of 0xFF encrypted with the session key (never a CTR counter block).
+ */
+bool NobleApi::enableEncryption(uint8_t client)
+{
+  uint8_t sessionKey[BLOCK_SIZE];
+  uint8_t macKey[BLOCK_SIZE];
+  uint8_t macInput[BLOCK_SIZE];
+  if (!sec->deriveKey((uint8_t *)challenges[client], sessionKey))
+  {
+    return false;
+  }
+  if (ciphers[client] == nullptr)
+  {
+    ciphers[client] = new Security();
+  }
+  if (macs[client] == nullptr)
+  {
+    macs[client] = new Security();
+  }
+  ciphers[client]->setKey(sessionKey, BLOCK_SIZE);
+  memset(macInput, 0xFF, BLOCK_SIZE);
+  bool derived = ciphers[client]->deriveKey(macInput, macKey);
+  macs[client]->setKey(macKey, BLOCK_SIZE);
+  memset(sessionKey, 0, BLOCK_SIZE);
+  memset(macKey, 0, BLOCK_SIZE);
+  if (!derived)
+  {
+    disableEncryption(client);
+    return false;
+  }
+  txCounters[client] = 0;
+  rxCounters[client] = 0;
+  return true;
+}
+
+void NobleApi::disableEncryption(uint8_t client)
+{
+  if (ciphers[client] != nullptr)
+  {
+    delete ciphers[client];
+    ciphers[client] = nullptr;
+  }
+  if (macs[client] != nullptr)
+  {
+    delete macs[client];
+    macs[client] = nullptr;
+  }
+  if (scratch[client] != nullptr)
+  {
+    Memory::release(scratch[client]);
+    scratch[client] = nullptr;
+    scratchSize[client] = 0;
+  }
+}
+
+/**
+ * Frame for messages shared with other clients, which cannot be encrypted in place.
+ * Grows in 512 byte steps to the largest message sent to the client and is kept until encryption ends,
+ * pages of devices are several KB, too much for the task stack and too often sent for a heap copy each.
+ */
+uint8_t *NobleApi::scratchFrame(uint8_t client, size_t length)
+{
+  size_t size = TX_HEADROOM + length + TX_TAILROOM;
+  if (size > scratchSize[client])
+  {
+    size = (size + 511) & ~(size_t)511;
+    uint8_t *frame = (uint8_t *)Memory::reallocate(MEMORY_TAG_NOBLE, scratch[client], size);
+    if (frame == nullptr)
+    {
+      return nullptr;
+    }
+    scratch[client] = frame;
+    scratchSize[client] = size;
+  }
+  return scratch[client];
+}
+
+/**
+ * Encrypt the message at buffer + ENCRYPTION_HEADER_SIZE in place, write the counter header
+ * and the tag after the message (ENCRYPTION_TAG_SIZE bytes)
+ */
+bool NobleApi::encryptFrame(uint8_t client, uint8_t *buffer, size_t length)
+{
+  uint64_t counter = ++txCounters[client];
+  for (auto i = 0; i < ENCRYPTION_HEADER_SIZE; i++)
+  {
+    buffer[i] = counter >> (8 * (ENCRYPTION_HEADER_SIZE - 1 - i));
+  }
+  uint8_t nonce[BLOCK_SIZE];
+  buildNonce(nonce, ENCRYPTION_DIRECTION_TX, counter);
+  uint8_t *message = buffer + ENCRYPTION_HEADER_SIZE;
+  return ciphers[client]->cryptCtr(nonce, message, length) && macs[client]->cmac(nonce, message, length, message + length);
+}
+
+/**
+ * Check the tag of a received frame and decrypt it in place, rejecting replayed counters.
+ * Nothing changes unless the tag is valid, so forged frames cannot move the counter.
+ */
+bool NobleApi::decryptFrame(uint8_t client, uint8_t *buffer, size_t length)
+{
+  if (length < ENCRYPTION_HEADER_SIZE + ENCRYPTION_TAG_SIZE)
+  {
+    return false;
+  }
+  uint64_t counter = 0;
+  for (auto i = 0; i < ENCRYPTION_HEADER_SIZE; i++)
+  {
+    counter = counter << 8 | buffer[i];
+  }
+  if (counter <= rxCounters[client])
+  {
+    return false;
+  }
+  uint8_t nonce[BLOCK_SIZE];
+  uint8_t tag[ENCRYPTION_TAG_SIZE];
+  uint8_t *message = buffer + ENCRYPTION_HEADER_SIZE;
+  size_t messageLength = length - ENCRYPTION_HEADER_SIZE - ENCRYPTION_TAG_SIZE;
+  buildNonce(nonce, ENCRYPTION_DIRECTION_RX, counter);
+  if (!macs[client]->cmac(nonce, message, messageLength, tag) || !sameTag(tag, message + messageLength))
+  {
+    return false;
+  }
+  if (!ciphers[client]->cryptCtr(nonce, message, messageLength))
+  {
+    return false;
+  }
+  rxCounters[client] = counter;
+  return true;
+}
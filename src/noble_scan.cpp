@@ -0,0 +1,451 @@
+#include "noble_api.h"
+
+ConnectMatch NobleApi::matches[WEBSOCKETS_SERVER_CLIENT_MAX];
+portMUX_TYPE NobleApi::matchMux = portMUX_INITIALIZER_UNLOCKED;
+bool NobleApi::scanReports[WEBSOCKETS_SERVER_CLIENT_MAX];
+uint16_t NobleApi::deviceCursors[WEBSOCKETS_SERVER_CLIENT_MAX];
+TxBuffer *NobleApi::devicePages[WEBSOCKETS_SERVER_CLIENT_MAX];
+uint32_t NobleApi::reportInterval = 0;
+uint32_t NobleApi::reportStarted = 0;
+
+static const char *addressTypeName(uint8_t type)
+{
+  if (type == BLE_ADDR_PUBLIC || type == BLE_ADDR_PUBLIC_ID)
+  {
+    return "public";
+  }
+  if (type == BLE_ADDR_RANDOM || type == BLE_ADDR_RANDOM_ID)
+  {
+    return "random";
+  }
+  return "unknown";
+}
+
+/**
+ * Decode the manufacturer data, or else the 16 bit service data, of a known format into out
+ * @return where the decoded fields come from, DECODER_NONE if the format is unknown
+ */
+static DecoderSource decodeAdvertisement(NimBLEAdvertisedDevice *advertisedDevice, JsonObject out)
+{
+  if (advertisedDevice->haveManufacturerData())
+  {
+    std::string data = advertisedDevice->getManufacturerData();
+    // company identifier is little endian
+    if (data.length() >= 2 && Decoders::decode(DECODER_MANUFACTURER, (uint8_t)data[0] | (uint8_t)data[1] << 8, (const uint8_t *)data.data() + 2, data.length() - 2, out) != nullptr)
+    {
+      return DECODER_MANUFACTURER;
+    }
+  }
+  if (advertisedDevice->haveServiceData())
+  {
+    NimBLEUUID uuid = advertisedDevice->getServiceDataUUID();
+    if (uuid.bitSize() == BLE_UUID_TYPE_16)
+    {
+      std::string data = advertisedDevice->getServiceData();
+      if (Decoders::decode(DECODER_SERVICE_DATA, uuid.getNative()->u16.value, (const uint8_t *)data.data(), data.length(), out) != nullptr)
+      {
+        return DECODER_SERVICE_DATA;
+      }
+    }
+  }
+  return DECODER_NONE;
+}
+
+/**
+ * Add the decoded fields of a known advertisement format to a discover message
+ * @return where the decoded fields come from, DECODER_NONE if nothing was added
+ */
+DecoderSource NobleApi::setDecoded(JsonObject advertisement, NimBLEAdvertisedDevice *advertisedDevice)
+{
+  JsonObject decoded = advertisement.createNestedObject("decoded");
+  DecoderSource source = decodeAdvertisement(advertisedDevice, decoded);
+  if (source == DECODER_NONE)
+  {
+    advertisement.remove("decoded");
+  }
+  else
+  {
+    Metrics::inc(METRIC_ADV_DECODED);
+  }
+  return source;
+}
+
+/**
+ * Does an advertisement pass every criterion set in the match
+ */
+static bool matchAdvertisement(const ConnectMatch &match, NimBLEAdvertisedDevice *advertisedDevice)
+{
+  if (match.minRssi != MATCH_ANY_RSSI && advertisedDevice->getRSSI() < match.minRssi)
+  {
+    return false;
+  }
+  if (match.manufacturerId != MATCH_ANY_MANUFACTURER)
+  {
+    if (!advertisedDevice->haveManufacturerData())
+    {
+      return false;
+    }
+    std::string data = advertisedDevice->getManufacturerData();
+    if (data.length() < 2 || ((uint8_t)data[0] | (uint8_t)data[1] << 8) != match.manufacturerId)
+    {
+      return false;
+    }
+  }
+  if (match.name[0] != '\0' && (!advertisedDevice->haveName() || advertisedDevice->getName() != match.name))
+  {
+    return false;
+  }
+  if (match.hasService && !advertisedDevice->isAdvertisingService(match.service))
+  {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Wait for an advertisement matching {"serviceUuid", "name", "manufacturerId", "minRssi"} and connect to it,
+ * without the discover and connect round trip through the client
+ */
+void NobleApi::handleConnectMatching(uint8_t client, NobleCommand &command)
+{
+  ConnectMatch match;
+  match.active = true;
+  match.found = false;
+  match.scanning = false;
+  match.persistent = command.persistent;
+  const char *service = command.filter["serviceUuid"] | "";
+  match.hasService = strlen(service) > 0;
+  if (match.hasService)
+  {
+    match.service = NimBLEUUID(service);
+  }
+  strlcpy(match.name, command.filter["name"] | "", sizeof(match.name));
+  match.manufacturerId = command.filter["manufacturerId"] | MATCH_ANY_MANUFACTURER;
+  match.minRssi = command.filter["minRssi"] | MATCH_ANY_RSSI;
+  if (!match.hasService && match.name[0] == '\0' && match.manufacturerId == MATCH_ANY_MANUFACTURER && match.minRssi == MATCH_ANY_RSSI)
+  {
+    // would connect to whatever advertises first
+    sendConnectMatching(client, match, "filter");
+    return;
+  }
+  uint32_t timeout = command.timeout == 0 ? ESP_GW_MATCH_TIMEOUT : command.timeout;
+  match.started = millis();
+  match.deadline = match.started + (timeout > ESP_GW_MATCH_MAX_TIMEOUT ? ESP_GW_MATCH_MAX_TIMEOUT : timeout);
+
+  portENTER_CRITICAL(&matchMux);
+  matches[client] = match;
+  portEXIT_CRITICAL(&matchMux);
+  // a scan started for the match is stopped again on timeout, a running one is left alone
+  bool scanning = BLEApi::startScan(0, true);
+  portENTER_CRITICAL(&matchMux);
+  matches[client].scanning = scanning;
+  portEXIT_CRITICAL(&matchMux);
+}
+
+/**
+ * Check an advertisement against the pending matches, runs in the BLE host task.
+ * The first matching device is kept and the API task is woken up to connect.
+ */
+void NobleApi::matchDevice(NimBLEAdvertisedDevice *advertisedDevice, BLEPeripheralID id)
+{
+  bool found = false;
+  for (uint8_t client = 0; client < WEBSOCKETS_SERVER_CLIENT_MAX; client++)
+  {
+    if (!matches[client].active)
+    {
+      continue;
+    }
+    portENTER_CRITICAL(&matchMux);
+    ConnectMatch match = matches[client];
+    portEXIT_CRITICAL(&matchMux);
+    // the advertisement is parsed outside the critical section, it allocates
+    if (!match.active || match.found || !matchAdvertisement(match, advertisedDevice))
+    {
+      continue;
+    }
+    portENTER_CRITICAL(&matchMux);
+    if (matches[client].active && !matches[client].found && matches[client].started == match.started)
+    {
+      matches[client].found = true;
+      matches[client].id = id;
+      matches[client].rssi = advertisedDevice->getRSSI();
+      found = true;
+    }
+    portEXIT_CRITICAL(&matchMux);
+  }
+  if (found)
+  {
+    wake();
+  }
+}
+
+/**
+ * Connect matched devices through the client BLE queue and time out the others
+ */
+void NobleApi::connectMatches()
+{
+  uint32_t now = millis();
+  for (uint8_t client = 0; client < WEBSOCKETS_SERVER_CLIENT_MAX; client++)
+  {
+    if (!matches[client].active)
+    {
+      continue;
+    }
+    bool done = false;
+    portENTER_CRITICAL(&matchMux);
+    ConnectMatch match = matches[client];
+    if (match.found || (int32_t)(now - match.deadline) >= 0)
+    {
+      matches[client].active = false;
+      done = true;
+    }
+    portEXIT_CRITICAL(&matchMux);
+    if (!done)
+    {
+      continue;
+    }
+
+    if (!match.found)
+    {
+      if (match.scanning)
+      {
+        BLEApi::stopScan();
+      }
+      sendConnectMatching(client, match, "timeout");
+      continue;
+    }
+    sendConnectMatching(client, match, nullptr);
+    // same path as a connect from the client, connect stops the scan
+    const NobleAction *action = findAction("connect");
+    StaticJsonDocument<128> document;
+    document["action"] = "connect";
+    document["peripheralUuid"] = BLEApi::idToString(match.id);
+    document["persistent"] = match.persistent;
+    NobleCommand command;
+    if (parseCommand(document, action->fields, command))
+    {
+      scheduleCommand(client, action, document, command, Latency::now());
+    }
+  }
+}
+
+/**
+ * Forget the pending match of a client that left
+ */
+void NobleApi::cancelMatch(uint8_t client)
+{
+  portENTER_CRITICAL(&matchMux);
+  matches[client].active = false;
+  portEXIT_CRITICAL(&matchMux);
+}
+
+/**
+ * Matched device with the scan time, or why nothing was connected
+ */
+void NobleApi::sendConnectMatching(const uint8_t client, const ConnectMatch &match, const char *reason)
+{
+  StaticJsonDocument<160> command;
+  command["type"] = "connectMatching";
+  if (reason != nullptr)
+  {
+    command["reason"] = reason;
+  }
+  else
+  {
+    command["peripheralUuid"] = BLEApi::idToString(match.id);
+    command["rssi"] = match.rssi;
+    command["scanMs"] = millis() - match.started;
+  }
+  sendJsonMessage(command, client, TX_CLASS_STATE);
+}
+
+/**
+ * Snapshot of the devices seen by the scan, sent page by page from continueDevices
+ */
+void NobleApi::sendDevices(const uint8_t client)
+{
+  deviceCursors[client] = 0;
+  wake();
+}
+
+/**
+ * Queue the next page of each snapshot once the previous one was sent, so a snapshot never fills
+ * the queue of a client. Rows are [peripheralUuid, addressType, rssi, age, advertisement];
+ * "more" is false on the last page
+ */
+void NobleApi::continueDevices()
+{
+  PresenceEntry page[ESP_GW_PRESENCE_PAGE];
+  for (uint8_t client = 0; client < WEBSOCKETS_SERVER_CLIENT_MAX; client++)
+  {
+    if (devicePages[client] != nullptr)
+    {
+      if (devicePages[client]->refs.load(std::memory_order_acquire) > 1)
+      {
+        // still queued
+        continue;
+      }
+      devicePages[client]->release();
+      devicePages[client] = nullptr;
+    }
+    if (deviceCursors[client] == DEVICES_IDLE)
+    {
+      continue;
+    }
+    uint16_t cursor = deviceCursors[client];
+    bool first = cursor == 0;
+    uint32_t now = millis();
+    uint16_t count = Presence::copy(cursor, page, ESP_GW_PRESENCE_PAGE);
+    TrackedJsonDocument command(JSON_OBJECT_SIZE(4) + JSON_ARRAY_SIZE(5) + JSON_ARRAY_SIZE(count) + count * (JSON_ARRAY_SIZE(5) + 18 + PRESENCE_MAX_ADV * 2 + 8) + 64);
+    command["type"] = "devices";
+    if (first)
+    {
+      JsonArray fields = command.createNestedArray("fields");
+      fields.add("peripheralUuid");
+      fields.add("addressType");
+      fields.add("rssi");
+      fields.add("age");
+      fields.add("advertisement");
+    }
+    JsonArray devices = command.createNestedArray("devices");
+    for (uint16_t i = 0; i < count; i++)
+    {
+      JsonArray row = devices.createNestedArray();
+      row.add(BLEApi::idToString(page[i].id));
+      row.add(addressTypeName(page[i].addressType));
+      row.add(page[i].rssi / 16);
+      row.add(now - page[i].lastSeen);
+      setBinary(row.add(), page[i].advertisement, page[i].length, client);
+    }
+    command["more"] = cursor < ESP_GW_PRESENCE_SLOTS;
+    deviceCursors[client] = cursor < ESP_GW_PRESENCE_SLOTS ? cursor : DEVICES_IDLE;
+    TxBuffer *buffer = TxBuffer::fromJson(command, encodings[client] == WS_ENCODING_MSGPACK);
+    if (buffer == nullptr)
+    {
+      Serial.printf("[%u] Out of memory for devices\n", client);
+      deviceCursors[client] = DEVICES_IDLE;
+      continue;
+    }
+    enqueue(client, buffer, TX_CLASS_STATE, BLEPeripheralID(), LATENCY_OP_NONE);
+    // our reference tells when the page was sent
+    devicePages[client] = buffer;
+  }
+}
+
+/**
+ * Is an authenticated client still getting every advertisement
+ */
+bool NobleApi::wantsDiscover()
+{
+  for (uint8_t client = 0; client < WEBSOCKETS_SERVER_CLIENT_MAX; client++)
+  {
+    if (ws->clientIsConnected(client) && isEmptyChallenge(challenges[client]) && !scanReports[client])
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Page of the scan report, rows are [peripheralUuid, count, minRssi, maxRssi, meanRssi, advertisement]
+ * with the last advertisement of the window
+ */
+void NobleApi::setScanReport(JsonDocument &command, const uint8_t client, const PresenceEntry *page, uint16_t count, uint32_t window, bool first, bool more)
+{
+  command["type"] = "scanReport";
+  command["window"] = window;
+  if (first)
+  {
+    JsonArray fields = command.createNestedArray("fields");
+    fields.add("peripheralUuid");
+    fields.add("count");
+    fields.add("minRssi");
+    fields.add("maxRssi");
+    fields.add("meanRssi");
+    fields.add("advertisement");
+  }
+  JsonArray devices = command.createNestedArray("devices");
+  for (uint16_t i = 0; i < count; i++)
+  {
+    const PresenceEntry &entry = page[i];
+    JsonArray row = devices.createNestedArray();
+    row.add(BLEApi::idToString(entry.id));
+    row.add(entry.windowCount);
+    row.add(entry.windowMin);
+    row.add(entry.windowMax);
+    row.add(entry.windowSum / entry.windowCount);
+    setBinary(row.add(), entry.advertisement, entry.length, client);
+  }
+  command["more"] = more;
+}
+
+/**
+ * Close the report window: one summary per device that advertised in it, in pages shared by all reporting clients.
+ * Pages are discover messages, behind replies and state events; under pressure a page replaces
+ * the same page of an older window still queued.
+ */
+void NobleApi::sendScanReports()
+{
+  uint32_t now = millis();
+  if (reportInterval == 0 || now - reportStarted < reportInterval)
+  {
+    return;
+  }
+  uint32_t window = now - reportStarted;
+  reportStarted = now;
+  bool reporting = false;
+  for (uint8_t client = 0; client < WEBSOCKETS_SERVER_CLIENT_MAX; client++)
+  {
+    reporting |= scanReports[client] && ws->clientIsConnected(client);
+  }
+  if (!reporting)
+  {
+    reportInterval = 0;
+    return;
+  }
+
+  PresenceEntry page[ESP_GW_PRESENCE_PAGE];
+  uint16_t cursor = 0;
+  uint16_t number = 0;
+  bool first = true;
+  while (first || cursor < ESP_GW_PRESENCE_SLOTS)
+  {
+    uint16_t count = Presence::report(cursor, page, ESP_GW_PRESENCE_PAGE);
+    bool more = cursor < ESP_GW_PRESENCE_SLOTS;
+    size_t capacity = JSON_OBJECT_SIZE(5) + JSON_ARRAY_SIZE(6) + JSON_ARRAY_SIZE(count) + count * (JSON_ARRAY_SIZE(6) + 18 + PRESENCE_MAX_ADV * 2 + 8) + 64;
+    // serialized once per encoding
+    TxBuffer *text = nullptr;
+    TxBuffer *packed = nullptr;
+    for (uint8_t client = 0; client < WEBSOCKETS_SERVER_CLIENT_MAX; client++)
+    {
+      if (!scanReports[client] || !ws->clientIsConnected(client))
+      {
+        continue;
+      }
+      bool binary = encodings[client] == WS_ENCODING_MSGPACK;
+      TxBuffer *&buffer = binary ? packed : text;
+      if (buffer == nullptr)
+      {
+        TrackedJsonDocument command(capacity);
+        setScanReport(command, client, page, count, window, first, more);
+        buffer = TxBuffer::fromJson(command, binary);
+      }
+      if (buffer != nullptr)
+      {
+        enqueue(client, buffer, TX_CLASS_DISCOVER, BLEPeripheralID(), LATENCY_OP_NONE, number);
+      }
+    }
+    if (text != nullptr)
+    {
+      text->release();
+    }
+    if (packed != nullptr)
+    {
+      packed->release();
+    }
+    Metrics::inc(METRIC_SCAN_REPORTS);
+    first = false;
+    number++;
+  }
+}
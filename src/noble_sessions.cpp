@@ -0,0 +1,381 @@
+#include "noble_api.h"
+
+ClientSession NobleApi::sessions[WEBSOCKETS_SERVER_CLIENT_MAX];
+portMUX_TYPE NobleApi::replayMux = portMUX_INITIALIZER_UNLOCKED;
+uint8_t NobleApi::replaySessions[WEBSOCKETS_SERVER_CLIENT_MAX];
+uint32_t NobleApi::replayCursors[WEBSOCKETS_SERVER_CLIENT_MAX];
+uint32_t NobleApi::replayAfter[WEBSOCKETS_SERVER_CLIENT_MAX];
+
+/**
+ * Constant time token compare
+ */
+static bool sameToken(const uint8_t a[BLOCK_SIZE], const uint8_t b[BLOCK_SIZE])
+{
+  uint8_t diff = 0;
+  for (auto i = 0; i < BLOCK_SIZE; i++)
+  {
+    diff |= a[i] ^ b[i];
+  }
+  return diff == 0;
+}
+
+void NobleApi::initSessions()
+{
+  for (auto i = 0; i < WEBSOCKETS_SERVER_CLIENT_MAX; i++)
+  {
+    sessions[i].client = INVALID_CLIENT;
+    sessions[i].active = false;
+    sessions[i].seq = 0;
+    replaySessions[i] = INVALID_SESSION;
+  }
+}
+
+/**
+ * Issue a new session for an authenticated client, replacing any previous one
+ */
+uint8_t NobleApi::createSession(uint8_t client)
+{
+  uint8_t session = getSession(client);
+  if (session == INVALID_SESSION)
+  {
+    for (auto i = 0; i < WEBSOCKETS_SERVER_CLIENT_MAX; i++)
+    {
+      if (!sessions[i].active)
+      {
+        session = i;
+        break;
+      }
+    }
+  }
+  if (session == INVALID_SESSION)
+  {
+    // all slots are taken by detached sessions, reuse the one closest to expiry
+    session = 0;
+    for (auto i = 1; i < WEBSOCKETS_SERVER_CLIENT_MAX; i++)
+    {
+      if ((int32_t)(sessions[i].expires - sessions[session].expires) < 0)
+      {
+        session = i;
+      }
+    }
+    clearSession(session);
+  }
+  esp_fill_random(sessions[session].token, BLOCK_SIZE);
+  sessions[session].client = client;
+  sessions[session].active = true;
+  return session;
+}
+
+/**
+ * Session of a connected client
+ */
+uint8_t NobleApi::getSession(uint8_t client)
+{
+  for (auto i = 0; i < WEBSOCKETS_SERVER_CLIENT_MAX; i++)
+  {
+    if (sessions[i].active && sessions[i].client == client)
+    {
+      return i;
+    }
+  }
+  return INVALID_SESSION;
+}
+
+/**
+ * Attach a detached session to a new client, skipping the challenge.
+ * The token never travels back: the client proves it has it with the AES-CMAC of its new challenge keyed with the token.
+ * Tokens are only given to encrypted clients, so resuming needs encryption too.
+ */
+bool NobleApi::resumeSession(uint8_t client, const uint8_t proof[BLOCK_SIZE], bool encrypt, int64_t lastSeq)
+{
+  if (!encrypt || isEmptyChallenge(challenges[client]))
+  {
+    return false;
+  }
+  Security mac;
+  uint8_t expected[BLOCK_SIZE];
+  for (uint8_t session = 0; session < WEBSOCKETS_SERVER_CLIENT_MAX; session++)
+  {
+    if (!sessions[session].active || sessions[session].client != INVALID_CLIENT)
+    {
+      continue;
+    }
+    mac.setKey(sessions[session].token, BLOCK_SIZE);
+    if (mac.cmac((uint8_t *)challenges[client], nullptr, 0, expected) && sameToken(expected, proof))
+    {
+      if ((int32_t)(millis() - sessions[session].expires) >= 0)
+      {
+        clearSession(session);
+        return false;
+      }
+
+      if (!enableEncryption(client))
+      {
+        // never fall back to cleartext, the session stays available for another try
+        Serial.printf("[%u] Encryption could not be enabled\n", client);
+        return false;
+      }
+      clearChallenge(challenges[client]);
+      // tokens are single use
+      esp_fill_random(sessions[session].token, BLOCK_SIZE);
+      attachSession(client, session, lastSeq);
+      sendState(client);
+      sendSession(client, session);
+
+      // peripherals the session still holds
+      for (auto i = 0; i < MAX_CLIENT_CONNECTIONS; i++)
+      {
+        Link *link = LinkRegistry::at(i);
+        if (link != nullptr && (link->sessions & (1u << session)))
+        {
+          sendConnected(client, link->id);
+        }
+      }
+      Serial.printf("[%u] Session resumed\n", client);
+      clientReady(client);
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Client went away, keep its session (and peripherals) for ESP_GW_SESSION_TTL
+ */
+void NobleApi::detachSession(uint8_t session)
+{
+  portENTER_CRITICAL(&replayMux);
+  sessions[session].client = INVALID_CLIENT;
+  portEXIT_CRITICAL(&replayMux);
+  sessions[session].expires = millis() + ESP_GW_SESSION_TTL;
+}
+
+/**
+ * Drop detached sessions that were not resumed in time
+ */
+void NobleApi::expireSessions()
+{
+  uint32_t now = millis();
+  for (uint8_t session = 0; session < WEBSOCKETS_SERVER_CLIENT_MAX; session++)
+  {
+    if (sessions[session].active && sessions[session].client == INVALID_CLIENT && (int32_t)(now - sessions[session].expires) >= 0)
+    {
+      Serial.printf("Session %u expired\n", session);
+      clearSession(session);
+    }
+  }
+}
+
+/**
+ * Remove a session and drop its peripheral references, links no other session holds are disconnected
+ */
+void NobleApi::clearSession(uint8_t session)
+{
+  for (auto i = 0; i < MAX_CLIENT_CONNECTIONS; i++)
+  {
+    Link *link = LinkRegistry::at(i);
+    if (link != nullptr && (link->sessions & (1u << session)))
+    {
+      releaseClient(link->id, session);
+    }
+  }
+  memset(sessions[session].token, 0, BLOCK_SIZE);
+  sessions[session].client = INVALID_CLIENT;
+  sessions[session].active = false;
+  portENTER_CRITICAL(&replayMux);
+  sessions[session].seq = 0;
+  portEXIT_CRITICAL(&replayMux);
+  Replay::forget(session);
+}
+
+/**
+ * Give the session token to the client, only over encrypted frames as it is enough to take the session over
+ */
+void NobleApi::sendSession(const uint8_t client, uint8_t session)
+{
+  if (ciphers[client] == nullptr)
+  {
+    return;
+  }
+  StaticJsonDocument<128> command;
+  command["type"] = "session";
+  char token[BLOCK_SIZE * 2 + 1];
+  Hex::encode(sessions[session].token, BLOCK_SIZE, token);
+  command["token"] = token;
+  command["ttl"] = ESP_GW_SESSION_TTL / 1000;
+  sendJsonMessage(command, client, TX_CLASS_STATE);
+}
+
+/**
+ * Client can start sending commands, log how long it took since the TCP connect
+ */
+void NobleApi::clientReady(uint8_t client)
+{
+  log_i("[%u] Ready in %u us", client, micros() - connectedAt[client]);
+}
+
+/**
+ * Tag an event of a peripheral with the next sequence and keep it for replay by the target sessions
+ * @return sessions that must get the event now, the others are away or will get it from their replay
+ */
+uint32_t NobleApi::recordEvent(uint32_t targets, BLEPeripheralID id, ReplayType type, EventTag &tag, const std::string &service, const std::string &characteristic, const std::string &data)
+{
+  uint32_t live = 0;
+  uint32_t index;
+  // same lock as attachSession and finishReplay, an event is either replayed or sent live, never both.
+  // Only the slot is reserved under it, the bytes are copied after.
+  portENTER_CRITICAL(&replayMux);
+  tag = Replay::reserve(targets, type, id, service.length(), characteristic.length(), data.length(), index);
+  for (uint8_t session = 0; session < WEBSOCKETS_SERVER_CLIENT_MAX; session++)
+  {
+    if (targets & (1u << session))
+    {
+      sessions[session].seq = tag.seq;
+      uint8_t client = sessions[session].client;
+      if (client != INVALID_CLIENT && replaySessions[client] == INVALID_SESSION)
+      {
+        live |= 1u << session;
+      }
+    }
+  }
+  portEXIT_CRITICAL(&replayMux);
+  Replay::commit(index, service, characteristic, data);
+  return live;
+}
+
+/**
+ * Attach a client to a session and, when it missed events after lastSeq, start resending them
+ * paced by continueReplays. Both happen under the lock of recordEvent so no event is sent live
+ * to the client before its replay is set up.
+ */
+void NobleApi::attachSession(uint8_t client, uint8_t session, int64_t lastSeq)
+{
+  bool replay = false;
+  portENTER_CRITICAL(&replayMux);
+  uint32_t last = sessions[session].seq;
+  if (lastSeq >= 0 && lastSeq < last)
+  {
+    replayCursors[client] = Replay::begin();
+    replayAfter[client] = lastSeq;
+    replaySessions[client] = session;
+    replay = true;
+  }
+  sessions[session].client = client;
+  portEXIT_CRITICAL(&replayMux);
+  if (replay)
+  {
+    Serial.printf("[%u] Replaying events %u to %u\n", client, (uint32_t)lastSeq + 1, last);
+    wake();
+  }
+}
+
+/**
+ * Queue replayed events while the client queue has room, live events wait behind them
+ */
+void NobleApi::continueReplays()
+{
+  ReplayEvent event;
+  std::string service;
+  std::string characteristic;
+  std::string data;
+  for (uint8_t client = 0; client < WEBSOCKETS_SERVER_CLIENT_MAX; client++)
+  {
+    uint8_t session = replaySessions[client];
+    if (session == INVALID_SESSION)
+    {
+      continue;
+    }
+    while (replaySessions[client] != INVALID_SESSION && txQueues[client].depth() < ESP_GW_TX_QUEUE_DEEP)
+    {
+      uint32_t lost = Replay::lostSeq(session);
+      if (lost > replayAfter[client])
+      {
+        sendGap(client, replayAfter[client] + 1, lost);
+        replayAfter[client] = lost;
+      }
+      uint32_t begin = Replay::begin();
+      if ((int32_t)(replayCursors[client] - begin) < 0)
+      {
+        // overwritten while replaying
+        replayCursors[client] = begin;
+      }
+      if (replayCursors[client] == Replay::end())
+      {
+        finishReplay(client);
+        break;
+      }
+      if (!Replay::read(replayCursors[client]++, event, service, characteristic, data))
+      {
+        continue;
+      }
+      if (!(event.sessions & (1u << session)) || event.seq <= replayAfter[client])
+      {
+        continue;
+      }
+      replayAfter[client] = event.seq;
+
+      EventTag tag = {event.seq, event.timestamp, true};
+      if (event.dropped)
+      {
+        // the value was too large to keep
+        sendGap(client, event.seq, event.seq);
+      }
+      else if (event.type == REPLAY_NOTIFICATION)
+      {
+        sendCharacteristicValue(client, event.id, service, characteristic, data, true, &tag);
+      }
+      else if (event.type == REPLAY_CONNECT)
+      {
+        sendConnected(client, event.id, &tag);
+      }
+      else if (event.type == REPLAY_RECONNECT)
+      {
+        sendReconnected(client, event.id, &tag);
+      }
+      else
+      {
+        sendDisconnected(client, event.id, "", &tag);
+      }
+    }
+  }
+}
+
+/**
+ * Switch the client back to live events once the whole ring was read
+ */
+void NobleApi::finishReplay(uint8_t client)
+{
+  uint8_t session = replaySessions[client];
+  bool finished = false;
+  uint32_t last = 0;
+  portENTER_CRITICAL(&replayMux);
+  // events still being written were not sent live to the client, they have to be replayed first
+  if (replayCursors[client] == Replay::end() && !Replay::writing())
+  {
+    replaySessions[client] = INVALID_SESSION;
+    last = sessions[session].seq;
+    finished = true;
+  }
+  portEXIT_CRITICAL(&replayMux);
+  if (finished)
+  {
+    if (last > replayAfter[client])
+    {
+      // newest events were not kept
+      sendGap(client, replayAfter[client] + 1, last);
+    }
+    Serial.printf("[%u] Replay done\n", client);
+  }
+}
+
+/**
+ * Events from..to were overwritten before the client came back
+ */
+void NobleApi::sendGap(const uint8_t client, uint32_t from, uint32_t to)
+{
+  StaticJsonDocument<64> command;
+  command["type"] = "gap";
+  command["from"] = from;
+  command["to"] = to;
+  sendJsonMessage(command, client, TX_CLASS_STATE);
+}
@@ -0,0 +1,548 @@
+#include "noble_api.h"
+
+Subscription NobleApi::subscriptions[ESP_GW_MAX_SUBSCRIPTIONS];
+SemaphoreHandle_t NobleApi::subscriptionsLock = nullptr;
+uint8_t NobleApi::pollCursor = 0;
+
+/**
+ * UUIDs from clients can be short or long, notifications use the long form
+ */
+static std::string normalizeUuid(const char *uuid)
+{
+  return BLEUUID(uuid).to128().toString();
+}
+
+void NobleApi::initSubscriptions()
+{
+  subscriptionsLock = xSemaphoreCreateMutex();
+  for (auto i = 0; i < ESP_GW_MAX_SUBSCRIPTIONS; i++)
+  {
+    subscriptions[i].active = false;
+    subscriptions[i].notifying = false;
+    subscriptions[i].batch = nullptr;
+    subscriptions[i].batchCapacity = 0;
+  }
+}
+
+static bool sameCharacteristic(const Subscription &subscription, BLEPeripheralID id, const char *service, const char *characteristic)
+{
+  return subscription.active && subscription.id == id && strcmp(subscription.characteristic, characteristic) == 0 && strcmp(subscription.service, service) == 0;
+}
+
+/**
+ * Subscription of a session to a characteristic, UUIDs in long form. Caller holds subscriptionsLock.
+ */
+Subscription *NobleApi::findSubscription(BLEPeripheralID id, const char *service, const char *characteristic, uint8_t session)
+{
+  for (auto i = 0; i < ESP_GW_MAX_SUBSCRIPTIONS; i++)
+  {
+    Subscription &subscription = subscriptions[i];
+    if (subscription.session == session && sameCharacteristic(subscription, id, service, characteristic))
+    {
+      return &subscription;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Subscription of a session to a characteristic, UUIDs as sent by the client. Caller holds subscriptionsLock.
+ */
+Subscription *NobleApi::lookupSubscription(BLEPeripheralID id, const char *service, const char *characteristic, uint8_t session)
+{
+  return findSubscription(id, normalizeUuid(service).c_str(), normalizeUuid(characteristic).c_str(), session);
+}
+
+/**
+ * Sessions notified of a characteristic, UUIDs in long form. Caller holds subscriptionsLock.
+ */
+uint8_t NobleApi::countNotifying(BLEPeripheralID id, const char *service, const char *characteristic)
+{
+  uint8_t count = 0;
+  for (auto i = 0; i < ESP_GW_MAX_SUBSCRIPTIONS; i++)
+  {
+    if (subscriptions[i].notifying && sameCharacteristic(subscriptions[i], id, service, characteristic))
+    {
+      count++;
+    }
+  }
+  return count;
+}
+
+/**
+ * Find or create the subscription of a session to a characteristic, UUIDs as sent by the client.
+ * Caller holds subscriptionsLock.
+ * @return nullptr if all slots are taken
+ */
+Subscription *NobleApi::addSubscription(BLEPeripheralID id, const char *service, const char *characteristic, uint8_t session)
+{
+  std::string serviceUuid = normalizeUuid(service);
+  std::string characteristicUuid = normalizeUuid(characteristic);
+  Subscription *subscription = findSubscription(id, serviceUuid.c_str(), characteristicUuid.c_str(), session);
+  if (subscription != nullptr)
+  {
+    return subscription;
+  }
+  for (auto i = 0; i < ESP_GW_MAX_SUBSCRIPTIONS; i++)
+  {
+    if (!subscriptions[i].active)
+    {
+      subscription = &subscriptions[i];
+      subscription->active = true;
+      subscription->session = session;
+      subscription->id = id;
+      strlcpy(subscription->service, serviceUuid.c_str(), sizeof(subscription->service));
+      strlcpy(subscription->characteristic, characteristicUuid.c_str(), sizeof(subscription->characteristic));
+      subscription->maxDelay = 0;
+      subscription->maxBatch = ESP_GW_MAX_BATCH;
+      memset(&subscription->filter, 0, sizeof(subscription->filter));
+      subscription->notifying = false;
+      subscription->pollInterval = 0;
+      subscription->count = 0;
+      subscription->batchLength = 0;
+      return subscription;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Send what is pending and free the slot. Caller holds subscriptionsLock.
+ */
+void NobleApi::removeSubscription(Subscription &subscription)
+{
+  flushBatch(subscription);
+  Memory::release(subscription.batch);
+  subscription.batch = nullptr;
+  subscription.batchCapacity = 0;
+  subscription.active = false;
+  subscription.notifying = false;
+}
+
+/**
+ * Peripheral is gone, drop all its subscriptions
+ */
+void NobleApi::removeSubscriptions(BLEPeripheralID id)
+{
+  xSemaphoreTake(subscriptionsLock, portMAX_DELAY);
+  for (auto i = 0; i < ESP_GW_MAX_SUBSCRIPTIONS; i++)
+  {
+    if (subscriptions[i].active && subscriptions[i].id == id)
+    {
+      removeSubscription(subscriptions[i]);
+    }
+  }
+  xSemaphoreGive(subscriptionsLock);
+}
+
+/**
+ * Session dropped its reference to a shared peripheral, the characteristics
+ * no other session is notified of are unsubscribed
+ */
+void NobleApi::removeSubscriptions(BLEPeripheralID id, uint8_t session)
+{
+  char service[REPLAY_MAX_UUID + 1];
+  char characteristic[REPLAY_MAX_UUID + 1];
+  bool found = true;
+  while (found)
+  {
+    found = false;
+    bool last = false;
+    xSemaphoreTake(subscriptionsLock, portMAX_DELAY);
+    for (auto i = 0; i < ESP_GW_MAX_SUBSCRIPTIONS; i++)
+    {
+      Subscription &subscription = subscriptions[i];
+      if (subscription.active && subscription.id == id && subscription.session == session)
+      {
+        strlcpy(service, subscription.service, sizeof(service));
+        strlcpy(characteristic, subscription.characteristic, sizeof(characteristic));
+        last = subscription.notifying && countNotifying(id, service, characteristic) == 1;
+        removeSubscription(subscription);
+        found = true;
+        break;
+      }
+    }
+    xSemaphoreGive(subscriptionsLock);
+    // notifications are handled under the lock, the peripheral is only written once it is released
+    if (last)
+    {
+      BLEApi::notifyCharacteristic(id, service, characteristic, false);
+    }
+  }
+}
+
+/**
+ * Persistent link is back, enable notifications again for every characteristic a session was notified of
+ */
+void NobleApi::restoreSubscriptions(BLEPeripheralID id)
+{
+  char service[REPLAY_MAX_UUID + 1];
+  char characteristic[REPLAY_MAX_UUID + 1];
+  for (auto i = 0; i < ESP_GW_MAX_SUBSCRIPTIONS; i++)
+  {
+    bool restore = false;
+    xSemaphoreTake(subscriptionsLock, portMAX_DELAY);
+    Subscription &subscription = subscriptions[i];
+    if (subscription.active && subscription.notifying && subscription.id == id)
+    {
+      // once per characteristic, by its first notifying session
+      restore = true;
+      for (auto j = 0; j < i && restore; j++)
+      {
+        restore = !(subscriptions[j].notifying && sameCharacteristic(subscriptions[j], id, subscription.service, subscription.characteristic));
+      }
+      strlcpy(service, subscription.service, sizeof(service));
+      strlcpy(characteristic, subscription.characteristic, sizeof(characteristic));
+    }
+    xSemaphoreGive(subscriptionsLock);
+    // the peripheral is only written once the lock is released
+    if (restore)
+    {
+      bool subscribed = BLEApi::notifyCharacteristic(id, service, characteristic, true);
+      Metrics::inc(subscribed ? METRIC_GATT_NOTIFY_OK : METRIC_GATT_NOTIFY_FAILED);
+      if (!subscribed)
+      {
+        Serial.printf("Could not restore notifications of %s\n", characteristic);
+      }
+    }
+  }
+}
+
+/**
+ * FNV-1a, enough to tell a repeated value from a new one
+ */
+static uint32_t valueHash(const std::string &data)
+{
+  uint32_t hash = 2166136261u;
+  for (char c : data)
+  {
+    hash = (hash ^ (uint8_t)c) * 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Little endian number of the filter width at the filter offset
+ */
+static bool readNumber(const NotificationFilter &filter, const std::string &data, int64_t &value)
+{
+  if ((size_t)filter.offset + filter.width > data.length())
+  {
+    return false;
+  }
+  uint32_t raw = 0;
+  for (auto i = 0; i < filter.width; i++)
+  {
+    raw |= (uint32_t)(uint8_t)data[filter.offset + i] << (8 * i);
+  }
+  if (filter.isSigned && filter.width < 4 && (raw & (1u << (8 * filter.width - 1))))
+  {
+    raw |= 0xFFFFFFFFu << (8 * filter.width);
+  }
+  value = filter.isSigned ? (int64_t)(int32_t)raw : (int64_t)raw;
+  return true;
+}
+
+/**
+ * Set the filter from {"changeOnly", "delta", "offset", "width", "signed", "minInterval"}, a missing filter clears it.
+ * Caller holds subscriptionsLock.
+ */
+void NobleApi::setFilter(Subscription &subscription, JsonVariantConst options)
+{
+  NotificationFilter &filter = subscription.filter;
+  memset(&filter, 0, sizeof(filter));
+  if (!options.is<JsonObjectConst>())
+  {
+    return;
+  }
+  if (options["changeOnly"] | false)
+  {
+    filter.flags |= FILTER_CHANGE;
+  }
+  if (options["delta"].is<uint32_t>())
+  {
+    uint8_t width = options["width"] | 1;
+    if (width == 1 || width == 2 || width == 4)
+    {
+      filter.flags |= FILTER_DELTA;
+      filter.delta = options["delta"];
+      filter.offset = options["offset"] | 0;
+      filter.width = width;
+      filter.isSigned = options["signed"] | false;
+    }
+  }
+  filter.minInterval = options["minInterval"].as<uint16_t>();
+  if (filter.minInterval > 0)
+  {
+    filter.flags |= FILTER_INTERVAL;
+  }
+}
+
+/**
+ * Apply a subscription filter, every enabled condition has to pass. Caller holds subscriptionsLock.
+ * @return false if the notification is suppressed
+ */
+bool NobleApi::passFilter(NotificationFilter &filter, const std::string &data)
+{
+  if (filter.flags == 0)
+  {
+    return true;
+  }
+  bool forward = true;
+  uint32_t now = millis();
+  uint32_t hash = (filter.flags & FILTER_CHANGE) ? valueHash(data) : 0;
+  int64_t number = 0;
+  bool hasNumber = (filter.flags & FILTER_DELTA) && readNumber(filter, data, number);
+  if (filter.hasLast)
+  {
+    if ((filter.flags & FILTER_INTERVAL) && now - filter.lastForwarded < filter.minInterval)
+    {
+      forward = false;
+    }
+    else if ((filter.flags & FILTER_CHANGE) && hash == filter.lastHash && data.length() == filter.lastLength)
+    {
+      forward = false;
+    }
+    else if (hasNumber)
+    {
+      int64_t last = filter.isSigned ? (int64_t)(int32_t)filter.lastNumber : (int64_t)filter.lastNumber;
+      int64_t moved = number > last ? number - last : last - number;
+      if (moved <= filter.delta)
+      {
+        forward = false;
+      }
+    }
+  }
+  if (forward)
+  {
+    filter.hasLast = true;
+    filter.lastForwarded = now;
+    filter.lastHash = hash;
+    filter.lastLength = data.length();
+    if (hasNumber)
+    {
+      filter.lastNumber = (uint32_t)number;
+    }
+  }
+  else
+  {
+    filter.suppressed++;
+    Metrics::inc(METRIC_NOTIFICATIONS_SUPPRESSED);
+  }
+  return forward;
+}
+
+/**
+ * Target sessions subscribed to the characteristic whose filter lets the value through.
+ * Notifications go to the sessions notified of it, polled values to the sessions polling it.
+ */
+uint32_t NobleApi::filterNotification(uint32_t targets, BLEPeripheralID id, const std::string &service, const std::string &characteristic, const std::string &data, bool polled)
+{
+  uint32_t subscribers = 0;
+  xSemaphoreTake(subscriptionsLock, portMAX_DELAY);
+  for (auto i = 0; i < ESP_GW_MAX_SUBSCRIPTIONS; i++)
+  {
+    Subscription &subscription = subscriptions[i];
+    if ((targets & (1u << subscription.session)) && (polled ? subscription.pollInterval > 0 : subscription.notifying) &&
+        sameCharacteristic(subscription, id, service.c_str(), characteristic.c_str()) && passFilter(subscription.filter, data))
+    {
+      subscribers |= 1u << subscription.session;
+    }
+  }
+  xSemaphoreGive(subscriptionsLock);
+  return subscribers;
+}
+
+/**
+ * Active subscriptions with their options and suppressed count, for stats
+ */
+void NobleApi::subscriptionsToJson(JsonArray out)
+{
+  xSemaphoreTake(subscriptionsLock, portMAX_DELAY);
+  for (auto i = 0; i < ESP_GW_MAX_SUBSCRIPTIONS; i++)
+  {
+    Subscription &subscription = subscriptions[i];
+    if (subscription.active)
+    {
+      JsonObject item = out.createNestedObject();
+      item["session"] = subscription.session;
+      item["peripheralUuid"] = BLEApi::idToString(subscription.id);
+      item["characteristicUuid"] = (const char *)subscription.characteristic;
+      item["maxDelay"] = subscription.maxDelay;
+      item["pollInterval"] = subscription.pollInterval;
+      item["filter"] = subscription.filter.flags;
+      item["suppressed"] = subscription.filter.suppressed;
+    }
+  }
+  xSemaphoreGive(subscriptionsLock);
+}
+
+/**
+ * Hold a notification for the coalescing subscriptions of the target sessions,
+ * each batch is sent once it is full or maxDelay old
+ * @return target sessions that must get the notification on its own
+ */
+uint32_t NobleApi::batchNotification(uint32_t targets, BLEPeripheralID id, const std::string &service, const std::string &characteristic, const std::string &data, const EventTag &tag)
+{
+  if (targets == 0)
+  {
+    return 0;
+  }
+  int64_t now = Latency::now();
+  xSemaphoreTake(subscriptionsLock, portMAX_DELAY);
+  for (auto i = 0; i < ESP_GW_MAX_SUBSCRIPTIONS; i++)
+  {
+    Subscription *subscription = &subscriptions[i];
+    if (!(targets & (1u << subscription->session)) || subscription->maxDelay == 0 || !sameCharacteristic(*subscription, id, service.c_str(), characteristic.c_str()))
+    {
+      continue;
+    }
+    size_t needed = subscription->batchLength + BATCH_ITEM_HEADER + data.length();
+    if (needed > subscription->batchCapacity)
+    {
+      size_t capacity = subscription->batchCapacity * 2 > needed ? subscription->batchCapacity * 2 : needed;
+      uint8_t *batch = (uint8_t *)Memory::reallocate(MEMORY_TAG_NOBLE, subscription->batch, capacity);
+      if (batch != nullptr)
+      {
+        subscription->batch = batch;
+        subscription->batchCapacity = capacity;
+      }
+    }
+    if (needed <= subscription->batchCapacity)
+    {
+      if (subscription->count == 0)
+      {
+        subscription->started = now;
+        subscription->timestamp = tag.seq > 0 ? tag.timestamp : millis();
+      }
+      uint32_t offset = now - subscription->started;
+      uint16_t length = data.length();
+      uint8_t *item = subscription->batch + subscription->batchLength;
+      memcpy(item, &offset, sizeof(offset));
+      memcpy(item + sizeof(offset), &length, sizeof(length));
+      memcpy(item + BATCH_ITEM_HEADER, data.data(), length);
+      subscription->batchLength = needed;
+      subscription->count++;
+      subscription->seq = tag.seq;
+      targets &= ~(1u << subscription->session);
+      if (subscription->count >= subscription->maxBatch)
+      {
+        flushBatch(*subscription);
+      }
+    }
+  }
+  xSemaphoreGive(subscriptionsLock);
+  return targets;
+}
+
+/**
+ * Send the pending batch to the client of the subscription session. Caller holds subscriptionsLock.
+ * Clients that are away miss it, the notifications are in the replay ring.
+ */
+void NobleApi::flushBatch(Subscription &subscription)
+{
+  if (subscription.count == 0)
+  {
+    return;
+  }
+  uint8_t client = sessions[subscription.session].client;
+  if (client != INVALID_CLIENT)
+  {
+    sendCharacteristicBatch(client, subscription);
+  }
+  subscription.count = 0;
+  subscription.batchLength = 0;
+}
+
+/**
+ * Send the batches that reached maxDelay
+ */
+void NobleApi::flushBatches()
+{
+  int64_t now = Latency::now();
+  xSemaphoreTake(subscriptionsLock, portMAX_DELAY);
+  for (auto i = 0; i < ESP_GW_MAX_SUBSCRIPTIONS; i++)
+  {
+    Subscription &subscription = subscriptions[i];
+    if (subscription.active && subscription.count > 0 && now - subscription.started >= (int64_t)subscription.maxDelay * 1000)
+    {
+      flushBatch(subscription);
+    }
+  }
+  xSemaphoreGive(subscriptionsLock);
+}
+
+/**
+ * Queue one due polled characteristic per loop, round robin. The read goes through the BLE queue of the client
+ * of the session, so it counts against its rate and the peripheral depth and takes its deficit round robin turn.
+ * Polls of a detached session wait for it to be resumed.
+ */
+void NobleApi::pollSubscriptions()
+{
+  bool queued = false;
+  uint32_t now = millis();
+  xSemaphoreTake(subscriptionsLock, portMAX_DELAY);
+  for (auto i = 0; i < ESP_GW_MAX_SUBSCRIPTIONS; i++)
+  {
+    Subscription &subscription = subscriptions[(pollCursor + i) % ESP_GW_MAX_SUBSCRIPTIONS];
+    if (!subscription.active || subscription.pollInterval == 0 || (int32_t)(now - subscription.nextPoll) < 0)
+    {
+      continue;
+    }
+    uint8_t client = sessions[subscription.session].client;
+    if (client == INVALID_CLIENT)
+    {
+      continue;
+    }
+    StaticJsonDocument<256> document;
+    document["action"] = pollReadAction.name;
+    document["peripheralUuid"] = BLEApi::idToString(subscription.id);
+    document["serviceUuid"] = (const char *)subscription.service;
+    document["characteristicUuid"] = (const char *)subscription.characteristic;
+    uint32_t retryAfter = 0;
+    if (queueBLEOp(client, &pollReadAction, document, subscription.id, Latency::now(), retryAfter) == nullptr)
+    {
+      queued = true;
+      // up to 10% jitter so polls of several characteristics spread out
+      subscription.nextPoll = now + subscription.pollInterval + esp_random() % (subscription.pollInterval / 10 + 1);
+    }
+    else
+    {
+      // the client has no room for it, try again when it has
+      subscription.nextPoll = now + (retryAfter > 0 ? retryAfter : ESP_GW_MIN_POLL_INTERVAL);
+    }
+    pollCursor = (pollCursor + i + 1) % ESP_GW_MAX_SUBSCRIPTIONS;
+    break;
+  }
+  xSemaphoreGive(subscriptionsLock);
+  if (queued)
+  {
+    // run it without waiting for the next loop
+    wake();
+  }
+}
+
+/**
+ * Polled read taken from the BLE queue, the value goes through the notification path
+ * so filters, batching and replay apply
+ */
+void NobleApi::handlePollRead(uint8_t client, NobleCommand &command)
+{
+  uint8_t session = getSession(client);
+  if (session == INVALID_SESSION || !clientConnected(client, command.peripheralUuid))
+  {
+    // the poll or the link was dropped while the read was waiting
+    return;
+  }
+  Metrics::inc(METRIC_POLL_READS);
+  std::string value = BLEApi::readCharacteristic(command.peripheralUuid, command.serviceUuid, command.characteristicUuid);
+  if (value.length() > 0)
+  {
+    Metrics::inc(METRIC_GATT_READ_OK);
+    deliverNotification(getSessions(command.peripheralUuid) & (1u << session), command.peripheralUuid, command.serviceUuid, command.characteristicUuid, value, true, true);
+  }
+  else
+  {
+    Metrics::inc(METRIC_GATT_READ_FAILED);
+  }
+}
@@ -0,0 +1,246 @@
+#include "presence.h"
+
+#define PRESENCE_MASK (ESP_GW_PRESENCE_SLOTS - 1)
+
+PresenceEntry *Presence::entries = nullptr;
+uint16_t Presence::used = 0;
+uint32_t Presence::epoch = 0;
+portMUX_TYPE Presence::mux = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * Allocate the table, in SPIRAM when available
+ */
+bool Presence::init()
+{
+  entries = (PresenceEntry *)Memory::allocateLarge(MEMORY_TAG_BLE, sizeof(PresenceEntry) * ESP_GW_PRESENCE_SLOTS);
+  if (entries == nullptr)
+  {
+    Serial.println("Presence table allocation failed");
+    return false;
+  }
+  for (auto i = 0; i < ESP_GW_PRESENCE_SLOTS; i++)
+  {
+    entries[i].used = false;
+  }
+  return true;
+}
+
+/**
+ * Home slot of a peripheral, FNV-1a of the address
+ */
+uint16_t Presence::slotOf(BLEPeripheralID id)
+{
+  uint32_t hash = 2166136261u;
+  for (auto i = 0; i < ESP_BD_ADDR_LEN; i++)
+  {
+    hash = (hash ^ id[i]) * 16777619u;
+  }
+  return hash & PRESENCE_MASK;
+}
+
+/**
+ * Slot of a peripheral, or the free slot it would take. Caller holds the lock.
+ */
+uint16_t Presence::find(BLEPeripheralID id)
+{
+  uint16_t slot = slotOf(id);
+  while (entries[slot].used && entries[slot].id != id)
+  {
+    slot = (slot + 1) & PRESENCE_MASK;
+  }
+  return slot;
+}
+
+/**
+ * Free a slot, the entries after it move back so no probe sequence is broken. Caller holds the lock.
+ */
+void Presence::remove(uint16_t slot)
+{
+  uint16_t hole = slot;
+  uint16_t next = (hole + 1) & PRESENCE_MASK;
+  while (entries[next].used)
+  {
+    // an entry can fill the hole if its home slot is not between the hole and itself
+    uint16_t home = slotOf(entries[next].id);
+    if (((next - home) & PRESENCE_MASK) >= ((next - hole) & PRESENCE_MASK))
+    {
+      entries[hole] = entries[next];
+      hole = next;
+    }
+    next = (next + 1) & PRESENCE_MASK;
+  }
+  entries[hole].used = false;
+  used--;
+}
+
+/**
+ * Make room for a new device: drop the first expired device from its home slot on, or the one not seen
+ * for the longest time among the next PRESENCE_EVICT_PROBE devices. Expired devices elsewhere wait for
+ * another eviction, snapshots already leave them out. Caller holds the lock.
+ */
+void Presence::evict(uint16_t home, uint32_t now)
+{
+  uint16_t oldest = home;
+  uint32_t oldestAge = 0;
+  uint16_t slot = home;
+  for (uint16_t seen = 0; seen < PRESENCE_EVICT_PROBE; slot = (slot + 1) & PRESENCE_MASK)
+  {
+    if (!entries[slot].used)
+    {
+      continue;
+    }
+    uint32_t age = now - entries[slot].lastSeen;
+    if (age > ESP_GW_PRESENCE_TTL)
+    {
+      oldest = slot;
+      break;
+    }
+    if (seen == 0 || age >= oldestAge)
+    {
+      oldest = slot;
+      oldestAge = age;
+    }
+    seen++;
+  }
+  remove(oldest);
+}
+
+/**
+ * Record an advertisement, runs in the BLE host task
+ */
+void Presence::update(NimBLEAdvertisedDevice *advertisedDevice, BLEPeripheralID id)
+{
+  uint32_t now = millis();
+  int8_t raw = advertisedDevice->getRSSI();
+  int16_t rssi = raw * 16;
+  size_t length = advertisedDevice->getPayloadLength();
+  if (length > PRESENCE_MAX_ADV)
+  {
+    length = PRESENCE_MAX_ADV;
+  }
+  portENTER_CRITICAL(&mux);
+  if (entries != nullptr)
+  {
+    uint16_t slot = find(id);
+    if (!entries[slot].used)
+    {
+      if (used == PRESENCE_CAPACITY)
+      {
+        evict(slotOf(id), now);
+        slot = find(id);
+      }
+      entries[slot].used = true;
+      entries[slot].id = id;
+      entries[slot].firstSeen = now;
+      entries[slot].rssi = rssi;
+      entries[slot].windowEpoch = epoch;
+      entries[slot].windowCount = 0;
+      used++;
+    }
+    PresenceEntry &entry = entries[slot];
+    entry.rssi += (rssi - entry.rssi) / (1 << PRESENCE_RSSI_SHIFT);
+    entry.addressType = advertisedDevice->getAddressType();
+    entry.lastSeen = now;
+    entry.length = length;
+    memcpy(entry.advertisement, advertisedDevice->getPayload(), length);
+    if (entry.windowEpoch != epoch)
+    {
+      // first advertisement since the window was reset
+      entry.windowEpoch = epoch;
+      entry.windowCount = 0;
+    }
+    if (entry.windowCount == 0)
+    {
+      entry.windowMin = raw;
+      entry.windowMax = raw;
+      entry.windowSum = 0;
+    }
+    else if (raw < entry.windowMin)
+    {
+      entry.windowMin = raw;
+    }
+    else if (raw > entry.windowMax)
+    {
+      entry.windowMax = raw;
+    }
+    if (entry.windowCount < UINT16_MAX)
+    {
+      entry.windowCount++;
+      entry.windowSum += raw;
+    }
+  }
+  portEXIT_CRITICAL(&mux);
+}
+
+/**
+ * Copy up to max devices seen within the TTL, starting at slot cursor
+ * @param cursor advanced past the copied slots, ESP_GW_PRESENCE_SLOTS once the whole table was read
+ * @return number of devices copied
+ */
+uint16_t Presence::copy(uint16_t &cursor, PresenceEntry *out, uint16_t max)
+{
+  uint16_t copied = 0;
+  uint32_t now = millis();
+  portENTER_CRITICAL(&mux);
+  if (entries == nullptr)
+  {
+    cursor = ESP_GW_PRESENCE_SLOTS;
+  }
+  while (cursor < ESP_GW_PRESENCE_SLOTS && copied < max)
+  {
+    PresenceEntry &entry = entries[cursor++];
+    if (entry.used && now - entry.lastSeen <= ESP_GW_PRESENCE_TTL)
+    {
+      out[copied++] = entry;
+    }
+  }
+  portEXIT_CRITICAL(&mux);
+  return copied;
+}
+
+/**
+ * Copy up to max devices that advertised in the current report window and start a new window for them
+ * @param cursor advanced past the copied slots, ESP_GW_PRESENCE_SLOTS once the whole table was read
+ * @return number of devices copied
+ */
+uint16_t Presence::report(uint16_t &cursor, PresenceEntry *out, uint16_t max)
+{
+  uint16_t copied = 0;
+  portENTER_CRITICAL(&mux);
+  if (entries == nullptr)
+  {
+    cursor = ESP_GW_PRESENCE_SLOTS;
+  }
+  while (cursor < ESP_GW_PRESENCE_SLOTS && copied < max)
+  {
+    PresenceEntry &entry = entries[cursor++];
+    if (entry.used && entry.windowEpoch == epoch && entry.windowCount > 0)
+    {
+      out[copied++] = entry;
+      entry.windowCount = 0;
+    }
+  }
+  portEXIT_CRITICAL(&mux);
+  return copied;
+}
+
+/**
+ * Start a new report window for every device at once, their counters are cleared when they next advertise or are reported
+ */
+void Presence::resetWindow()
+{
+  portENTER_CRITICAL(&mux);
+  epoch++;
+  portEXIT_CRITICAL(&mux);
+}
+
+/**
+ * Devices in the table, expired ones included until they are evicted
+ */
+uint16_t Presence::count()
+{
+  portENTER_CRITICAL(&mux);
+  uint16_t count = used;
+  portEXIT_CRITICAL(&mux);
+  return count;
+}
@@ -0,0 +1,75 @@
+#ifndef ESP_GW_PRESENCE_H
+#define ESP_GW_PRESENCE_H
+
+// slots of the presence table, power of two
+#ifndef ESP_GW_PRESENCE_SLOTS
+#ifdef BOARD_HAS_PSRAM
+#define ESP_GW_PRESENCE_SLOTS 1024
+#else
+#define ESP_GW_PRESENCE_SLOTS 128
+#endif
+#endif
+
+// ms a device stays in the table after its last advertisement
+#ifndef ESP_GW_PRESENCE_TTL
+#define ESP_GW_PRESENCE_TTL 60000
+#endif
+
+// devices kept, the free slots keep the probe sequences short
+#define PRESENCE_CAPACITY (ESP_GW_PRESENCE_SLOTS * 3 / 4)
+#define PRESENCE_MAX_ADV 62  // advertisement and scan response
+#define PRESENCE_RSSI_SHIFT 2 // each advertisement moves the smoothed RSSI by 1/4 of the difference
+#define PRESENCE_EVICT_PROBE 16 // devices looked at to make room for a new one, the scan callback holds the lock meanwhile
+
+#include <Arduino.h>
+#include <NimBLEDevice.h>
+#include "memory_stats.h"
+#include "ble_api.h"
+
+static_assert((ESP_GW_PRESENCE_SLOTS & (ESP_GW_PRESENCE_SLOTS - 1)) == 0, "presence slots must be a power of two");
+static_assert(PRESENCE_CAPACITY >= PRESENCE_EVICT_PROBE, "presence table smaller than the eviction probe");
+
+struct PresenceEntry
+{
+  bool used;
+  BLEPeripheralID id;
+  uint8_t addressType;
+  int16_t rssi; // smoothed, 1/16 dBm
+  uint32_t firstSeen;
+  uint32_t lastSeen;
+  uint8_t length;
+  uint8_t advertisement[PRESENCE_MAX_ADV];
+  // current scan report window, stale when windowEpoch is not the current epoch
+  uint32_t windowEpoch;
+  uint16_t windowCount;
+  int8_t windowMin;
+  int8_t windowMax;
+  int32_t windowSum;
+};
+
+/**
+ * Devices seen by the scan with their last advertisement, open addressing by peripheral.
+ * Updated from the scan callback, read page by page for snapshots and scan reports.
+ */
+class Presence
+{
+public:
+  static bool init();
+  static void update(NimBLEAdvertisedDevice *advertisedDevice, BLEPeripheralID id);
+  static uint16_t copy(uint16_t &cursor, PresenceEntry *out, uint16_t max);
+  static uint16_t report(uint16_t &cursor, PresenceEntry *out, uint16_t max);
+  static void resetWindow();
+  static uint16_t count();
+
+private:
+  static PresenceEntry *entries;
+  static uint16_t used;
+  static uint32_t epoch;
+  static portMUX_TYPE mux;
+  static uint16_t slotOf(BLEPeripheralID id);
+  static uint16_t find(BLEPeripheralID id);
+  static void remove(uint16_t slot);
+  static void evict(uint16_t home, uint32_t now);
+};
+
+#endif
@@ -0,0 +1,260 @@
+#include "replay.h"
+
+ReplayEvent *Replay::events = nullptr;
+uint8_t *Replay::arena = nullptr;
+uint32_t Replay::first = 0;
+uint32_t Replay::next = 0;
+uint32_t Replay::committed = 0;
+uint32_t Replay::arenaHead = 0;
+uint32_t Replay::arenaUsed = 0;
+uint32_t Replay::sequence = 0;
+uint32_t Replay::lost[REPLAY_MAX_SESSIONS];
+uint32_t Replay::forgotten[REPLAY_MAX_SESSIONS];
+portMUX_TYPE Replay::mux = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * Allocate the ring, in SPIRAM when available
+ */
+bool Replay::init()
+{
+  events = (ReplayEvent *)Memory::allocateLarge(MEMORY_TAG_NOBLE, sizeof(ReplayEvent) * ESP_GW_REPLAY_EVENTS);
+  arena = (uint8_t *)Memory::allocateLarge(MEMORY_TAG_NOBLE, ESP_GW_REPLAY_BYTES);
+  if (events == nullptr || arena == nullptr)
+  {
+    Memory::release(events);
+    Memory::release(arena);
+    events = nullptr;
+    arena = nullptr;
+    Serial.println("Replay buffer allocation failed");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Tag the next event of some sessions and reserve its slot and bytes, the caller copies them in with commit().
+ * The sequence is always taken, even when the event cannot be kept, so clients see the gap.
+ * A value longer than REPLAY_MAX_DATA is not cut, the event is kept without it and marked dropped.
+ * @param index set to the slot to commit, REPLAY_NO_INDEX when the event is not kept
+ */
+EventTag Replay::reserve(uint32_t sessions, ReplayType type, BLEPeripheralID id, size_t serviceLength, size_t characteristicLength, size_t dataLength, uint32_t &index)
+{
+  bool dropped = dataLength > REPLAY_MAX_DATA;
+  serviceLength = serviceLength > REPLAY_MAX_UUID ? REPLAY_MAX_UUID : serviceLength;
+  characteristicLength = characteristicLength > REPLAY_MAX_UUID ? REPLAY_MAX_UUID : characteristicLength;
+  size_t length = serviceLength + characteristicLength + (dropped ? 0 : dataLength);
+
+  EventTag tag;
+  tag.timestamp = millis();
+  tag.replayed = false;
+  index = REPLAY_NO_INDEX;
+  portENTER_CRITICAL(&mux);
+  tag.seq = ++sequence;
+  bool room = events != nullptr;
+  while (room && (next - first == ESP_GW_REPLAY_EVENTS || arenaUsed + length > ESP_GW_REPLAY_BYTES))
+  {
+    room = evict();
+  }
+  if (room)
+  {
+    ReplayEvent &event = events[next % ESP_GW_REPLAY_EVENTS];
+    event.seq = tag.seq;
+    event.timestamp = tag.timestamp;
+    event.offset = (arenaHead + arenaUsed) % ESP_GW_REPLAY_BYTES;
+    event.length = length;
+    event.sessions = sessions;
+    event.type = type;
+    event.id = id;
+    event.serviceLength = serviceLength;
+    event.characteristicLength = characteristicLength;
+    event.ready = false;
+    event.dropped = dropped;
+    arenaUsed += length;
+    index = next++;
+  }
+  else
+  {
+    markLost(sessions, tag.seq);
+  }
+  portEXIT_CRITICAL(&mux);
+  return tag;
+}
+
+/**
+ * Copy the bytes of a reserved event into the arena. Readers get it once it and every older event are committed.
+ */
+void Replay::commit(uint32_t index, const std::string &service, const std::string &characteristic, const std::string &data)
+{
+  if (index == REPLAY_NO_INDEX)
+  {
+    return;
+  }
+  // a slot is not evicted before it is ready, nobody else touches it or its bytes meanwhile
+  ReplayEvent &event = events[index % ESP_GW_REPLAY_EVENTS];
+  uint32_t offset = event.offset;
+  write(offset, service.data(), event.serviceLength);
+  offset += event.serviceLength;
+  write(offset, characteristic.data(), event.characteristicLength);
+  offset += event.characteristicLength;
+  write(offset, data.data(), event.length - event.serviceLength - event.characteristicLength);
+  portENTER_CRITICAL(&mux);
+  event.ready = true;
+  while (committed != next && events[committed % ESP_GW_REPLAY_EVENTS].ready)
+  {
+    committed++;
+  }
+  portEXIT_CRITICAL(&mux);
+}
+
+/**
+ * Session slot is reused, its events must not be replayed to the new owner.
+ * The ring is left as is, events up to the current sequence no longer count for the session.
+ */
+void Replay::forget(uint8_t session)
+{
+  portENTER_CRITICAL(&mux);
+  forgotten[session] = sequence;
+  lost[session] = 0;
+  portEXIT_CRITICAL(&mux);
+}
+
+uint32_t Replay::begin()
+{
+  portENTER_CRITICAL(&mux);
+  uint32_t index = first;
+  portEXIT_CRITICAL(&mux);
+  return index;
+}
+
+uint32_t Replay::end()
+{
+  portENTER_CRITICAL(&mux);
+  uint32_t index = committed;
+  portEXIT_CRITICAL(&mux);
+  return index;
+}
+
+/**
+ * Some reserved events are not committed yet
+ */
+bool Replay::writing()
+{
+  portENTER_CRITICAL(&mux);
+  bool writing = committed != next;
+  portEXIT_CRITICAL(&mux);
+  return writing;
+}
+
+/**
+ * Copy a committed event out of the ring, its sessions no longer include those that forgot it
+ * @return false if it was already overwritten
+ */
+bool Replay::read(uint32_t index, ReplayEvent &event, std::string &service, std::string &characteristic, std::string &data)
+{
+  uint8_t bytes[REPLAY_MAX_UUID * 2 + REPLAY_MAX_DATA];
+  portENTER_CRITICAL(&mux);
+  bool found = events != nullptr && index - first < committed - first;
+  if (found)
+  {
+    event = events[index % ESP_GW_REPLAY_EVENTS];
+    for (uint32_t sessions = event.sessions; sessions != 0; sessions &= sessions - 1)
+    {
+      uint8_t session = __builtin_ctz(sessions);
+      if (event.seq <= forgotten[session])
+      {
+        event.sessions &= ~(1u << session);
+      }
+    }
+  }
+  portEXIT_CRITICAL(&mux);
+  if (!found)
+  {
+    return false;
+  }
+  copy(event.offset, bytes, event.length);
+  // the bytes are only written again once the event is evicted
+  portENTER_CRITICAL(&mux);
+  found = index - first < committed - first;
+  portEXIT_CRITICAL(&mux);
+  if (found)
+  {
+    service.assign((const char *)bytes, event.serviceLength);
+    characteristic.assign((const char *)bytes + event.serviceLength, event.characteristicLength);
+    data.assign((const char *)bytes + event.serviceLength + event.characteristicLength, event.length - event.serviceLength - event.characteristicLength);
+  }
+  return found;
+}
+
+/**
+ * Sequence of the newest event of a session that was not kept, 0 if there is none.
+ * Events are dropped oldest first, so every event of the session up to it is gone.
+ */
+uint32_t Replay::lostSeq(uint8_t session)
+{
+  portENTER_CRITICAL(&mux);
+  uint32_t seq = lost[session];
+  portEXIT_CRITICAL(&mux);
+  return seq;
+}
+
+/**
+ * Drop the oldest event, its bytes are at the head of the arena. Caller holds the lock.
+ * @return false if there is none or it is still being written
+ */
+bool Replay::evict()
+{
+  // events before committed are all ready
+  if (first == committed)
+  {
+    return false;
+  }
+  ReplayEvent &event = events[first % ESP_GW_REPLAY_EVENTS];
+  markLost(event.sessions, event.seq);
+  arenaHead = (arenaHead + event.length) % ESP_GW_REPLAY_BYTES;
+  arenaUsed -= event.length;
+  first++;
+  return true;
+}
+
+void Replay::markLost(uint32_t sessions, uint32_t seq)
+{
+  while (sessions != 0)
+  {
+    uint8_t session = __builtin_ctz(sessions);
+    // events from before the session slot was reused are not its own
+    if (seq > forgotten[session])
+    {
+      lost[session] = seq;
+    }
+    sessions &= sessions - 1;
+  }
+}
+
+void Replay::write(uint32_t offset, const void *data, size_t length)
+{
+  offset %= ESP_GW_REPLAY_BYTES;
+  size_t part = ESP_GW_REPLAY_BYTES - offset;
+  if (part >= length)
+  {
+    memcpy(arena + offset, data, length);
+  }
+  else
+  {
+    memcpy(arena + offset, data, part);
+    memcpy(arena, (const uint8_t *)data + part, length - part);
+  }
+}
+
+void Replay::copy(uint32_t offset, void *out, size_t length)
+{
+  size_t part = ESP_GW_REPLAY_BYTES - offset;
+  if (part >= length)
+  {
+    memcpy(out, arena + offset, length);
+  }
+  else
+  {
+    memcpy(out, arena + offset, part);
+    memcpy((uint8_t *)out + part, arena, length - part);
+  }
+}
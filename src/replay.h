@@ -0,0 +1,101 @@
+#ifndef ESP_GW_REPLAY_H
+#define ESP_GW_REPLAY_H
+
+// events kept for replay and the bytes for their UUIDs and data, shared by all sessions
+#ifndef ESP_GW_REPLAY_EVENTS
+#ifdef BOARD_HAS_PSRAM
+#define ESP_GW_REPLAY_EVENTS 1024
+#else
+#define ESP_GW_REPLAY_EVENTS 32
+#endif
+#endif
+
+#ifndef ESP_GW_REPLAY_BYTES
+#ifdef BOARD_HAS_PSRAM
+#define ESP_GW_REPLAY_BYTES 131072
+#else
+#define ESP_GW_REPLAY_BYTES 4096
+#endif
+#endif
+
+#define REPLAY_MAX_UUID 36   // 128 bit UUID string
+#define REPLAY_MAX_DATA 512  // largest attribute value
+#define REPLAY_MAX_SESSIONS 32 // sessions are bits of ReplayEvent::sessions
+#define REPLAY_NO_INDEX UINT32_MAX // event could not be reserved
+
+#include <Arduino.h>
+#include <string>
+#include "memory_stats.h"
+#include "ble_api.h"
+
+enum ReplayType : uint8_t
+{
+  REPLAY_NOTIFICATION,
+  REPLAY_CONNECT,
+  REPLAY_DISCONNECT,
+  REPLAY_RECONNECT
+};
+
+struct ReplayEvent
+{
+  uint32_t seq;
+  uint32_t timestamp;
+  uint32_t offset;
+  uint32_t sessions; // sessions the event belongs to
+  uint16_t length;
+  ReplayType type;
+  BLEPeripheralID id;
+  uint8_t serviceLength;
+  uint8_t characteristicLength;
+  bool ready;   // bytes are written, see Replay::commit
+  bool dropped; // value longer than REPLAY_MAX_DATA, kept without its bytes
+};
+
+/**
+ * Sequence number and time of an event sent to a client
+ */
+struct EventTag
+{
+  uint32_t seq;
+  uint32_t timestamp;
+  bool replayed;
+};
+
+/**
+ * Bounded ring of the notifications and connection events of all sessions,
+ * oldest events are overwritten first. Indexes are absolute and keep growing.
+ * Sequence numbers are gateway wide, an event shared by several sessions is kept once.
+ * Only the ring indexes are changed under the lock, bytes are copied in and out of the arena outside of it.
+ */
+class Replay
+{
+public:
+  static bool init();
+  static EventTag reserve(uint32_t sessions, ReplayType type, BLEPeripheralID id, size_t serviceLength, size_t characteristicLength, size_t dataLength, uint32_t &index);
+  static void commit(uint32_t index, const std::string &service, const std::string &characteristic, const std::string &data);
+  static void forget(uint8_t session);
+  static uint32_t begin();
+  static uint32_t end();
+  static bool writing();
+  static bool read(uint32_t index, ReplayEvent &event, std::string &service, std::string &characteristic, std::string &data);
+  static uint32_t lostSeq(uint8_t session);
+
+private:
+  static ReplayEvent *events;
+  static uint8_t *arena;
+  static uint32_t first;
+  static uint32_t next;
+  static uint32_t committed;
+  static uint32_t arenaHead;
+  static uint32_t arenaUsed;
+  static uint32_t sequence;
+  static uint32_t lost[REPLAY_MAX_SESSIONS];
+  static uint32_t forgotten[REPLAY_MAX_SESSIONS];
+  static portMUX_TYPE mux;
+  static bool evict();
+  static void markLost(uint32_t sessions, uint32_t seq);
+  static void write(uint32_t offset, const void *data, size_t length);
+  static void copy(uint32_t offset, void *out, size_t length);
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include "security.h"
+#include "hex.h"
 #include "stdlib.h"
 #include "string.h"
 #include <esp_system.h>
@@ -31,11 +32,17 @@ void Security::generateKey(char *newKey) {
 
 void Security::setKey(const char *aesKey)
 {
-  keyLength = strlen(aesKey) / 2;
-  uint8_t localKey[keyLength];
-  fromHex(aesKey, keyLength * 2, localKey);
-  ESP_LOG_BUFFER_HEX("KEY      ", localKey, keyLength);
-  memcpy(key, localKey, BLOCK_SIZE);
+  size_t localKeyLength = strlen(aesKey) / 2;
+  uint8_t localKey[localKeyLength];
+  fromHex(aesKey, localKeyLength * 2, localKey);
+  ESP_LOG_BUFFER_HEX("KEY      ", localKey, localKeyLength);
+  setKey(localKey, localKeyLength);
+}
+
+void Security::setKey(const uint8_t *aesKey, size_t aesKeyLength)
+{
+  keyLength = aesKeyLength;
+  memcpy(key, aesKey, BLOCK_SIZE);
   esp_aes_setkey(&aesContext, key, keyLength * 8);
 }
 
@@ -45,16 +52,12 @@ void Security::getKey(uint8_t *aesKey) {
 
 void Security::generateIV(uint8_t IV[BLOCK_SIZE])
 {
-  uint8_t localIV[BLOCK_SIZE];
-  esp_fill_random(localIV, BLOCK_SIZE);
-  for (uint8_t i = 0; i < BLOCK_SIZE; i++)
-  {
-    uint8_t nib1 = (localIV[i] >> 4) & 0x0F;
-    uint8_t nib2 = (localIV[i] >> 0) & 0x0F;
-    IV[i * 2 + 0] = nib1 < 0xA ? '0' + nib1 : 'A' + nib1 - 0xA;
-    IV[i * 2 + 1] = nib2 < 0xA ? '0' + nib2 : 'A' + nib2 - 0xA;
-  }
-  IV[BLOCK_SIZE] = '\0';
+  // the IV is the hex representation of BLOCK_SIZE / 2 random bytes
+  uint8_t localIV[BLOCK_SIZE / 2];
+  char hexIV[BLOCK_SIZE + 1];
+  esp_fill_random(localIV, BLOCK_SIZE / 2);
+  Hex::encode(localIV, BLOCK_SIZE / 2, hexIV);
+  memcpy(IV, hexIV, BLOCK_SIZE);
 }
 
 size_t Security::getPadedSize(size_t dataLength)
@@ -95,31 +98,104 @@ size_t Security::decrypt(const uint8_t IV[BLOCK_SIZE], const uint8_t *data, size
   return dataLength;
 }
 
-uint8_t Security::fromHex(const char *data, const size_t dataLength, uint8_t *out)
+/**
+ * Derive a new key by encrypting a single block with the current key
+ */
+bool Security::deriveKey(const uint8_t input[BLOCK_SIZE], uint8_t derived[BLOCK_SIZE])
+{
+  return esp_aes_crypt_ecb(&aesContext, ESP_AES_ENCRYPT, input, derived) == 0;
+}
+
+/**
+ * AES-CTR encrypt or decrypt data in place
+ * @param nonce initial counter block, the low 4 bytes are used as block counter
+ */
+bool Security::cryptCtr(const uint8_t nonce[BLOCK_SIZE], uint8_t *data, size_t dataLength)
+{
+  uint8_t counter[BLOCK_SIZE];
+  uint8_t streamBlock[BLOCK_SIZE];
+  size_t offset = 0;
+  memcpy(counter, nonce, BLOCK_SIZE);
+  return esp_aes_crypt_ctr(&aesContext, dataLength, &offset, counter, streamBlock, data, data) == 0;
+}
+
+/**
+ * CMAC subkey: the block shifted left by one bit, with the constant added when the top bit falls out
+ */
+static void cmacSubkey(const uint8_t in[BLOCK_SIZE], uint8_t out[BLOCK_SIZE])
 {
-  uint8_t outLen = dataLength / 2;
-  char tmp[3];
-  tmp[2] = '\0';
-  for (int i = 0; i < outLen; i++)
+  uint8_t carry = in[0] >> 7;
+  for (auto i = 0; i < BLOCK_SIZE - 1; i++)
+  {
+    out[i] = in[i] << 1 | in[i + 1] >> 7;
+  }
+  out[BLOCK_SIZE - 1] = in[BLOCK_SIZE - 1] << 1;
+  if (carry)
   {
-    tmp[0] = data[i * 2];
-    tmp[1] = data[i * 2 + 1];
-    out[i] = strtoul(tmp, NULL, 16);
-    // ESP_LOG_BUFFER_HEXDUMP("Response", tmp, 2, esp_log_level_t::ESP_LOG_INFO);
-    // Serial.println(out[i], HEX);
+    out[BLOCK_SIZE - 1] ^= 0x87;
   }
-  return outLen;
 }
 
-uint8_t Security::toHex(const uint8_t *data, const size_t dataLength, char *out)
+/**
+ * AES-CMAC (RFC 4493) of a first block followed by data
+ */
+bool Security::cmac(const uint8_t first[BLOCK_SIZE], const uint8_t *data, size_t dataLength, uint8_t mac[BLOCK_SIZE])
 {
-  for (uint8_t i = 0; i < dataLength; i++)
+  uint8_t subkey[BLOCK_SIZE] = {0};
+  uint8_t state[BLOCK_SIZE];
+  if (esp_aes_crypt_ecb(&aesContext, ESP_AES_ENCRYPT, subkey, subkey) != 0)
   {
-    uint8_t nib1 = (data[i] >> 4) & 0x0F;
-    uint8_t nib2 = (data[i] >> 0) & 0x0F;
-    out[i * 2 + 0] = nib1 < 0xA ? '0' + nib1 : 'A' + nib1 - 0xA;
-    out[i * 2 + 1] = nib2 < 0xA ? '0' + nib2 : 'A' + nib2 - 0xA;
+    return false;
   }
-  out[dataLength * 2] = '\0';
-  return dataLength * 2 + 1;
-}
\ No newline at end of file
+  cmacSubkey(subkey, subkey);
+  memcpy(state, first, BLOCK_SIZE);
+  if (dataLength > 0)
+  {
+    if (esp_aes_crypt_ecb(&aesContext, ESP_AES_ENCRYPT, state, state) != 0)
+    {
+      return false;
+    }
+    size_t offset = 0;
+    for (; dataLength - offset > BLOCK_SIZE; offset += BLOCK_SIZE)
+    {
+      for (auto i = 0; i < BLOCK_SIZE; i++)
+      {
+        state[i] ^= data[offset + i];
+      }
+      if (esp_aes_crypt_ecb(&aesContext, ESP_AES_ENCRYPT, state, state) != 0)
+      {
+        return false;
+      }
+    }
+    size_t rest = dataLength - offset;
+    for (size_t i = 0; i < rest; i++)
+    {
+      state[i] ^= data[offset + i];
+    }
+    if (rest < BLOCK_SIZE)
+    {
+      // incomplete last block is padded with 0x80 0x00... and takes the second subkey
+      state[rest] ^= 0x80;
+      cmacSubkey(subkey, subkey);
+    }
+  }
+  for (auto i = 0; i < BLOCK_SIZE; i++)
+  {
+    state[i] ^= subkey[i];
+  }
+  return esp_aes_crypt_ecb(&aesContext, ESP_AES_ENCRYPT, state, mac) == 0;
+}
+
+uint8_t Security::fromHex(const char *data, const size_t dataLength, uint8_t *out)
+{
+  if (!Hex::decode(data, dataLength, out))
+  {
+    return 0;
+  }
+  return Hex::decodedLength(dataLength);
+}
+
+uint8_t Security::toHex(const uint8_t *data, const size_t dataLength, char *out)
+{
+  return Hex::encode(data, dataLength, out) + 1;
+}
@@ -11,11 +11,15 @@ class Security {
     Security(const char *aesKey);
     ~Security();
     void setKey(const char *aesKey);
+    void setKey(const uint8_t *aesKey, size_t aesKeyLength);
     void getKey(uint8_t *aesKey);
     void generateIV(uint8_t IV[BLOCK_SIZE]);
     size_t getPadedSize(size_t dataLength);
     size_t encrypt(const uint8_t IV[BLOCK_SIZE], const uint8_t *data, size_t dataLength, uint8_t *encrypted);
     size_t decrypt(const uint8_t IV[BLOCK_SIZE], const uint8_t *data, size_t dataLength, uint8_t *decrypted);
+    bool deriveKey(const uint8_t input[BLOCK_SIZE], uint8_t derived[BLOCK_SIZE]);
+    bool cryptCtr(const uint8_t nonce[BLOCK_SIZE], uint8_t *data, size_t dataLength);
+    bool cmac(const uint8_t first[BLOCK_SIZE], const uint8_t *data, size_t dataLength, uint8_t mac[BLOCK_SIZE]);
     
     static void generateKey(char *newKey);
     static uint8_t fromHex(const char *data, const size_t dataLength, uint8_t *out);
@@ -0,0 +1,247 @@
+#include "tx_queue.h"
+#include "metrics.h"
+#include <new>
+
+/**
+ * Allocate a buffer for a message of length bytes, with one reference held by the caller
+ */
+TxBuffer *TxBuffer::create(size_t length, bool binary)
+{
+  // headroom in front, tailroom after
+  void *memory = Memory::allocate(MEMORY_TAG_NOBLE, sizeof(TxBuffer) + TX_HEADROOM + length + TX_TAILROOM);
+  if (memory == nullptr)
+  {
+    return nullptr;
+  }
+  TxBuffer *buffer = new (memory) TxBuffer;
+  buffer->refs.store(1, std::memory_order_relaxed);
+  buffer->binary = binary;
+  buffer->length = length;
+  return buffer;
+}
+
+/**
+ * Serialize a document as MessagePack or JSON
+ */
+TxBuffer *TxBuffer::fromJson(JsonDocument &document, bool packed)
+{
+  size_t length = packed ? measureMsgPack(document) : measureJson(document);
+  TxBuffer *buffer = create(length, packed);
+  if (buffer == nullptr)
+  {
+    return nullptr;
+  }
+  if (packed)
+  {
+    serializeMsgPack(document, buffer->payload(), length);
+  }
+  else
+  {
+    serializeJson(document, (char *)buffer->payload(), length + 1);
+  }
+  return buffer;
+}
+
+void TxBuffer::retain()
+{
+  refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void TxBuffer::release()
+{
+  if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+  {
+    this->~TxBuffer();
+    Memory::release(this);
+  }
+}
+
+TxQueue::TxQueue() : head(0), count(0), stats()
+{
+  vPortCPUInitializeMutex(&mux);
+}
+
+/**
+ * Queue a message, taking a reference on the buffer.
+ * Discover messages replace a queued one of the same peripheral (or report page) or are dropped once the queue is deep,
+ * reliable messages evict the oldest discover message when the queue is full.
+ * @return false if the queue is full of reliable messages, the client is not keeping up
+ */
+bool TxQueue::push(TxBuffer *buffer, TxClass kind, BLEPeripheralID id, LatencyOp op, uint16_t page)
+{
+  TxBuffer *released = nullptr;
+  bool accepted = true;
+  buffer->retain();
+  portENTER_CRITICAL(&mux);
+  if (kind == TX_CLASS_DISCOVER && count >= ESP_GW_TX_QUEUE_DEEP)
+  {
+    released = buffer;
+    for (uint16_t i = 0; i < count; i++)
+    {
+      TxEntry &entry = entries[(head + i) % ESP_GW_TX_QUEUE_SIZE];
+      if (entry.kind == TX_CLASS_DISCOVER && entry.page == page && (page != TX_PAGE_NONE || entry.id == id))
+      {
+        // keep the queue position, send the latest advertisement or page
+        released = entry.buffer;
+        entry.buffer = buffer;
+        break;
+      }
+    }
+    if (released == buffer)
+    {
+      stats.dropped++;
+      Metrics::inc(METRIC_WS_TX_DROPPED);
+    }
+    else
+    {
+      stats.coalesced++;
+      Metrics::inc(METRIC_WS_TX_COALESCED);
+    }
+  }
+  else
+  {
+    if (count == ESP_GW_TX_QUEUE_SIZE)
+    {
+      for (uint16_t i = 0; i < count; i++)
+      {
+        if (entries[(head + i) % ESP_GW_TX_QUEUE_SIZE].kind == TX_CLASS_DISCOVER)
+        {
+          released = removeAt(i);
+          stats.dropped++;
+          Metrics::inc(METRIC_WS_TX_DROPPED);
+          break;
+        }
+      }
+    }
+    if (count == ESP_GW_TX_QUEUE_SIZE)
+    {
+      released = buffer;
+      accepted = false;
+    }
+    else
+    {
+      TxEntry &entry = entries[(head + count) % ESP_GW_TX_QUEUE_SIZE];
+      entry.buffer = buffer;
+      entry.kind = kind;
+      entry.op = op;
+      entry.id = id;
+      entry.page = page;
+      entry.queued = Latency::now();
+      count++;
+      stats.queued++;
+      if (count > stats.maxDepth)
+      {
+        stats.maxDepth = count;
+      }
+    }
+  }
+  portEXIT_CRITICAL(&mux);
+  // free outside of the critical section
+  if (released != nullptr)
+  {
+    released->release();
+  }
+  return accepted;
+}
+
+/**
+ * Take the oldest message of the highest class up to lowest, the caller owns the buffer reference
+ */
+bool TxQueue::pop(TxEntry &entry, TxClass lowest)
+{
+  bool found = false;
+  portENTER_CRITICAL(&mux);
+  uint16_t best = count;
+  for (uint16_t i = 0; i < count; i++)
+  {
+    TxClass kind = entries[(head + i) % ESP_GW_TX_QUEUE_SIZE].kind;
+    if (kind <= lowest && (best == count || kind < entries[(head + best) % ESP_GW_TX_QUEUE_SIZE].kind))
+    {
+      best = i;
+      if (kind == TX_CLASS_GATT)
+      {
+        break;
+      }
+    }
+  }
+  if (best < count)
+  {
+    entry = entries[(head + best) % ESP_GW_TX_QUEUE_SIZE];
+    removeAt(best);
+    found = true;
+  }
+  portEXIT_CRITICAL(&mux);
+  return found;
+}
+
+void TxQueue::clear()
+{
+  TxEntry entry;
+  while (pop(entry))
+  {
+    entry.buffer->release();
+  }
+  portENTER_CRITICAL(&mux);
+  stats = TxStats();
+  portEXIT_CRITICAL(&mux);
+}
+
+uint16_t TxQueue::depth()
+{
+  portENTER_CRITICAL(&mux);
+  uint16_t depth = count;
+  portEXIT_CRITICAL(&mux);
+  return depth;
+}
+
+void TxQueue::sent(size_t length, TxClass kind, uint32_t waitUs)
+{
+  portENTER_CRITICAL(&mux);
+  stats.sent++;
+  stats.bytes += length;
+  if (waitUs > stats.maxWaitUs[kind])
+  {
+    stats.maxWaitUs[kind] = waitUs;
+  }
+  portEXIT_CRITICAL(&mux);
+}
+
+void TxQueue::toJson(JsonObject out)
+{
+  portENTER_CRITICAL(&mux);
+  TxStats current = stats;
+  uint16_t depth = count;
+  portEXIT_CRITICAL(&mux);
+  out["queued"] = current.queued;
+  out["sent"] = current.sent;
+  out["dropped"] = current.dropped;
+  out["coalesced"] = current.coalesced;
+  out["bytes"] = current.bytes;
+  out["depth"] = depth;
+  out["maxDepth"] = current.maxDepth;
+  JsonArray maxWait = out.createNestedArray("maxWaitUs");
+  for (auto i = 0; i < TX_CLASS_COUNT; i++)
+  {
+    maxWait.add(current.maxWaitUs[i]);
+  }
+}
+
+/**
+ * Remove the entry at position index from the head, caller holds the lock
+ */
+TxBuffer *TxQueue::removeAt(uint16_t index)
+{
+  TxBuffer *buffer = entries[(head + index) % ESP_GW_TX_QUEUE_SIZE].buffer;
+  if (index == 0)
+  {
+    head = (head + 1) % ESP_GW_TX_QUEUE_SIZE;
+    count--;
+    return buffer;
+  }
+  for (uint16_t i = index; i + 1 < count; i++)
+  {
+    entries[(head + i) % ESP_GW_TX_QUEUE_SIZE] = entries[(head + i + 1) % ESP_GW_TX_QUEUE_SIZE];
+  }
+  count--;
+  return buffer;
+}
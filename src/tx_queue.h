@@ -0,0 +1,115 @@
+#ifndef ESP_GW_TX_QUEUE_H
+#define ESP_GW_TX_QUEUE_H
+
+#ifndef ESP_GW_TX_QUEUE_SIZE
+#ifdef BOARD_HAS_PSRAM
+#define ESP_GW_TX_QUEUE_SIZE 64
+#else
+#define ESP_GW_TX_QUEUE_SIZE 16
+#endif
+#endif
+
+// depth from which discover messages are coalesced per peripheral or dropped
+#ifndef ESP_GW_TX_QUEUE_DEEP
+#define ESP_GW_TX_QUEUE_DEEP (ESP_GW_TX_QUEUE_SIZE * 3 / 4)
+#endif
+
+// ms a client socket can stay unwritable with messages queued before the client is considered stuck
+#ifndef ESP_GW_TX_STUCK_TIMEOUT
+#define ESP_GW_TX_STUCK_TIMEOUT 10000
+#endif
+
+// messages sent per client on each loop, keeps one slow client from starving the others
+#ifndef ESP_GW_TX_DRAIN_BUDGET
+#define ESP_GW_TX_DRAIN_BUDGET 4
+#endif
+
+#define TX_HEADROOM 8 // room in front of each message for the encryption header
+#define TX_TAILROOM 16 // room after each message for the encryption tag, or the NUL terminator of text messages
+#define TX_PAGE_NONE 0xFFFF // discover message of a peripheral, not a page of a report
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <atomic>
+#include "memory_stats.h"
+#include "latency.h"
+#include "ble_api.h"
+
+/**
+ * Outbound classes in strict priority order, lower is sent first
+ */
+enum TxClass : uint8_t
+{
+  TX_CLASS_GATT,     // GATT replies and notifications, never dropped
+  TX_CLASS_STATE,    // auth, session and connection state events, never dropped
+  TX_CLASS_DISCOVER, // advertisements, coalesced or dropped under pressure
+  TX_CLASS_COUNT
+};
+
+/**
+ * Serialized message shared by all the queues it was pushed to.
+ * The payload starts at frame + TX_HEADROOM and is followed by TX_TAILROOM bytes.
+ */
+struct TxBuffer
+{
+  std::atomic<uint16_t> refs;
+  bool binary;
+  size_t length;
+  uint8_t frame[];
+
+  uint8_t *payload()
+  {
+    return frame + TX_HEADROOM;
+  }
+  static TxBuffer *create(size_t length, bool binary);
+  static TxBuffer *fromJson(JsonDocument &document, bool packed);
+  void retain();
+  void release();
+};
+
+struct TxEntry
+{
+  TxBuffer *buffer;
+  TxClass kind;
+  LatencyOp op;
+  BLEPeripheralID id;
+  uint16_t page; // discover messages are coalesced by page, or by peripheral when TX_PAGE_NONE
+  int64_t queued;
+};
+
+struct TxStats
+{
+  uint32_t queued;
+  uint32_t sent;
+  uint32_t dropped;
+  uint32_t coalesced;
+  uint32_t bytes;
+  uint16_t maxDepth;
+  uint32_t maxWaitUs[TX_CLASS_COUNT];
+};
+
+/**
+ * Bounded outbound queue of one WebSocket client.
+ * Pushed from any task, drained by the API task highest class first, FIFO within a class.
+ */
+class TxQueue
+{
+public:
+  TxQueue();
+  bool push(TxBuffer *buffer, TxClass kind, BLEPeripheralID id, LatencyOp op, uint16_t page = TX_PAGE_NONE);
+  bool pop(TxEntry &entry, TxClass lowest = TX_CLASS_DISCOVER);
+  void clear();
+  uint16_t depth();
+  void sent(size_t length, TxClass kind, uint32_t waitUs);
+  void toJson(JsonObject stats);
+
+private:
+  TxEntry entries[ESP_GW_TX_QUEUE_SIZE];
+  uint16_t head;
+  uint16_t count;
+  TxStats stats;
+  portMUX_TYPE mux;
+  TxBuffer *removeAt(uint16_t index);
+};
+
+#endif
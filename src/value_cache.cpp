@@ -0,0 +1,120 @@
+#include "value_cache.h"
+#include "latency.h"
+
+ValueCache::ValueCache() : entries(nullptr)
+{
+  lock = xSemaphoreCreateMutex();
+}
+
+/**
+ * Allocate the entries of a new connection, in SPIRAM when available
+ */
+bool ValueCache::init()
+{
+  CachedValue *memory = (CachedValue *)Memory::allocateLarge(MEMORY_TAG_BLE, sizeof(CachedValue) * ESP_GW_VALUE_CACHE_SIZE);
+  if (memory == nullptr)
+  {
+    return false;
+  }
+  for (auto i = 0; i < ESP_GW_VALUE_CACHE_SIZE; i++)
+  {
+    memory[i].handle = 0;
+  }
+  xSemaphoreTake(lock, portMAX_DELAY);
+  CachedValue *previous = entries;
+  entries = memory;
+  xSemaphoreGive(lock);
+  Memory::release(previous);
+  return true;
+}
+
+/**
+ * Connection is gone, its values with it
+ */
+void ValueCache::release()
+{
+  xSemaphoreTake(lock, portMAX_DELAY);
+  CachedValue *memory = entries;
+  entries = nullptr;
+  xSemaphoreGive(lock);
+  Memory::release(memory);
+}
+
+void ValueCache::store(uint16_t handle, const uint8_t *data, size_t length)
+{
+  if (length > ESP_GW_VALUE_CACHE_MAX_DATA)
+  {
+    invalidate(handle);
+    return;
+  }
+  int64_t now = Latency::now();
+  xSemaphoreTake(lock, portMAX_DELAY);
+  if (entries != nullptr)
+  {
+    CachedValue *slot = &entries[0];
+    for (auto i = 0; i < ESP_GW_VALUE_CACHE_SIZE; i++)
+    {
+      if (entries[i].handle == handle)
+      {
+        slot = &entries[i];
+        break;
+      }
+      if (slot->handle != 0 && (entries[i].handle == 0 || entries[i].updated < slot->updated))
+      {
+        slot = &entries[i];
+      }
+    }
+    slot->handle = handle;
+    slot->length = length;
+    slot->updated = now;
+    memcpy(slot->data, data, length);
+  }
+  xSemaphoreGive(lock);
+}
+
+/**
+ * Value was written or is too long to be cached
+ */
+void ValueCache::invalidate(uint16_t handle)
+{
+  xSemaphoreTake(lock, portMAX_DELAY);
+  if (entries != nullptr)
+  {
+    for (auto i = 0; i < ESP_GW_VALUE_CACHE_SIZE; i++)
+    {
+      if (entries[i].handle == handle)
+      {
+        entries[i].handle = 0;
+      }
+    }
+  }
+  xSemaphoreGive(lock);
+}
+
+/**
+ * Copy a cached value updated at most maxAge ms ago
+ * @return false if there is none
+ */
+bool ValueCache::lookup(uint16_t handle, uint32_t maxAge, std::string &value)
+{
+  bool found = false;
+  int64_t oldest = Latency::now() - (int64_t)maxAge * 1000;
+  xSemaphoreTake(lock, portMAX_DELAY);
+  if (entries != nullptr)
+  {
+    for (auto i = 0; i < ESP_GW_VALUE_CACHE_SIZE; i++)
+    {
+      if (entries[i].handle == handle)
+      {
+        if (entries[i].updated >= oldest)
+        {
+          value.assign((const char *)entries[i].data, entries[i].length);
+          found = true;
+        }
+        break;
+      }
+    }
+  }
+  xSemaphoreGive(lock);
+  return found;
+}
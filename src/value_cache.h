@@ -0,0 +1,54 @@
+#ifndef ESP_GW_VALUE_CACHE_H
+#define ESP_GW_VALUE_CACHE_H
+
+// characteristic values kept per connection for reads with maxAge
+#ifndef ESP_GW_VALUE_CACHE_SIZE
+#ifdef BOARD_HAS_PSRAM
+#define ESP_GW_VALUE_CACHE_SIZE 32
+#else
+#define ESP_GW_VALUE_CACHE_SIZE 8
+#endif
+#endif
+
+// longer values are not cached
+#ifndef ESP_GW_VALUE_CACHE_MAX_DATA
+#ifdef BOARD_HAS_PSRAM
+#define ESP_GW_VALUE_CACHE_MAX_DATA 512
+#else
+#define ESP_GW_VALUE_CACHE_MAX_DATA 64
+#endif
+#endif
+
+#include <Arduino.h>
+#include <string>
+#include "memory_stats.h"
+
+struct CachedValue
+{
+  uint16_t handle; // characteristic value handle, 0 when unused
+  uint16_t length;
+  int64_t updated;
+  uint8_t data[ESP_GW_VALUE_CACHE_MAX_DATA];
+};
+
+/**
+ * Last known characteristic values of one connection, updated by reads and notifications.
+ * The least recently updated value is replaced when the cache is full.
+ * Guarded by a mutex, values of up to 512 bytes in SPIRAM are too slow to copy in a critical section.
+ */
+class ValueCache
+{
+public:
+  ValueCache();
+  bool init();
+  void release();
+  void store(uint16_t handle, const uint8_t *data, size_t length);
+  void invalidate(uint16_t handle);
+  bool lookup(uint16_t handle, uint32_t maxAge, std::string &value);
+
+private:
+  CachedValue *entries;
+  SemaphoreHandle_t lock;
+};
+
+#endif
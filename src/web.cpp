@@ -7,7 +7,7 @@ SSLCert *WebManager::cert = nullptr;
 HTTPSServer *WebManager::serverSecure = nullptr;
 bool WebManager::rebootRequired = false;
 bool WebManager::rebootNextLoop = false;
-uint8_t *WebManager::buffer = new uint8_t[ESP_GW_WEBSERVER_BUFFER_SIZE];
+uint8_t *WebManager::buffer = (uint8_t *)Memory::allocateLarge(MEMORY_TAG_WEB, ESP_GW_WEBSERVER_BUFFER_SIZE);
 
 bool WebManager::init()
 {
@@ -23,6 +23,8 @@ bool WebManager::init()
   serverSecure->registerNode(new ResourceNode("/config", "GET", handleConfigGet));
   serverSecure->registerNode(new ResourceNode("/config", "POST", handleConfigSet));
   serverSecure->registerNode(new ResourceNode("/factoryReset", "GET", handleFactoryReset));
+  serverSecure->registerNode(new ResourceNode("/metrics", "GET", handleMetrics));
+  serverSecure->registerNode(new ResourceNode("/memory", "GET", handleMemory));
   serverSecure->setDefaultNode(new ResourceNode("", "", handleNotFound));
   serverSecure->start();
 
@@ -269,6 +271,24 @@ void WebManager::handleFactoryReset(HTTPRequest *req, HTTPResponse *res)
   rebootRequired = true;
 }
 
+void WebManager::handleMetrics(HTTPRequest *req, HTTPResponse *res)
+{
+  res->setHeader("Content-Type", "text/plain; version=0.0.4");
+  res->setHeader("Connection", "close");
+  Metrics::print(*res);
+}
+
+void WebManager::handleMemory(HTTPRequest *req, HTTPResponse *res)
+{
+  res->setHeader("Content-Type", "application/json");
+  res->setHeader("Connection", "close");
+
+  Memory::sample();
+  TrackedJsonDocument memory(1024);
+  Memory::toJson(memory.to<JsonObject>());
+  serializeJson(memory, *res);
+}
+
 void WebManager::handleRedirect(HTTPRequest *req, HTTPResponse *res)
 {
   res->setHeader("Connection", "close");
@@ -16,6 +16,8 @@
 #include "gw_settings.h"
 #include "util.h"
 #include "security.h"
+#include "metrics.h"
+#include "memory_stats.h"
 #include <ArduinoJson.h>
 #include <WiFi.h>
 #include <HTTPSServer.hpp>
@@ -48,6 +50,8 @@ class WebManager {
     static void handleConfigGet(HTTPRequest * req, HTTPResponse * res);
     static void handleConfigSet(HTTPRequest * req, HTTPResponse * res);
     static void handleFactoryReset(HTTPRequest * req, HTTPResponse * res);
+    static void handleMetrics(HTTPRequest * req, HTTPResponse * res);
+    static void handleMemory(HTTPRequest * req, HTTPResponse * res);
     static void handleRedirect(HTTPRequest * req, HTTPResponse * res);
     static void handleNotFound(HTTPRequest *req, HTTPResponse *res);
 };
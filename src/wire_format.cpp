@@ -0,0 +1,40 @@
+#include "wire_format.h"
+#include <string>
+#include "hex.h"
+
+void WireFormat::setBinary(JsonVariant field, const uint8_t *data, size_t length, bool packed)
+{
+  if (packed)
+  {
+    std::string bin;
+    bin.reserve(length + 5);
+    if (length <= 0xFF)
+    {
+      bin += (char)0xC4;
+      bin += (char)length;
+    }
+    else if (length <= 0xFFFF)
+    {
+      bin += (char)0xC5;
+      bin += (char)(length >> 8);
+      bin += (char)length;
+    }
+    else
+    {
+      bin += (char)0xC6;
+      bin += (char)(length >> 24);
+      bin += (char)(length >> 16);
+      bin += (char)(length >> 8);
+      bin += (char)length;
+    }
+    bin.append((const char *)data, length);
+    // raw values are copied verbatim into the MessagePack output
+    field.set(serialized(bin));
+  }
+  else
+  {
+    char hexValue[length * 2 + 1];
+    Hex::encode(data, length, hexValue);
+    field.set(std::string(hexValue));
+  }
+}
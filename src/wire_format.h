@@ -0,0 +1,19 @@
+#ifndef ESP_GW_WIRE_FORMAT_H
+#define ESP_GW_WIRE_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ArduinoJson.h>
+
+/**
+ * Encoding of binary fields in outgoing messages, free of the API state so it builds on the host
+ */
+class WireFormat {
+  public:
+    /**
+     * Set field to data, as hex string for JSON and as a raw bin field for MessagePack
+     */
+    static void setBinary(JsonVariant field, const uint8_t *data, size_t length, bool packed);
+};
+
+#endif
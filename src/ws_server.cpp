@@ -0,0 +1,23 @@
+#include "ws_server.h"
+#include <lwip/sockets.h>
+
+/**
+ * Does the client socket have room in its send buffer ? Polls without waiting.
+ */
+bool GwWebSocketsServer::canWrite(uint8_t client)
+{
+  if (client >= WEBSOCKETS_SERVER_CLIENT_MAX || _clients[client].tcp == nullptr)
+  {
+    return false;
+  }
+  int fd = _clients[client].tcp->fd();
+  if (fd < 0)
+  {
+    return false;
+  }
+  fd_set writable;
+  FD_ZERO(&writable);
+  FD_SET(fd, &writable);
+  struct timeval timeout = {0, 0};
+  return select(fd + 1, nullptr, &writable, nullptr, &timeout) > 0;
+}
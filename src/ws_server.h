@@ -0,0 +1,17 @@
+#ifndef ESP_GW_WS_SERVER_H
+#define ESP_GW_WS_SERVER_H
+
+#include <WebSocketsServer.h>
+
+/**
+ * WebSocket server that can tell whether a client socket takes a write without blocking.
+ * The library sends synchronously, one client with a full TCP window would hold up the others.
+ */
+class GwWebSocketsServer : public WebSocketsServer
+{
+public:
+  using WebSocketsServer::WebSocketsServer;
+  bool canWrite(uint8_t client);
+};
+
+#endif
@@ -0,0 +1,221 @@
+#include <string.h>
+#include <unity.h>
+#include <ArduinoJson.h>
+#include "decoders.h"
+#include "hex.h"
+
+/**
+ * Decode a captured payload, given as hex without the company identifier or service data UUID
+ */
+static const Decoder *decodeHex(DecoderSource source, uint16_t key, const char *hex, JsonObject out)
+{
+  uint8_t data[64];
+  size_t length = strlen(hex);
+  TEST_ASSERT_TRUE(length / 2 <= sizeof(data));
+  TEST_ASSERT_TRUE(Hex::decode(hex, length, data));
+  return Decoders::decode(source, key, data, Hex::decodedLength(length), out);
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_unknown_key()
+{
+  StaticJsonDocument<512> document;
+  JsonObject out = document.to<JsonObject>();
+  TEST_ASSERT_NULL(decodeHex(DECODER_MANUFACTURER, 0x0059, "0102030405", out));
+  TEST_ASSERT_NULL(decodeHex(DECODER_SERVICE_DATA, 0x004C, "0215", out));
+  TEST_ASSERT_EQUAL(0, out.size());
+}
+
+void test_ibeacon()
+{
+  StaticJsonDocument<512> document;
+  JsonObject out = document.to<JsonObject>();
+  const Decoder *decoder = decodeHex(DECODER_MANUFACTURER, 0x004C, "0215E2C56DB5DFFB48D2B060D0F5A71096E000010002C5", out);
+  TEST_ASSERT_NOT_NULL(decoder);
+  TEST_ASSERT_EQUAL_STRING("ibeacon", out["format"]);
+  TEST_ASSERT_EQUAL_STRING("e2c56db5-dffb-48d2-b060-d0f5a71096e0", out["uuid"]);
+  TEST_ASSERT_EQUAL(1, out["major"].as<int>());
+  TEST_ASSERT_EQUAL(2, out["minor"].as<int>());
+  TEST_ASSERT_EQUAL(-59, out["txPower"].as<int>());
+}
+
+void test_apple_not_ibeacon()
+{
+  // Apple nearby info, same company identifier
+  StaticJsonDocument<512> document;
+  JsonObject out = document.to<JsonObject>();
+  TEST_ASSERT_NULL(decodeHex(DECODER_MANUFACTURER, 0x004C, "1005011C1E4E7A", out));
+  TEST_ASSERT_EQUAL(0, out.size());
+}
+
+void test_ruuvi_valid()
+{
+  // test vectors of the Ruuvi data format 5 specification
+  StaticJsonDocument<512> document;
+  JsonObject out = document.to<JsonObject>();
+  TEST_ASSERT_NOT_NULL(decodeHex(DECODER_MANUFACTURER, 0x0499, "0512FC5394C37C0004FFFC040CAC364200CDCBB8334C884F", out));
+  TEST_ASSERT_EQUAL_STRING("ruuvi", out["format"]);
+  TEST_ASSERT_FLOAT_WITHIN(0.001, 24.3, out["temperature"].as<float>());
+  TEST_ASSERT_FLOAT_WITHIN(0.001, 53.49, out["humidity"].as<float>());
+  TEST_ASSERT_EQUAL(100044, out["pressure"].as<long>());
+  TEST_ASSERT_EQUAL(4, out["acceleration"][0].as<int>());
+  TEST_ASSERT_EQUAL(-4, out["acceleration"][1].as<int>());
+  TEST_ASSERT_EQUAL(1036, out["acceleration"][2].as<int>());
+  TEST_ASSERT_EQUAL(2977, out["battery"].as<int>());
+  TEST_ASSERT_EQUAL(4, out["txPower"].as<int>());
+  TEST_ASSERT_EQUAL(66, out["movements"].as<int>());
+  TEST_ASSERT_EQUAL(205, out["sequence"].as<int>());
+}
+
+void test_ruuvi_limits()
+{
+  StaticJsonDocument<512> document;
+  JsonObject out = document.to<JsonObject>();
+  TEST_ASSERT_NOT_NULL(decodeHex(DECODER_MANUFACTURER, 0x0499, "057FFFFFFEFFFE7FFF7FFF7FFFFFDEFEFFFECBB8334C884F", out));
+  TEST_ASSERT_FLOAT_WITHIN(0.001, 163.835, out["temperature"].as<float>());
+  TEST_ASSERT_FLOAT_WITHIN(0.001, 163.835, out["humidity"].as<float>());
+  TEST_ASSERT_EQUAL(115534, out["pressure"].as<long>());
+  TEST_ASSERT_EQUAL(32767, out["acceleration"][0].as<int>());
+  TEST_ASSERT_EQUAL(3646, out["battery"].as<int>());
+  TEST_ASSERT_EQUAL(20, out["txPower"].as<int>());
+  TEST_ASSERT_EQUAL(254, out["movements"].as<int>());
+  TEST_ASSERT_EQUAL(65534, out["sequence"].as<long>());
+
+  out = document.to<JsonObject>();
+  TEST_ASSERT_NOT_NULL(decodeHex(DECODER_MANUFACTURER, 0x0499, "058001000000008001800180010000000000CBB8334C884F", out));
+  TEST_ASSERT_FLOAT_WITHIN(0.001, -163.835, out["temperature"].as<float>());
+  TEST_ASSERT_FLOAT_WITHIN(0.001, 0, out["humidity"].as<float>());
+  TEST_ASSERT_EQUAL(50000, out["pressure"].as<long>());
+  TEST_ASSERT_EQUAL(-32767, out["acceleration"][2].as<int>());
+  TEST_ASSERT_EQUAL(1600, out["battery"].as<int>());
+  TEST_ASSERT_EQUAL(-40, out["txPower"].as<int>());
+}
+
+void test_ruuvi_invalid()
+{
+  // every field holds its "not available" value
+  StaticJsonDocument<512> document;
+  JsonObject out = document.to<JsonObject>();
+  TEST_ASSERT_NOT_NULL(decodeHex(DECODER_MANUFACTURER, 0x0499, "058000FFFFFFFF800080008000FFFFFFFFFFFFFFFFFFFFFF", out));
+  TEST_ASSERT_EQUAL_STRING("ruuvi", out["format"]);
+  TEST_ASSERT_EQUAL(1, out.size());
+}
+
+void test_ruuvi_truncated()
+{
+  StaticJsonDocument<512> document;
+  JsonObject out = document.to<JsonObject>();
+  TEST_ASSERT_NULL(decodeHex(DECODER_MANUFACTURER, 0x0499, "0512FC5394C37C0004", out));
+  // data format 3 is not decoded
+  TEST_ASSERT_NULL(decodeHex(DECODER_MANUFACTURER, 0x0499, "03291A1ECE1EFC18F94202CA0B53", out));
+  TEST_ASSERT_EQUAL(0, out.size());
+}
+
+void test_eddystone_uid()
+{
+  StaticJsonDocument<512> document;
+  JsonObject out = document.to<JsonObject>();
+  TEST_ASSERT_NOT_NULL(decodeHex(DECODER_SERVICE_DATA, 0xFEAA, "00E700010203040506070809AABBCCDDEEFF0000", out));
+  TEST_ASSERT_EQUAL_STRING("eddystone", out["format"]);
+  TEST_ASSERT_EQUAL_STRING("uid", out["frame"]);
+  TEST_ASSERT_EQUAL(-25, out["txPower"].as<int>());
+  TEST_ASSERT_EQUAL_STRING("00010203040506070809", out["namespace"]);
+  TEST_ASSERT_EQUAL_STRING("AABBCCDDEEFF", out["instance"]);
+}
+
+void test_eddystone_url()
+{
+  StaticJsonDocument<512> document;
+  JsonObject out = document.to<JsonObject>();
+  TEST_ASSERT_NOT_NULL(decodeHex(DECODER_SERVICE_DATA, 0xFEAA, "10EB03676F6F2E676C2F53367A543650", out));
+  TEST_ASSERT_EQUAL_STRING("url", out["frame"]);
+  TEST_ASSERT_EQUAL(-21, out["txPower"].as<int>());
+  TEST_ASSERT_EQUAL_STRING("https://goo.gl/S6zT6P", out["url"]);
+
+  out = document.to<JsonObject>();
+  TEST_ASSERT_NOT_NULL(decodeHex(DECODER_SERVICE_DATA, 0xFEAA, "10EC0167697468756207", out));
+  TEST_ASSERT_EQUAL_STRING("https://www.github.com", out["url"]);
+
+  // control characters are not part of a URL
+  out = document.to<JsonObject>();
+  TEST_ASSERT_NULL(decodeHex(DECODER_SERVICE_DATA, 0xFEAA, "10EC016769741F", out));
+}
+
+void test_eddystone_tlm()
+{
+  StaticJsonDocument<512> document;
+  JsonObject out = document.to<JsonObject>();
+  TEST_ASSERT_NOT_NULL(decodeHex(DECODER_SERVICE_DATA, 0xFEAA, "20000BB81380000004D2000004D2", out));
+  TEST_ASSERT_EQUAL_STRING("tlm", out["frame"]);
+  TEST_ASSERT_EQUAL(3000, out["battery"].as<int>());
+  TEST_ASSERT_FLOAT_WITHIN(0.001, 19.5, out["temperature"].as<float>());
+  TEST_ASSERT_EQUAL(1234, out["advCount"].as<long>());
+  TEST_ASSERT_EQUAL(123, out["uptime"].as<long>());
+
+  // temperature not supported by the beacon
+  out = document.to<JsonObject>();
+  TEST_ASSERT_NOT_NULL(decodeHex(DECODER_SERVICE_DATA, 0xFEAA, "20000BB88000000004D2000004D2", out));
+  TEST_ASSERT_FALSE(out.containsKey("temperature"));
+}
+
+void test_atc()
+{
+  StaticJsonDocument<512> document;
+  JsonObject out = document.to<JsonObject>();
+  TEST_ASSERT_NOT_NULL(decodeHex(DECODER_SERVICE_DATA, 0x181A, "A4C13801020300E63C5A0B9A2A", out));
+  TEST_ASSERT_EQUAL_STRING("atc", out["format"]);
+  TEST_ASSERT_FLOAT_WITHIN(0.001, 23.0, out["temperature"].as<float>());
+  TEST_ASSERT_EQUAL(60, out["humidity"].as<int>());
+  TEST_ASSERT_EQUAL(90, out["batteryLevel"].as<int>());
+  TEST_ASSERT_EQUAL(2970, out["battery"].as<int>());
+  TEST_ASSERT_EQUAL(42, out["counter"].as<int>());
+  TEST_ASSERT_FALSE(out.containsKey("flags"));
+}
+
+void test_pvvx()
+{
+  StaticJsonDocument<512> document;
+  JsonObject out = document.to<JsonObject>();
+  TEST_ASSERT_NOT_NULL(decodeHex(DECODER_SERVICE_DATA, 0x181A, "03020138C1A429097C179A0B5A2A05", out));
+  TEST_ASSERT_EQUAL_STRING("atc", out["format"]);
+  TEST_ASSERT_FLOAT_WITHIN(0.001, 23.45, out["temperature"].as<float>());
+  TEST_ASSERT_FLOAT_WITHIN(0.001, 60.12, out["humidity"].as<float>());
+  TEST_ASSERT_EQUAL(2970, out["battery"].as<int>());
+  TEST_ASSERT_EQUAL(90, out["batteryLevel"].as<int>());
+  TEST_ASSERT_EQUAL(42, out["counter"].as<int>());
+  TEST_ASSERT_EQUAL(5, out["flags"].as<int>());
+
+  // below zero
+  out = document.to<JsonObject>();
+  TEST_ASSERT_NOT_NULL(decodeHex(DECODER_SERVICE_DATA, 0x181A, "03020138C1A40BFE7C179A0B5A2A05", out));
+  TEST_ASSERT_FLOAT_WITHIN(0.001, -5.01, out["temperature"].as<float>());
+
+  // neither the ATC1441 nor the pvvx length
+  out = document.to<JsonObject>();
+  TEST_ASSERT_NULL(decodeHex(DECODER_SERVICE_DATA, 0x181A, "03020138C1A429097C179A0B5A2A", out));
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_unknown_key);
+  RUN_TEST(test_ibeacon);
+  RUN_TEST(test_apple_not_ibeacon);
+  RUN_TEST(test_ruuvi_valid);
+  RUN_TEST(test_ruuvi_limits);
+  RUN_TEST(test_ruuvi_invalid);
+  RUN_TEST(test_ruuvi_truncated);
+  RUN_TEST(test_eddystone_uid);
+  RUN_TEST(test_eddystone_url);
+  RUN_TEST(test_eddystone_tlm);
+  RUN_TEST(test_atc);
+  RUN_TEST(test_pvvx);
+  return UNITY_END();
+}
@@ -0,0 +1,149 @@
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+#include <ArduinoJson.h>
+#include "wire_format.h"
+
+#define BENCH_ROUNDS 20000
+
+static const uint8_t value[20] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A,
+                                  0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x12, 0x13, 0x14};
+
+/**
+ * read reply or notification, as built by NobleApi::setCharacteristicValue
+ */
+static void buildRead(JsonDocument &command, bool packed, bool notification)
+{
+  command["type"] = "read";
+  command["peripheralUuid"] = "a4c1382f5d1e";
+  command["serviceUuid"] = "ebe0ccb07a0a4b0c8a1a6ff2997da3a6";
+  command["characteristicUuid"] = "ebe0ccc17a0a4b0c8a1a6ff2997da3a6";
+  WireFormat::setBinary(command["data"], value, sizeof(value), packed);
+  command["isNotification"] = notification;
+  if (notification)
+  {
+    command["seq"] = 123456;
+    command["ts"] = 98765432;
+  }
+}
+
+/**
+ * discover event as built by NobleApi::onBLEDeviceFound, it has no binary field
+ */
+static void buildDiscover(JsonDocument &command)
+{
+  command["type"] = "discover";
+  command["peripheralUuid"] = "a4c1382f5d1e";
+  command["address"] = "a4:c1:38:2f:5d:1e";
+  command["addressType"] = "public";
+  command["connectable"] = "true";
+  command["rssi"] = -67;
+  command["advertisement"]["localName"] = "LYWSD03MMC";
+  command["advertisement"]["manufacturerData"] = "4C000215E2C56DB5DFFB48D2B060D0F5A71096E000010002C5";
+}
+
+/**
+ * Bytes and serialization time of one message in both encodings, MessagePack must not be larger
+ */
+static void compare(const char *name, void (*build)(JsonDocument &command, bool packed))
+{
+  StaticJsonDocument<512> text;
+  StaticJsonDocument<512> packed;
+  build(text, false);
+  build(packed, true);
+  char out[512];
+  size_t textBytes = serializeJson(text, out, sizeof(out));
+  size_t packedBytes = serializeMsgPack(packed, out, sizeof(out));
+  TEST_ASSERT_TRUE(packedBytes <= textBytes);
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < BENCH_ROUNDS; i++)
+  {
+    text.clear();
+    build(text, false);
+    serializeJson(text, out, sizeof(out));
+  }
+  auto middle = std::chrono::steady_clock::now();
+  for (int i = 0; i < BENCH_ROUNDS; i++)
+  {
+    packed.clear();
+    build(packed, true);
+    serializeMsgPack(packed, out, sizeof(out));
+  }
+  auto end = std::chrono::steady_clock::now();
+  printf("%-8s json %3u bytes %5lld ns, msgpack %3u bytes %5lld ns\n", name,
+         (unsigned)textBytes, (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(middle - start).count() / BENCH_ROUNDS,
+         (unsigned)packedBytes, (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(end - middle).count() / BENCH_ROUNDS);
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_hex_field()
+{
+  StaticJsonDocument<128> document;
+  WireFormat::setBinary(document["data"], value, 3, false);
+  char out[64];
+  serializeJson(document, out, sizeof(out));
+  TEST_ASSERT_EQUAL_STRING("{\"data\":\"010203\"}", out);
+}
+
+void test_bin_field()
+{
+  StaticJsonDocument<128> document;
+  WireFormat::setBinary(document["data"], value, 3, true);
+  uint8_t out[64];
+  size_t length = serializeMsgPack(document, out, sizeof(out));
+  const uint8_t expected[] = {0x81, 0xA4, 'd', 'a', 't', 'a', 0xC4, 0x03, 0x01, 0x02, 0x03};
+  TEST_ASSERT_EQUAL(sizeof(expected), length);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, out, sizeof(expected));
+}
+
+void test_bin16_field()
+{
+  uint8_t data[300];
+  memset(data, 0xAB, sizeof(data));
+  DynamicJsonDocument document(1024);
+  WireFormat::setBinary(document["d"], data, sizeof(data), true);
+  uint8_t out[400];
+  size_t length = serializeMsgPack(document, out, sizeof(out));
+  // fixmap, fixstr "d", bin 16 with a big endian length
+  TEST_ASSERT_EQUAL(3 + 3 + sizeof(data), length);
+  TEST_ASSERT_EQUAL_HEX8(0xC5, out[3]);
+  TEST_ASSERT_EQUAL_HEX8(0x01, out[4]);
+  TEST_ASSERT_EQUAL_HEX8(0x2C, out[5]);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(data, out + 6, sizeof(data));
+}
+
+void test_bench_read()
+{
+  compare("read", [](JsonDocument &command, bool packed) { buildRead(command, packed, false); });
+}
+
+void test_bench_notify()
+{
+  compare("notify", [](JsonDocument &command, bool packed) { buildRead(command, packed, true); });
+}
+
+void test_bench_discover()
+{
+  compare("discover", [](JsonDocument &command, bool packed) { buildDiscover(command); });
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_hex_field);
+  RUN_TEST(test_bin_field);
+  RUN_TEST(test_bin16_field);
+  RUN_TEST(test_bench_read);
+  RUN_TEST(test_bench_notify);
+  RUN_TEST(test_bench_discover);
+  return UNITY_END();
+}
@@ -0,0 +1,172 @@
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+#include "hex.h"
+
+#define BENCH_ROUNDS 20000
+#define BENCH_BYTES 244 // longest value of a 247 byte ATT MTU
+
+/**
+ * Security::fromHex before the codec, strtoul on a 3 byte string per byte, kept as benchmark baseline
+ */
+static size_t legacyFromHex(const char *data, size_t dataLength, uint8_t *out)
+{
+  size_t outLen = dataLength / 2;
+  char tmp[3];
+  tmp[2] = '\0';
+  for (size_t i = 0; i < outLen; i++)
+  {
+    tmp[0] = data[i * 2];
+    tmp[1] = data[i * 2 + 1];
+    out[i] = strtoul(tmp, NULL, 16);
+  }
+  return outLen;
+}
+
+/**
+ * Security::toHex before the codec, branchy nibble conversion, kept as benchmark baseline
+ */
+static size_t legacyToHex(const uint8_t *data, size_t dataLength, char *out)
+{
+  for (size_t i = 0; i < dataLength; i++)
+  {
+    uint8_t nib1 = (data[i] >> 4) & 0x0F;
+    uint8_t nib2 = (data[i] >> 0) & 0x0F;
+    out[i * 2 + 0] = nib1 < 0xA ? '0' + nib1 : 'A' + nib1 - 0xA;
+    out[i * 2 + 1] = nib2 < 0xA ? '0' + nib2 : 'A' + nib2 - 0xA;
+  }
+  out[dataLength * 2] = '\0';
+  return dataLength * 2 + 1;
+}
+
+static long long nsPerRound(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+  return (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / BENCH_ROUNDS;
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_encode()
+{
+  const uint8_t data[] = {0x00, 0x01, 0x7F, 0x80, 0xAB, 0xFF};
+  char out[sizeof(data) * 2 + 1];
+  TEST_ASSERT_EQUAL(12, Hex::encode(data, sizeof(data), out));
+  TEST_ASSERT_EQUAL_STRING("00017F80ABFF", out);
+  TEST_ASSERT_EQUAL(0, Hex::encode(data, 0, out));
+  TEST_ASSERT_EQUAL_STRING("", out);
+}
+
+void test_decode_both_cases()
+{
+  uint8_t out[6];
+  TEST_ASSERT_TRUE(Hex::decode("00017f80AbfF", 12, out));
+  const uint8_t expected[] = {0x00, 0x01, 0x7F, 0x80, 0xAB, 0xFF};
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, out, sizeof(expected));
+  TEST_ASSERT_EQUAL(6, Hex::decodedLength(12));
+}
+
+void test_decode_rejects()
+{
+  uint8_t out[8];
+  // odd length
+  TEST_ASSERT_FALSE(Hex::decode("ABC", 3, out));
+  TEST_ASSERT_FALSE(Hex::isValid("ABC", 3));
+  // bad character in the word at a time part and in the tail
+  TEST_ASSERT_FALSE(Hex::decode("0011G233", 8, out));
+  TEST_ASSERT_FALSE(Hex::decode("00112233445x", 12, out));
+  TEST_ASSERT_FALSE(Hex::isValid("0g", 2));
+  TEST_ASSERT_FALSE(Hex::decode("00 1", 4, out));
+  TEST_ASSERT_TRUE(Hex::isValid("00aF", 4));
+}
+
+void test_decode_in_place()
+{
+  char buffer[] = "0102030405060708090A";
+  TEST_ASSERT_TRUE(Hex::decode(buffer, 20, (uint8_t *)buffer));
+  const uint8_t expected[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, (uint8_t *)buffer, sizeof(expected));
+}
+
+void test_round_trip()
+{
+  uint8_t data[256];
+  for (int i = 0; i < 256; i++)
+  {
+    data[i] = i;
+  }
+  // every length exercises the word and tail paths
+  for (size_t length = 0; length <= sizeof(data); length++)
+  {
+    char text[sizeof(data) * 2 + 1];
+    char legacy[sizeof(data) * 2 + 1];
+    uint8_t out[sizeof(data)];
+    Hex::encode(data, length, text);
+    legacyToHex(data, length, legacy);
+    TEST_ASSERT_EQUAL_STRING(legacy, text);
+    TEST_ASSERT_TRUE(Hex::decode(text, length * 2, out));
+    TEST_ASSERT_EQUAL_MEMORY(data, out, length);
+  }
+}
+
+void test_bench()
+{
+  uint8_t data[BENCH_BYTES];
+  char text[BENCH_BYTES * 2 + 1];
+  uint8_t out[BENCH_BYTES];
+  for (int i = 0; i < BENCH_BYTES; i++)
+  {
+    data[i] = i * 37;
+  }
+  volatile uint8_t sink = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < BENCH_ROUNDS; i++)
+  {
+    legacyToHex(data, BENCH_BYTES, text);
+    sink ^= text[i % BENCH_BYTES];
+  }
+  auto legacyEncoded = std::chrono::steady_clock::now();
+  for (int i = 0; i < BENCH_ROUNDS; i++)
+  {
+    Hex::encode(data, BENCH_BYTES, text);
+    sink ^= text[i % BENCH_BYTES];
+  }
+  auto encoded = std::chrono::steady_clock::now();
+  for (int i = 0; i < BENCH_ROUNDS; i++)
+  {
+    legacyFromHex(text, BENCH_BYTES * 2, out);
+    sink ^= out[i % BENCH_BYTES];
+  }
+  auto legacyDecoded = std::chrono::steady_clock::now();
+  for (int i = 0; i < BENCH_ROUNDS; i++)
+  {
+    Hex::decode(text, BENCH_BYTES * 2, out);
+    sink ^= out[i % BENCH_BYTES];
+  }
+  auto decoded = std::chrono::steady_clock::now();
+  TEST_ASSERT_EQUAL_MEMORY(data, out, BENCH_BYTES);
+
+  printf("%u bytes: encode %lld ns (before %lld ns), decode %lld ns (before %lld ns)\n", BENCH_BYTES,
+         nsPerRound(legacyEncoded, encoded), nsPerRound(start, legacyEncoded),
+         nsPerRound(legacyDecoded, decoded), nsPerRound(encoded, legacyDecoded));
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_encode);
+  RUN_TEST(test_decode_both_cases);
+  RUN_TEST(test_decode_rejects);
+  RUN_TEST(test_decode_in_place);
+  RUN_TEST(test_round_trip);
+  RUN_TEST(test_bench);
+  return UNITY_END();
+}